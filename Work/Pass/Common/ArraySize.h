@@ -0,0 +1,302 @@
+#ifndef ARRAYSIZE_H
+#define ARRAYSIZE_H
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Metadata.h"
+#include <map>
+#include <set>
+#include <vector>
+
+using namespace llvm;
+
+//Tracks the number of elements behind pointers returned by heap allocation calls.
+//
+//The element count of each allocation is computed right after the call. Pointers are
+//followed through casts and through stack slots (the -O0 form of a pointer variable).
+//Each tracked slot gets a shadow ".size" slot that is written next to every store into it,
+//so the size can be loaded anywhere the pointer is loaded. The shadow slots and counts are
+//tagged with "arraysize" metadata so later passes can find them again without redoing the work.
+struct ArraySize
+{
+	std::map<Value*, Value*> sizeValue;		//pointer value -> element count
+	std::map<Value*, AllocaInst*> sizeSlot;		//pointer slot -> slot holding the element count
+	std::set<Value*> sizeSlots;			//all shadow slots
+
+	//Find the byte count of a heap allocation call, NULL if it is not one
+	static Value* getAllocatedBytes(CallInst* call, Instruction* insertBefore)
+	{
+		Function* callee = call->getCalledFunction();
+		if (callee == NULL){
+			return NULL;
+		}
+
+		StringRef name = callee->getName();
+		if (name == "malloc" || name == "_Znam" || name == "_Znaj" || name == "_Znwm" || name == "_Znwj"){
+			return call->getArgOperand(0);
+		}
+		if (name == "realloc"){
+			return call->getArgOperand(1);
+		}
+		if (name == "calloc"){
+			Value* count = call->getArgOperand(0);
+			Value* elementSize = call->getArgOperand(1);
+			if (insertBefore == NULL){
+				return count;		//only asking whether it is an allocation
+			}
+			return BinaryOperator::CreateMul(count, elementSize, "callocbytes", insertBefore);
+		}
+		return NULL;
+	}
+
+	static bool isAllocationCall(CallInst* call)
+	{
+		return getAllocatedBytes(call, NULL) != NULL;
+	}
+
+	//Compute the element count of an allocation viewed as a pointer to elementType
+	Value* createCount(CallInst* call, Instruction* pointer, Type* elementType)
+	{
+		//Insert right after the pointer so the count dominates every use of it
+		BasicBlock::iterator insertPoint = pointer;
+		insertPoint++;
+		while (isa<PHINode>(insertPoint)){
+			insertPoint++;
+		}
+
+		Value* bytes = getAllocatedBytes(call, insertPoint);
+		Constant* elementSize = ConstantExpr::getSizeOf(elementType);
+		elementSize = ConstantExpr::getTruncOrBitCast(elementSize, bytes->getType());
+
+		Instruction* count = BinaryOperator::CreateUDiv(bytes, elementSize, Twine(pointer->getName() + "elements"), insertPoint);
+		count->setMetadata("arraysize", MDNode::get(pointer->getContext(), pointer));
+		sizeValue[pointer] = count;
+
+		return count;
+	}
+
+	//A slot can only be tracked if every value stored into it has a known size and its address does not escape
+	bool isTrackable(AllocaInst* slot)
+	{
+		if (!slot->getAllocatedType()->isPointerTy()){
+			return false;
+		}
+
+		int numStores = 0;
+		for (Value::use_iterator u = slot->use_begin(); u != slot->use_end(); ++u){
+			if (isa<LoadInst>(*u)){
+				continue;
+			}
+			StoreInst* store = dyn_cast<StoreInst>(*u);
+			if (store == NULL || store->getPointerOperand() != slot){
+				return false;		//address escapes
+			}
+			Value* stored = store->getValueOperand();
+			if (!isa<ConstantPointerNull>(stored) && sizeValue.find(stored) == sizeValue.end()){
+				return false;
+			}
+			numStores++;
+		}
+		return numStores > 0;
+	}
+
+	//Give the slot a shadow slot that mirrors the size of whatever pointer it holds
+	void shadowSlot(Function &F, AllocaInst* slot)
+	{
+		Type* countType = NULL;
+		for (Value::use_iterator u = slot->use_begin(); u != slot->use_end(); ++u){
+			if (StoreInst* store = dyn_cast<StoreInst>(*u)){
+				if (sizeValue.find(store->getValueOperand()) != sizeValue.end()){
+					countType = sizeValue[store->getValueOperand()]->getType();
+				}
+			}
+		}
+		if (countType == NULL){
+			return;		//only ever holds NULL
+		}
+
+		AllocaInst* shadow = new AllocaInst(countType, Twine(slot->getName() + ".size"), F.getEntryBlock().begin());
+		shadow->setMetadata("arraysize", MDNode::get(F.getContext(), slot));
+
+		//Mirror every store of the pointer with a store of its size
+		std::vector<StoreInst*> stores;
+		for (Value::use_iterator u = slot->use_begin(); u != slot->use_end(); ++u){
+			if (StoreInst* store = dyn_cast<StoreInst>(*u)){
+				stores.push_back(store);
+			}
+		}
+		for (unsigned i = 0; i < stores.size(); i++){
+			Value* stored = stores[i]->getValueOperand();
+			Value* count;
+			if (isa<ConstantPointerNull>(stored)){
+				count = ConstantInt::get(countType, 0);
+			}else{
+				count = sizeValue[stored];
+			}
+			BasicBlock::iterator after = stores[i];
+			after++;
+			new StoreInst(count, shadow, after);
+		}
+
+		sizeSlot[slot] = shadow;
+		sizeSlots.insert(shadow);
+	}
+
+	//Find the sizes created by an earlier run
+	void readMetadata(Function &F)
+	{
+		for (Function::iterator b = F.begin(); b != F.end(); ++b){
+			for (BasicBlock::iterator i = b->begin(); i != b->end(); ++i){
+				MDNode* N = i->getMetadata("arraysize");
+				if (N == NULL){
+					continue;
+				}
+				Value* pointer = N->getOperand(0);
+				if (AllocaInst* shadow = dyn_cast<AllocaInst>(i)){
+					sizeSlot[pointer] = shadow;
+					sizeSlots.insert(shadow);
+				}else{
+					sizeValue[pointer] = i;
+				}
+			}
+		}
+	}
+
+	//Build the size maps. If materialize is false, only sizes already in the IR are used
+	void run(Function &F, bool materialize)
+	{
+		sizeValue.clear();
+		sizeSlot.clear();
+		sizeSlots.clear();
+
+		readMetadata(F);
+		if (!materialize){
+			return;
+		}
+
+		//Compute the count for each allocation, once per type it is viewed as
+		std::vector<CallInst*> calls;
+		for (Function::iterator b = F.begin(); b != F.end(); ++b){
+			for (BasicBlock::iterator i = b->begin(); i != b->end(); ++i){
+				if (CallInst* call = dyn_cast<CallInst>(i)){
+					if (isAllocationCall(call)){
+						calls.push_back(call);
+					}
+				}
+			}
+		}
+		for (unsigned c = 0; c < calls.size(); c++){
+			CallInst* call = calls[c];
+
+			std::vector<BitCastInst*> casts;
+			bool usedAsBytes = false;
+			for (Value::use_iterator u = call->use_begin(); u != call->use_end(); ++u){
+				if (BitCastInst* cast = dyn_cast<BitCastInst>(*u)){
+					casts.push_back(cast);
+				}else{
+					usedAsBytes = true;
+				}
+			}
+
+			//Used directly as a byte buffer
+			if (usedAsBytes && sizeValue.find(call) == sizeValue.end()){
+				createCount(call, call, Type::getInt8Ty(F.getContext()));
+			}
+			for (unsigned i = 0; i < casts.size(); i++){
+				PointerType* pt = dyn_cast<PointerType>(casts[i]->getType());
+				if (pt && sizeValue.find(casts[i]) == sizeValue.end()){
+					createCount(call, casts[i], pt->getElementType());
+				}
+			}
+		}
+
+		//Follow the pointers through the stack slots holding them
+		for (BasicBlock::iterator i = F.getEntryBlock().begin(); i != F.getEntryBlock().end(); ++i){
+			if (AllocaInst* slot = dyn_cast<AllocaInst>(i)){
+				if (sizeSlot.find(slot) == sizeSlot.end() && sizeSlots.find(slot) == sizeSlots.end() && isTrackable(slot)){
+					shadowSlot(F, slot);
+				}
+			}
+		}
+	}
+
+	//Get the element count of the memory pointer points to, usable right before insertBefore
+	Value* getSize(Value* pointer, Instruction* insertBefore)
+	{
+		if (sizeValue.find(pointer) != sizeValue.end()){
+			return sizeValue[pointer];
+		}
+		if (LoadInst* load = dyn_cast<LoadInst>(pointer)){
+			Value* slot = load->getPointerOperand();
+			if (sizeSlot.find(slot) != sizeSlot.end()){
+				return new LoadInst(sizeSlot[slot], "heapsize", insertBefore);
+			}
+		}
+		return NULL;
+	}
+
+	//Counts are unsigned divisions of the allocated bytes, so they are never negative
+	bool isNonNegative(Value* size)
+	{
+		if (ZExtInst* zext = dyn_cast<ZExtInst>(size)){
+			size = zext->getOperand(0);
+		}
+		if (LoadInst* load = dyn_cast<LoadInst>(size)){
+			return sizeSlots.find(load->getPointerOperand()) != sizeSlots.end();
+		}
+		if (Instruction* inst = dyn_cast<Instruction>(size)){
+			return inst->getMetadata("arraysize") != NULL;
+		}
+		return false;
+	}
+
+	bool isSizeSlot(Value* slot)
+	{
+		return sizeSlots.find(slot) != sizeSlots.end();
+	}
+
+	//Two sizes are the same if they are the same value, or loads of one shadow slot with no store between them
+	bool sameSize(Value* first, Value* second)
+	{
+		if (first == second){
+			return true;
+		}
+
+		LoadInst* firstLoad = dyn_cast<LoadInst>(first);
+		LoadInst* secondLoad = dyn_cast<LoadInst>(second);
+		if (firstLoad == NULL || secondLoad == NULL){
+			return false;
+		}
+		Value* slot = firstLoad->getPointerOperand();
+		if (slot != secondLoad->getPointerOperand() || !isSizeSlot(slot)){
+			return false;
+		}
+		if (firstLoad->getParent() != secondLoad->getParent()){
+			return false;
+		}
+
+		//Make sure nothing was stored to the slot between the two loads
+		bool between = false;
+		for (BasicBlock::iterator i = firstLoad->getParent()->begin(); i != firstLoad->getParent()->end(); ++i){
+			if (&*i == firstLoad || &*i == secondLoad){
+				if (between){
+					return true;
+				}
+				between = true;
+				continue;
+			}
+			if (between){
+				if (StoreInst* store = dyn_cast<StoreInst>(i)){
+					if (store->getPointerOperand() == slot){
+						return false;
+					}
+				}
+			}
+		}
+		return false;
+	}
+};
+
+#endif
@@ -0,0 +1,252 @@
+#ifndef CLONEDREGION_H
+#define CLONEDREGION_H
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/CFG.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+#include <map>
+#include <set>
+#include <vector>
+
+using namespace llvm;
+
+//A copy of a set of blocks, entered from the head of the region.
+//
+//Every original block and instruction is put in one hashed ValueToValueMap with its copy as it is cloned, then
+//each copied instruction is remapped once: operands, the successors of any terminator, the incoming blocks of
+//phis and function-local debug metadata all go through the same lookup, so a copy takes time linear in its
+//size. Values from outside the region are left as they are. The copy starts with no way in; enterFrom sends
+//one predecessor of the head to it. A copy that later passes leave the same as the original can be merged back
+//into it.
+struct ClonedRegion
+{
+	BasicBlock* head;
+	std::vector<BasicBlock*> originals;
+	std::vector<BasicBlock*> clones;		//in the order of originals
+	std::set<BasicBlock*> cloneSet;
+	ValueToValueMapTy valueMap;		//original -> copy, for every block and instruction of the region
+
+	void clone(BasicBlock* headIn, const std::vector<BasicBlock*> &blocks, const Twine &suffix)
+	{
+		head = headIn;
+		Function* F = head->getParent();
+		for(unsigned b = 0; b < blocks.size(); b++)
+		{
+			BasicBlock* copy = CloneBasicBlock(blocks[b], valueMap, suffix, F);
+			valueMap[blocks[b]] = copy;
+			originals.push_back(blocks[b]);
+			clones.push_back(copy);
+			cloneSet.insert(copy);
+		}
+
+		for(unsigned b = 0; b < clones.size(); b++)
+			for(BasicBlock::iterator i = clones[b]->begin(); i != clones[b]->end(); ++i)
+				RemapInstruction(i, valueMap, RF_IgnoreMissingEntries);
+
+		//Phis the region exits to get an entry for each copied block that now also comes in
+		std::set<BasicBlock*> exits;
+		for(unsigned b = 0; b < clones.size(); b++)
+			for(succ_iterator s = succ_begin(clones[b]); s != succ_end(clones[b]); ++s)
+				if(!isClone(*s)) exits.insert(*s);
+		for(std::set<BasicBlock*>::iterator e = exits.begin(); e != exits.end(); ++e)
+		{
+			for(BasicBlock::iterator i = (*e)->begin(); isa<PHINode>(i); ++i)
+			{
+				PHINode* phi = cast<PHINode>(i);
+				unsigned numIncoming = phi->getNumIncomingValues();
+				for(unsigned in = 0; in < numIncoming; in++)
+				{
+					ValueToValueMapTy::iterator from = valueMap.find(phi->getIncomingBlock(in));
+					if(from == valueMap.end()) continue;
+					phi->addIncoming(getCopy(phi->getIncomingValue(in)), cast<BasicBlock>(from->second));
+				}
+			}
+		}
+	}
+
+	bool isClone(BasicBlock* block)
+	{
+		return cloneSet.count(block) > 0;
+	}
+
+	//The copy of an original value, or the value itself if it is not in the region
+	Value* getCopy(Value* value)
+	{
+		ValueToValueMapTy::iterator found = valueMap.find(value);
+		return found == valueMap.end() ? value : (Value*)found->second;
+	}
+
+	BasicBlock* getCloneHead()
+	{
+		return cast<BasicBlock>(getCopy(head));
+	}
+
+	//Send every edge from pred to the head to the copy instead. The phis of the head lose pred, the phis of the
+	//copy keep only pred and the edges from inside the copy. Returns false if pred does not go to the head.
+	bool enterFrom(BasicBlock* pred)
+	{
+		BasicBlock* cloneHead = getCloneHead();
+		TerminatorInst* term = pred->getTerminator();
+		bool entered = false;
+		for(unsigned s = 0; s < term->getNumSuccessors(); s++)
+		{
+			if(term->getSuccessor(s) != head) continue;
+			term->setSuccessor(s, cloneHead);
+			entered = true;
+		}
+		if(!entered) return false;
+
+		for(BasicBlock::iterator i = head->begin(); isa<PHINode>(i); ++i)
+		{
+			PHINode* phi = cast<PHINode>(i);
+			PHINode* clonePhi = cast<PHINode>(getCopy(phi));
+			for(unsigned in = clonePhi->getNumIncomingValues(); in > 0; in--)
+				if(!isClone(clonePhi->getIncomingBlock(in - 1)))
+					clonePhi->removeIncomingValue(in - 1, false);
+			for(unsigned in = phi->getNumIncomingValues(); in > 0; in--)
+			{
+				if(phi->getIncomingBlock(in - 1) != pred) continue;
+				clonePhi->addIncoming(phi->getIncomingValue(in - 1), pred);
+				phi->removeIncomingValue(in - 1, false);
+			}
+		}
+		return true;
+	}
+
+	//The original a value of the copy stands for, or the value itself if it is not in the copy
+	static Value* getOriginal(Value* value, std::map<Value*, Value*> &toOriginal)
+	{
+		std::map<Value*, Value*>::iterator found = toOriginal.find(value);
+		return found == toOriginal.end() ? value : found->second;
+	}
+
+	//Is the copy still the same as the original: the same instructions in the same order, using the matching
+	//values of the copy, with nothing outside the copy using it but the predecessors entering its head and the
+	//phis it exits to. Instructions added since to both, by value numbering for one, are matched by position.
+	//Fills toOriginal with the original of each block and instruction of the copy
+	bool isUnchanged(std::map<Value*, Value*> &toOriginal)
+	{
+		if(clones.empty()) return false;
+		std::set<BasicBlock*> originalSet(originals.begin(), originals.end());
+		for(unsigned b = 0; b < clones.size(); b++)
+		{
+			if(clones[b]->size() != originals[b]->size()) return false;
+			toOriginal[clones[b]] = originals[b];
+			for(BasicBlock::iterator c = clones[b]->begin(), o = originals[b]->begin(); c != clones[b]->end(); ++c, ++o)
+				toOriginal[c] = o;
+		}
+
+		BasicBlock* cloneHead = getCloneHead();
+		std::set<BasicBlock*> exits;
+		for(unsigned b = 0; b < clones.size(); b++)
+		{
+			for(Value::use_iterator u = clones[b]->use_begin(); u != clones[b]->use_end(); ++u)
+			{
+				Instruction* user = dyn_cast<Instruction>(*u);
+				if(user == NULL) return false;
+				if(!isClone(user->getParent()) && (clones[b] != cloneHead || !isa<TerminatorInst>(user))) return false;
+			}
+			for(succ_iterator s = succ_begin(clones[b]); s != succ_end(clones[b]); ++s)
+				if(!isClone(*s)) exits.insert(*s);
+
+			for(BasicBlock::iterator c = clones[b]->begin(), o = originals[b]->begin(); c != clones[b]->end(); ++c, ++o)
+			{
+				for(Value::use_iterator u = c->use_begin(); u != c->use_end(); ++u)
+				{
+					Instruction* user = dyn_cast<Instruction>(*u);
+					if(user == NULL || (!isClone(user->getParent()) && !isa<PHINode>(user))) return false;
+				}
+
+				if(PHINode* phi = dyn_cast<PHINode>(c))
+				{
+					//Entries from outside the region stay with the copy of the head, and are moved back when merging
+					PHINode* originalPhi = dyn_cast<PHINode>(o);
+					if(originalPhi == NULL || phi->getType() != originalPhi->getType()) return false;
+					unsigned inRegion = 0;
+					for(unsigned in = 0; in < originalPhi->getNumIncomingValues(); in++)
+						if(originalSet.count(originalPhi->getIncomingBlock(in))) inRegion++;
+					for(unsigned in = 0; in < phi->getNumIncomingValues(); in++)
+					{
+						if(!isClone(phi->getIncomingBlock(in))) continue;
+						int found = originalPhi->getBasicBlockIndex(cast<BasicBlock>(toOriginal[phi->getIncomingBlock(in)]));
+						if(found == -1 || getOriginal(phi->getIncomingValue(in), toOriginal) != originalPhi->getIncomingValue(found)) return false;
+						inRegion--;
+					}
+					if(inRegion != 0) return false;
+					continue;
+				}
+
+				if(!c->isSameOperationAs(o)) return false;
+				for(unsigned op = 0; op < c->getNumOperands(); op++)
+					if(getOriginal(c->getOperand(op), toOriginal) != o->getOperand(op)) return false;
+			}
+		}
+
+		//The phis the region exits to must get the same from the copy as from the original
+		for(std::set<BasicBlock*>::iterator e = exits.begin(); e != exits.end(); ++e)
+		{
+			for(BasicBlock::iterator i = (*e)->begin(); isa<PHINode>(i); ++i)
+			{
+				PHINode* phi = cast<PHINode>(i);
+				for(unsigned in = 0; in < phi->getNumIncomingValues(); in++)
+				{
+					if(!isClone(phi->getIncomingBlock(in))) continue;
+					int found = phi->getBasicBlockIndex(cast<BasicBlock>(toOriginal[phi->getIncomingBlock(in)]));
+					if(found == -1 || getOriginal(phi->getIncomingValue(in), toOriginal) != phi->getIncomingValue(found)) return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	//Send the predecessors entering the copy back to the head and erase the copy. Only for a copy isUnchanged
+	//holds for, given the toOriginal it filled
+	void mergeBack(std::map<Value*, Value*> &toOriginal)
+	{
+		BasicBlock* cloneHead = getCloneHead();
+		for(BasicBlock::iterator i = cloneHead->begin(); isa<PHINode>(i); ++i)
+		{
+			PHINode* clonePhi = cast<PHINode>(i);
+			PHINode* phi = cast<PHINode>(toOriginal[clonePhi]);
+			for(unsigned in = 0; in < clonePhi->getNumIncomingValues(); in++)
+			{
+				if(isClone(clonePhi->getIncomingBlock(in))) continue;
+				phi->addIncoming(getOriginal(clonePhi->getIncomingValue(in), toOriginal), clonePhi->getIncomingBlock(in));
+			}
+		}
+
+		std::set<BasicBlock*> entering;
+		for(pred_iterator p = pred_begin(cloneHead); p != pred_end(cloneHead); ++p)
+			if(!isClone(*p)) entering.insert(*p);
+		for(std::set<BasicBlock*>::iterator p = entering.begin(); p != entering.end(); ++p)
+		{
+			TerminatorInst* term = (*p)->getTerminator();
+			for(unsigned s = 0; s < term->getNumSuccessors(); s++)
+				if(term->getSuccessor(s) == cloneHead) term->setSuccessor(s, head);
+		}
+		discard();
+	}
+
+	//Remove a copy that was never entered, with the phi entries it added
+	void discard()
+	{
+		for(unsigned b = 0; b < clones.size(); b++)
+		{
+			TerminatorInst* term = clones[b]->getTerminator();
+			for(unsigned s = 0; s < term->getNumSuccessors(); s++)
+				if(!isClone(term->getSuccessor(s)))
+					term->getSuccessor(s)->removePredecessor(clones[b], true);
+		}
+		for(unsigned b = 0; b < clones.size(); b++)
+			clones[b]->dropAllReferences();
+		for(unsigned b = 0; b < clones.size(); b++)
+			clones[b]->eraseFromParent();
+		originals.clear();
+		clones.clear();
+		cloneSet.clear();
+	}
+};
+
+#endif
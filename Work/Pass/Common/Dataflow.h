@@ -0,0 +1,226 @@
+#ifndef DATAFLOW_H
+#define DATAFLOW_H
+
+#include "llvm/IR/Function.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/SparseBitVector.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/Support/CFG.h"
+#include <map>
+#include <vector>
+#include <algorithm>
+
+using namespace llvm;
+
+//A gen/kill data flow problem over the blocks of a function, with one bit per fact.
+//
+//Forward problems flow from the predecessors of a block to its successors, backward ones the other way.
+//Intersect picks the meet: true for "on every path" problems (availability, busy expressions), which start
+//optimistically with every fact and lose the ones some path does not carry, false for "on some path" problems
+//(reaching definitions), which start empty. The user numbers the facts, fills the gen and kill of each block,
+//then solves. Blocks are swept in reverse postorder (postorder for backward problems) until nothing changes,
+//so each sweep carries facts through all the forward edges and only back edges need another one.
+//Blocks not reachable from the entry take no part.
+//
+//After an edit that leaves the values outside some blocks as they were, such as copying a region and sending
+//some of its entries to the copy, update solves again over those blocks alone.
+//
+//Bits is BitVector by default. "On some path" problems over many facts, few of which reach any one block, can
+//use SparseBitVector<> instead; it has no way to hold every fact, so it can not be used with Intersect.
+template <bool Forward, bool Intersect, class Bits = BitVector>
+struct Dataflow
+{
+	unsigned numBits;
+	std::vector<BasicBlock*> order;
+	std::map<BasicBlock*, unsigned> position;
+	std::vector<Bits> gen, kill, in, out;
+
+	//The value flowing in at the entry (forward) or out at the exits (backward)
+	Bits boundary;
+
+	//Number of sweeps the last solve took
+	int numSweeps;
+
+	void init(Function &F, unsigned numBitsIn)
+	{
+		numBits = numBitsIn;
+		order.clear();
+		position.clear();
+
+		ReversePostOrderTraversal<Function*> rpot(&F);
+		for(ReversePostOrderTraversal<Function*>::rpo_iterator itr = rpot.begin(); itr != rpot.end(); itr++)
+			order.push_back(*itr);
+		if(!Forward)
+			std::reverse(order.begin(), order.end());
+		for(unsigned i = 0; i < order.size(); i++)
+			position[order[i]] = i;
+
+		Bits empty, start;
+		makeSet(empty, numBits, false);
+		makeSet(start, numBits, Intersect);
+		gen.assign(order.size(), empty);
+		kill.assign(order.size(), empty);
+		in.assign(order.size(), start);
+		out.assign(order.size(), start);
+		boundary = empty;
+		numSweeps = 0;
+	}
+
+	//Add a block that did not exist or was not reachable when init ran, at the end of the order
+	void addBlock(BasicBlock* block)
+	{
+		Bits empty, start;
+		makeSet(empty, numBits, false);
+		makeSet(start, numBits, Intersect);
+		position[block] = order.size();
+		order.push_back(block);
+		gen.push_back(empty);
+		kill.push_back(empty);
+		in.push_back(start);
+		out.push_back(start);
+	}
+
+	static void makeSet(BitVector &bits, unsigned size, bool full) { bits = BitVector(size, full); }
+	static void makeSet(SparseBitVector<> &bits, unsigned size, bool full) { bits.clear(); }
+	static void subtract(BitVector &bits, const BitVector &other) { bits.reset(other); }
+	static void subtract(SparseBitVector<> &bits, const SparseBitVector<> &other) { bits.intersectWithComplement(other); }
+
+	bool reaches(BasicBlock* block)
+	{
+		return position.find(block) != position.end();
+	}
+
+	Bits &getGen(BasicBlock* block) { return gen[position[block]]; }
+	Bits &getKill(BasicBlock* block) { return kill[position[block]]; }
+	Bits &getIn(BasicBlock* block) { return in[position[block]]; }
+	Bits &getOut(BasicBlock* block) { return out[position[block]]; }
+
+	//The value on the side of the block facts flow in from: IN for forward problems, OUT for backward ones
+	Bits &before(unsigned b) { return Forward ? in[b] : out[b]; }
+	Bits &after(unsigned b) { return Forward ? out[b] : in[b]; }
+
+	//Meet of the values flowing into the block from its neighbours
+	void meet(unsigned b, Bits &result)
+	{
+		bool first = true;
+		BasicBlock* block = order[b];
+		if(Forward)
+		{
+			for(pred_iterator p = pred_begin(block); p != pred_end(block); ++p)
+				meetWith(result, *p, first);
+		}
+		else
+		{
+			for(succ_iterator s = succ_begin(block); s != succ_end(block); ++s)
+				meetWith(result, *s, first);
+		}
+		if(first)
+			result = boundary;
+	}
+
+	void meetWith(Bits &result, BasicBlock* neighbour, bool &first)
+	{
+		if(!reaches(neighbour)) return;
+		Bits &value = after(position[neighbour]);
+		if(first)
+			result = value;
+		else if(Intersect)
+			result &= value;
+		else
+			result |= value;
+		first = false;
+	}
+
+	//Solve again after the given blocks changed, keeping the value of every other block. The changed blocks start
+	//over from the initial value, and a worklist takes them and their neighbours until nothing changes
+	void update(std::vector<BasicBlock*> &changed)
+	{
+		Bits start;
+		makeSet(start, numBits, Intersect);
+		std::vector<bool> queued(order.size(), false);
+		std::vector<unsigned> worklist;
+		for(unsigned c = 0; c < changed.size(); c++)
+		{
+			if(!reaches(changed[c])) continue;
+			unsigned b = position[changed[c]];
+			before(b) = start;
+			after(b) = start;
+		}
+		for(unsigned c = 0; c < changed.size(); c++)
+		{
+			if(!reaches(changed[c])) continue;
+			queue(position[changed[c]], worklist, queued);
+			queueNext(position[changed[c]], worklist, queued);
+		}
+
+		Bits result;
+		while(!worklist.empty())
+		{
+			unsigned b = worklist.back();
+			worklist.pop_back();
+			queued[b] = false;
+
+			meet(b, result);
+			before(b) = result;
+			subtract(result, kill[b]);
+			result |= gen[b];
+			if(result != after(b))
+			{
+				after(b) = result;
+				queueNext(b, worklist, queued);
+			}
+		}
+	}
+
+	void queue(unsigned b, std::vector<unsigned> &worklist, std::vector<bool> &queued)
+	{
+		if(queued[b]) return;
+		queued[b] = true;
+		worklist.push_back(b);
+	}
+
+	//Queue the blocks the value of b flows on to
+	void queueNext(unsigned b, std::vector<unsigned> &worklist, std::vector<bool> &queued)
+	{
+		BasicBlock* block = order[b];
+		if(Forward)
+		{
+			for(succ_iterator s = succ_begin(block); s != succ_end(block); ++s)
+				if(reaches(*s)) queue(position[*s], worklist, queued);
+		}
+		else
+		{
+			for(pred_iterator p = pred_begin(block); p != pred_end(block); ++p)
+				if(reaches(*p)) queue(position[*p], worklist, queued);
+		}
+	}
+
+	void solve()
+	{
+		bool changed = true;
+		numSweeps = 0;
+		Bits result;
+		makeSet(result, numBits, false);
+		while(changed)
+		{
+			changed = false;
+			numSweeps++;
+			for(unsigned b = 0; b < order.size(); b++)
+			{
+				meet(b, result);
+				before(b) = result;
+
+				//after = gen + (before - kill)
+				subtract(result, kill[b]);
+				result |= gen[b];
+				if(result != after(b))
+				{
+					after(b) = result;
+					changed = true;
+				}
+			}
+		}
+	}
+};
+
+#endif
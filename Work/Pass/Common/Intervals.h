@@ -0,0 +1,536 @@
+#ifndef INTERVALS_H
+#define INTERVALS_H
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/Support/CFG.h"
+#include <map>
+#include <set>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+using namespace llvm;
+
+//A range of signed integers, empty when lo > hi
+struct Interval
+{
+	int64_t lo, hi;
+
+	Interval() : lo(1), hi(0) {}
+	Interval(int64_t loIn, int64_t hiIn) : lo(loIn), hi(hiIn) {}
+
+	bool isEmpty() const { return lo > hi; }
+	bool operator==(const Interval &other) const { return lo == other.lo && hi == other.hi; }
+	bool operator!=(const Interval &other) const { return !(*this == other); }
+
+	//Every value of an integer type with the given number of bits
+	static Interval full(unsigned bits)
+	{
+		if (bits >= 64){
+			return Interval(INT64_MIN, INT64_MAX);
+		}
+		return Interval(-((int64_t)1 << (bits - 1)), ((int64_t)1 << (bits - 1)) - 1);
+	}
+
+	//Values that wrapped around in a type of the given width could be anything in it
+	Interval fit(unsigned bits) const
+	{
+		Interval type = full(bits);
+		if (isEmpty() || (lo >= type.lo && hi <= type.hi)){
+			return *this;
+		}
+		return type;
+	}
+
+	Interval join(const Interval &other) const
+	{
+		if (isEmpty()) return other;
+		if (other.isEmpty()) return *this;
+		return Interval(std::min(lo, other.lo), std::max(hi, other.hi));
+	}
+
+	Interval meet(const Interval &other) const
+	{
+		return Interval(std::max(lo, other.lo), std::min(hi, other.hi));
+	}
+
+	//Bounds that keep moving go straight to the end of the type, so loops reach a fixed point
+	Interval widen(const Interval &next, unsigned bits) const
+	{
+		if (isEmpty()) return next;
+		if (next.isEmpty()) return *this;
+		Interval type = full(bits);
+		return Interval(next.lo < lo ? type.lo : lo, next.hi > hi ? type.hi : hi);
+	}
+
+	//Recover the bounds widening gave up on
+	Interval narrow(const Interval &next, unsigned bits) const
+	{
+		if (isEmpty() || next.isEmpty()) return next;
+		Interval type = full(bits);
+		return Interval(lo == type.lo ? next.lo : lo, hi == type.hi ? next.hi : hi);
+	}
+
+	//Saturating arithmetic, the result is fitted to the type afterwards
+	static int64_t add(int64_t a, int64_t b)
+	{
+		if (b > 0 && a > INT64_MAX - b) return INT64_MAX;
+		if (b < 0 && a < INT64_MIN - b) return INT64_MIN;
+		return a + b;
+	}
+
+	static int64_t mul(int64_t a, int64_t b)
+	{
+		if (a == 0 || b == 0) return 0;
+		bool negative = (a < 0) != (b < 0);
+		if (a == INT64_MIN || b == INT64_MIN) return negative ? INT64_MIN : INT64_MAX;
+		int64_t absA = a < 0 ? -a : a;
+		int64_t absB = b < 0 ? -b : b;
+		if (absA > INT64_MAX / absB) return negative ? INT64_MIN : INT64_MAX;
+		return a * b;
+	}
+
+	Interval operator+(const Interval &other) const
+	{
+		return Interval(add(lo, other.lo), add(hi, other.hi));
+	}
+
+	Interval operator-(const Interval &other) const
+	{
+		return Interval(add(lo, other.hi == INT64_MIN ? INT64_MAX : -other.hi), add(hi, other.lo == INT64_MIN ? INT64_MAX : -other.lo));
+	}
+
+	Interval operator*(const Interval &other) const
+	{
+		int64_t products[4] = {mul(lo, other.lo), mul(lo, other.hi), mul(hi, other.lo), mul(hi, other.hi)};
+		return Interval(*std::min_element(products, products + 4), *std::max_element(products, products + 4));
+	}
+};
+
+//Interval abstract interpretation of the integers in a function.
+//
+//Integer stack slots whose address never escapes are tracked through their loads and stores (the -O0 form of
+//a local variable), and are narrowed on the edges of branches that compare them. Loop heads are widened to
+//reach a fixed point, then a few narrowing passes win back the bounds the loop tests give. Every integer
+//value gets the range it can have where it is computed.
+struct Intervals
+{
+	typedef std::map<AllocaInst*, Interval> State;
+
+	std::set<AllocaInst*> slots;			//tracked stack slots
+	std::map<Value*, Interval> values;		//range of each integer value
+	std::map<BasicBlock*, State> inState;		//slot ranges at the start of each reached block
+	std::map<std::pair<BasicBlock*, BasicBlock*>, State> edgeState;	//slot ranges along each feasible edge
+	std::set<BasicBlock*> loopHeads;
+
+	static unsigned getBits(Value* value)
+	{
+		return cast<IntegerType>(value->getType())->getBitWidth();
+	}
+
+	static unsigned getSlotBits(AllocaInst* slot)
+	{
+		return cast<IntegerType>(slot->getAllocatedType())->getBitWidth();
+	}
+
+	//Only slots that are loaded and stored directly can be followed
+	static bool isTrackable(AllocaInst* slot)
+	{
+		if (slot->isArrayAllocation() || !slot->getAllocatedType()->isIntegerTy()){
+			return false;
+		}
+		for (Value::use_iterator u = slot->use_begin(); u != slot->use_end(); ++u){
+			if (isa<LoadInst>(*u)){
+				continue;
+			}
+			StoreInst* store = dyn_cast<StoreInst>(*u);
+			if (store == NULL || store->getPointerOperand() != slot){
+				return false;
+			}
+		}
+		return true;
+	}
+
+	//The range of a value, every value of its type if nothing is known
+	Interval get(Value* value)
+	{
+		if (ConstantInt* CI = dyn_cast<ConstantInt>(value)){
+			if (CI->getBitWidth() > 64){
+				return Interval::full(64);
+			}
+			return Interval(CI->getSExtValue(), CI->getSExtValue());
+		}
+		std::map<Value*, Interval>::iterator it = values.find(value);
+		if (it != values.end()){
+			return it->second;
+		}
+		//Casts added after the analysis, e.g. of sizes to the index type
+		if (CastInst* cast = dyn_cast<CastInst>(value)){
+			if (cast->getType()->isIntegerTy() && cast->getOperand(0)->getType()->isIntegerTy()){
+				return castRange(cast, get(cast->getOperand(0)));
+			}
+		}
+		if (!value->getType()->isIntegerTy()){
+			return Interval::full(64);
+		}
+		return Interval::full(getBits(value));
+	}
+
+	Interval castRange(CastInst* cast, Interval range)
+	{
+		unsigned bits = getBits(cast);
+		switch (cast->getOpcode()){
+		case Instruction::SExt:
+			return range;
+		case Instruction::ZExt:
+			if (range.lo >= 0){
+				return range;
+			}
+			if (getBits(cast->getOperand(0)) < 64){
+				return Interval(0, ((int64_t)1 << getBits(cast->getOperand(0))) - 1);
+			}
+			return Interval::full(bits);
+		case Instruction::Trunc:
+			return range.fit(bits);
+		}
+		return Interval::full(bits);
+	}
+
+	//Range of an instruction given the slot ranges before it
+	Interval transfer(Instruction* inst, State &state)
+	{
+		unsigned bits = getBits(inst);
+
+		if (LoadInst* load = dyn_cast<LoadInst>(inst)){
+			AllocaInst* slot = dyn_cast<AllocaInst>(load->getPointerOperand());
+			if (slot != NULL && slots.count(slot) && state.count(slot)){
+				return state[slot];
+			}
+			return Interval::full(bits);
+		}
+		if (CastInst* cast = dyn_cast<CastInst>(inst)){
+			if (cast->getOperand(0)->getType()->isIntegerTy()){
+				return castRange(cast, get(cast->getOperand(0)));
+			}
+			return Interval::full(bits);
+		}
+		if (SelectInst* select = dyn_cast<SelectInst>(inst)){
+			return get(select->getTrueValue()).join(get(select->getFalseValue()));
+		}
+		if (PHINode* phi = dyn_cast<PHINode>(inst)){
+			//The values along back edges are not known yet when the head is visited
+			if (loopHeads.count(phi->getParent())){
+				return Interval::full(bits);
+			}
+			Interval range;
+			for (unsigned i = 0; i < phi->getNumIncomingValues(); i++){
+				range = range.join(get(phi->getIncomingValue(i)));
+			}
+			return range;
+		}
+		BinaryOperator* binary = dyn_cast<BinaryOperator>(inst);
+		if (binary == NULL){
+			return Interval::full(bits);
+		}
+		Interval left = get(binary->getOperand(0));
+		Interval right = get(binary->getOperand(1));
+		switch (binary->getOpcode()){
+		case Instruction::Add:
+			return (left + right).fit(bits);
+		case Instruction::Sub:
+			return (left - right).fit(bits);
+		case Instruction::Mul:
+			return (left * right).fit(bits);
+		case Instruction::SDiv:
+		case Instruction::UDiv:
+			//Dividing non-negative values by a positive constant
+			if (left.lo >= 0 && right.lo == right.hi && right.lo > 0){
+				return Interval(left.lo / right.lo, left.hi / right.lo);
+			}
+			break;
+		case Instruction::SRem:
+		case Instruction::URem:
+			if (left.lo >= 0 && right.lo > 0){
+				return Interval(0, std::min(left.hi, right.hi - 1));
+			}
+			break;
+		case Instruction::And:
+			//Masking with a non-negative value can not exceed it
+			if (right.lo >= 0){
+				return Interval(0, right.hi);
+			}
+			if (left.lo >= 0){
+				return Interval(0, left.hi);
+			}
+			break;
+		}
+		return Interval::full(bits);
+	}
+
+	//The slot a compared value was loaded from, if nothing stores to the slot before the branch
+	AllocaInst* getComparedSlot(Value* value, BasicBlock* block)
+	{
+		if (SExtInst* sext = dyn_cast<SExtInst>(value)){
+			value = sext->getOperand(0);
+		}
+		LoadInst* load = dyn_cast<LoadInst>(value);
+		if (load == NULL || load->getParent() != block){
+			return NULL;
+		}
+		AllocaInst* slot = dyn_cast<AllocaInst>(load->getPointerOperand());
+		if (slot == NULL || !slots.count(slot)){
+			return NULL;
+		}
+		BasicBlock::iterator i = load;
+		for (++i; i != block->end(); ++i){
+			StoreInst* store = dyn_cast<StoreInst>(i);
+			if (store != NULL && store->getPointerOperand() == slot){
+				return NULL;
+			}
+		}
+		return slot;
+	}
+
+	//What "left pred right" being true says about left
+	static Interval constrain(CmpInst::Predicate pred, Interval left, Interval right)
+	{
+		switch (pred){
+		case CmpInst::ICMP_SLT:
+			return left.meet(Interval(INT64_MIN, Interval::add(right.hi, -1)));
+		case CmpInst::ICMP_SLE:
+			return left.meet(Interval(INT64_MIN, right.hi));
+		case CmpInst::ICMP_SGT:
+			return left.meet(Interval(Interval::add(right.lo, 1), INT64_MAX));
+		case CmpInst::ICMP_SGE:
+			return left.meet(Interval(right.lo, INT64_MAX));
+		case CmpInst::ICMP_EQ:
+			return left.meet(right);
+		case CmpInst::ICMP_NE:
+			if (right.lo == right.hi && left.lo == right.lo){
+				return Interval(Interval::add(left.lo, 1), left.hi);
+			}
+			if (right.lo == right.hi && left.hi == right.lo){
+				return Interval(left.lo, Interval::add(left.hi, -1));
+			}
+			return left;
+		default:
+			return left;
+		}
+	}
+
+	//Narrow the slots compared by a branch along one of its edges, false if the edge can not be taken
+	bool refine(BasicBlock* block, BasicBlock* succ, State &state)
+	{
+		BranchInst* branch = dyn_cast<BranchInst>(block->getTerminator());
+		if (branch == NULL || !branch->isConditional() || branch->getSuccessor(0) == branch->getSuccessor(1)){
+			return true;
+		}
+		ICmpInst* cmp = dyn_cast<ICmpInst>(branch->getCondition());
+		if (cmp == NULL || !cmp->getOperand(0)->getType()->isIntegerTy()){
+			return true;
+		}
+
+		CmpInst::Predicate pred = cmp->getPredicate();
+		if (succ != branch->getSuccessor(0)){
+			pred = cmp->getInversePredicate();
+		}
+		Interval left = get(cmp->getOperand(0));
+		Interval right = get(cmp->getOperand(1));
+
+		AllocaInst* leftSlot = getComparedSlot(cmp->getOperand(0), block);
+		AllocaInst* rightSlot = getComparedSlot(cmp->getOperand(1), block);
+		if (leftSlot != NULL){
+			state[leftSlot] = constrain(pred, left, right);
+			if (state[leftSlot].isEmpty()) return false;
+		}
+		if (rightSlot != NULL && rightSlot != leftSlot){
+			state[rightSlot] = constrain(CmpInst::getSwappedPredicate(pred), right, left);
+			if (state[rightSlot].isEmpty()) return false;
+		}
+		return true;
+	}
+
+	//Run the block from its in state, recording the value ranges and the state along each outgoing edge.
+	//Blocks using a value whose range changed are added to changedUsers.
+	void visit(BasicBlock* block, std::set<BasicBlock*> &changedUsers)
+	{
+		State state = inState[block];
+		for (BasicBlock::iterator i = block->begin(); i != block->end(); ++i){
+			if (StoreInst* store = dyn_cast<StoreInst>(i)){
+				AllocaInst* slot = dyn_cast<AllocaInst>(store->getPointerOperand());
+				if (slot != NULL && slots.count(slot)){
+					state[slot] = get(store->getValueOperand());
+				}
+				continue;
+			}
+			if (i->getType()->isIntegerTy()){
+				Interval range = transfer(i, state);
+				std::map<Value*, Interval>::iterator old = values.find(i);
+				if (old != values.end() && old->second != range){
+					for (Value::use_iterator u = i->use_begin(); u != i->use_end(); ++u){
+						Instruction* user = cast<Instruction>(*u);
+						if (user->getParent() != block){
+							changedUsers.insert(user->getParent());
+						}
+					}
+				}
+				values[i] = range;
+			}
+		}
+
+		TerminatorInst* term = block->getTerminator();
+		for (unsigned s = 0; s < term->getNumSuccessors(); s++){
+			BasicBlock* succ = term->getSuccessor(s);
+			State edge = state;
+			if (refine(block, succ, edge)){
+				edgeState[std::make_pair(block, succ)] = edge;
+			}else{
+				edgeState.erase(std::make_pair(block, succ));
+			}
+		}
+	}
+
+	//Join the states coming into a block from its reached predecessors, false if none is reached
+	bool joinIncoming(BasicBlock* block, State &joined)
+	{
+		bool reached = false;
+		for (pred_iterator p = pred_begin(block); p != pred_end(block); ++p){
+			std::map<std::pair<BasicBlock*, BasicBlock*>, State>::iterator edge = edgeState.find(std::make_pair(*p, block));
+			if (edge == edgeState.end()){
+				continue;
+			}
+			if (!reached){
+				joined = edge->second;
+				reached = true;
+				continue;
+			}
+			for (State::iterator s = edge->second.begin(); s != edge->second.end(); ++s){
+				joined[s->first] = joined[s->first].join(s->second);
+			}
+		}
+		return reached;
+	}
+
+	//Order the blocks so each comes before its successors, except along back edges, whose targets are the loop heads
+	void order(BasicBlock* block, std::set<BasicBlock*> &onStack, std::set<BasicBlock*> &done, std::vector<BasicBlock*> &postOrder)
+	{
+		onStack.insert(block);
+		TerminatorInst* term = block->getTerminator();
+		for (unsigned s = 0; s < term->getNumSuccessors(); s++){
+			BasicBlock* succ = term->getSuccessor(s);
+			if (onStack.count(succ)){
+				loopHeads.insert(succ);
+			}else if (!done.count(succ)){
+				order(succ, onStack, done, postOrder);
+			}
+		}
+		onStack.erase(block);
+		done.insert(block);
+		postOrder.push_back(block);
+	}
+
+	void run(Function &F)
+	{
+		slots.clear();
+		values.clear();
+		inState.clear();
+		edgeState.clear();
+		loopHeads.clear();
+
+		for (BasicBlock::iterator i = F.getEntryBlock().begin(); i != F.getEntryBlock().end(); ++i){
+			if (AllocaInst* slot = dyn_cast<AllocaInst>(i)){
+				if (isTrackable(slot)){
+					slots.insert(slot);
+				}
+			}
+		}
+
+		std::set<BasicBlock*> onStack, done;
+		std::vector<BasicBlock*> postOrder;
+		order(&F.getEntryBlock(), onStack, done, postOrder);
+		std::vector<BasicBlock*> blocks(postOrder.rbegin(), postOrder.rend());
+		std::map<BasicBlock*, unsigned> position;
+		for (unsigned b = 0; b < blocks.size(); b++){
+			position[blocks[b]] = b;
+		}
+
+		//Nothing is known about the slots on entry
+		State entry;
+		for (std::set<AllocaInst*>::iterator s = slots.begin(); s != slots.end(); ++s){
+			entry[*s] = Interval::full(getSlotBits(*s));
+		}
+		inState[&F.getEntryBlock()] = entry;
+
+		//Ascending phase, always taking the earliest block in the order that has changed
+		std::set<unsigned> worklist;
+		worklist.insert(0);
+		while (!worklist.empty()){
+			BasicBlock* block = blocks[*worklist.begin()];
+			worklist.erase(worklist.begin());
+
+			std::set<BasicBlock*> changedUsers;
+			visit(block, changedUsers);
+			for (std::set<BasicBlock*>::iterator u = changedUsers.begin(); u != changedUsers.end(); ++u){
+				if (inState.count(*u)){
+					worklist.insert(position[*u]);
+				}
+			}
+
+			TerminatorInst* term = block->getTerminator();
+			for (unsigned s = 0; s < term->getNumSuccessors(); s++){
+				BasicBlock* succ = term->getSuccessor(s);
+				State joined;
+				if (!joinIncoming(succ, joined)){
+					continue;
+				}
+
+				bool changed = !inState.count(succ);
+				State &old = inState[succ];
+				for (State::iterator j = joined.begin(); j != joined.end(); ++j){
+					Interval next = j->second;
+					if (!changed && loopHeads.count(succ)){
+						next = old[j->first].widen(next, getSlotBits(j->first));
+					}
+					if (changed || old[j->first] != next){
+						changed = true;
+					}
+					old[j->first] = next;
+				}
+				if (changed){
+					worklist.insert(position[succ]);
+				}
+			}
+		}
+
+		//Descending phase, the loop tests narrow what widening lost
+		for (int pass = 0; pass < 2; pass++){
+			for (unsigned b = 0; b < blocks.size(); b++){
+				BasicBlock* block = blocks[b];
+				if (!inState.count(block)){
+					continue;
+				}
+				if (block != &F.getEntryBlock()){
+					State joined;
+					if (!joinIncoming(block, joined)){
+						continue;
+					}
+					State &old = inState[block];
+					for (State::iterator j = joined.begin(); j != joined.end(); ++j){
+						if (loopHeads.count(block)){
+							old[j->first] = old[j->first].narrow(j->second, getSlotBits(j->first));
+						}else{
+							old[j->first] = j->second;
+						}
+					}
+				}
+				std::set<BasicBlock*> changedUsers;
+				visit(block, changedUsers);
+			}
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,349 @@
+#ifndef LOOPCHECKS_H
+#define LOOPCHECKS_H
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include <map>
+
+using namespace llvm;
+
+//Questions about the bounds checks in a loop and the values they use, shared by the passes that move
+//checks out of loops. Loops are expected in the -O0 form, where variables live in stack slots.
+struct LoopChecks
+{
+	//A bounds check inserted by CreateBounds, its only use is a branch that goes to the exit block when it fails
+	bool isBoundCheck(ICmpInst* cmp, BranchInst* &branch)
+	{
+		if(!cmp->getName().startswith("CmpTest") || !cmp->hasOneUse()) return false;
+		branch = dyn_cast<BranchInst>(*cmp->use_begin());
+		return branch != NULL && branch->isConditional() && branch->getCondition() == cmp;
+	}
+
+	//A stack variable is unchanged in the loop if it is never stored there and its address does not escape
+	bool isSlotInvariant(Value* slot, Loop* loop)
+	{
+		if(!isa<AllocaInst>(slot)) return false;
+		for(Value::use_iterator u = slot->use_begin(); u != slot->use_end(); ++u)
+		{
+			if(isa<LoadInst>(*u)) continue;
+			StoreInst* store = dyn_cast<StoreInst>(*u);
+			if(store == NULL || store->getPointerOperand() != slot) return false;
+			if(loop->contains(store->getParent())) return false;
+		}
+		return true;
+	}
+
+	//Operations that can be recomputed before the loop without side effects or traps
+	bool isSafeToRecompute(Instruction* inst)
+	{
+		if(isa<CastInst>(inst)) return true;
+		switch(inst->getOpcode())
+		{
+		case Instruction::Add:
+		case Instruction::Sub:
+		case Instruction::Mul:
+		case Instruction::Shl:
+		case Instruction::And:
+		case Instruction::Or:
+		case Instruction::Xor:
+			return true;
+		}
+		return false;
+	}
+
+	//The value is the same on every iteration. Loads of the induction variable are allowed when one is given
+	bool isInvariant(Value* value, Loop* loop, Value* induction)
+	{
+		Instruction* inst = dyn_cast<Instruction>(value);
+		if(inst == NULL || !loop->contains(inst->getParent())) return true;
+
+		if(LoadInst* load = dyn_cast<LoadInst>(inst))
+			return (induction != NULL && load->getPointerOperand() == induction) || isSlotInvariant(load->getPointerOperand(), loop);
+
+		if(!isSafeToRecompute(inst)) return false;
+		for(unsigned i = 0; i < inst->getNumOperands(); i++)
+			if(!isInvariant(inst->getOperand(i), loop, induction)) return false;
+		return true;
+	}
+
+	//The value moves in one direction as the induction variable does, so its extremes are at the first and last iteration
+	bool isMonotonic(Value* value, Loop* loop, Value* induction)
+	{
+		if(isInvariant(value, loop, NULL)) return true;
+
+		Instruction* inst = dyn_cast<Instruction>(value);
+		if(LoadInst* load = dyn_cast<LoadInst>(inst))
+			return load->getPointerOperand() == induction;
+		if(isa<SExtInst>(inst) || isa<ZExtInst>(inst))
+			return isMonotonic(inst->getOperand(0), loop, induction);
+		if(!isa<BinaryOperator>(inst)) return false;
+
+		Value* op1 = inst->getOperand(0);
+		Value* op2 = inst->getOperand(1);
+		switch(inst->getOpcode())
+		{
+		case Instruction::Add:
+		case Instruction::Sub:
+			return (isInvariant(op1, loop, NULL) && isMonotonic(op2, loop, induction))
+				|| (isMonotonic(op1, loop, induction) && isInvariant(op2, loop, NULL));
+		case Instruction::Mul:
+		case Instruction::Shl:
+			return (isa<ConstantInt>(op1) && isMonotonic(op2, loop, induction))
+				|| (isMonotonic(op1, loop, induction) && isa<ConstantInt>(op2));
+		}
+		return false;
+	}
+
+	//Copy an invariant expression before insertBefore, replacing loads of the induction variable with inductionValue
+	Value* copyExpression(Value* value, Loop* loop, Value* induction, Value* inductionValue, Instruction* insertBefore)
+	{
+		Instruction* inst = dyn_cast<Instruction>(value);
+		if(inst == NULL || !loop->contains(inst->getParent())) return value;
+
+		if(LoadInst* load = dyn_cast<LoadInst>(inst))
+			if(load->getPointerOperand() == induction) return inductionValue;
+
+		Instruction* copy = inst->clone();
+		for(unsigned i = 0; i < copy->getNumOperands(); i++)
+			copy->setOperand(i, copyExpression(inst->getOperand(i), loop, induction, inductionValue, insertBefore));
+		copy->insertBefore(insertBefore);
+		return copy;
+	}
+
+	//The step of a stack variable that is only changed in the loop by "i = i + 1" or "i = i - 1" in a latch, 0 if it
+	//is changed any other way or its address escapes
+	int getLatchStep(Loop* loop, Value* slot)
+	{
+		int step = 0;
+		for(Value::use_iterator u = slot->use_begin(); u != slot->use_end(); ++u)
+		{
+			if(isa<LoadInst>(*u)) continue;
+			StoreInst* store = dyn_cast<StoreInst>(*u);
+			if(store == NULL || store->getPointerOperand() != slot) return 0;
+			if(!loop->contains(store->getParent())) continue;
+			if(step != 0) return 0;
+
+			BranchInst* latchBranch = dyn_cast<BranchInst>(store->getParent()->getTerminator());
+			if(latchBranch == NULL || latchBranch->isConditional() || latchBranch->getSuccessor(0) != loop->getHeader()) return 0;
+
+			BinaryOperator* change = dyn_cast<BinaryOperator>(store->getValueOperand());
+			if(change == NULL) return 0;
+			LoadInst* old = dyn_cast<LoadInst>(change->getOperand(0));
+			ConstantInt* amount = dyn_cast<ConstantInt>(change->getOperand(1));
+			if(old == NULL || old->getPointerOperand() != slot || amount == NULL) return 0;
+
+			if(change->getOpcode() == Instruction::Add) step = amount->getSExtValue();
+			else if(change->getOpcode() == Instruction::Sub) step = -amount->getSExtValue();
+			if(step != 1 && step != -1) return 0;
+		}
+		return step;
+	}
+
+	//A constant, or a load of a stack variable whose only store is that constant
+	ConstantInt* getFixedConstant(Value* value)
+	{
+		if(ConstantInt* constant = dyn_cast<ConstantInt>(value)) return constant;
+		LoadInst* load = dyn_cast<LoadInst>(value);
+		if(load == NULL || !isa<AllocaInst>(load->getPointerOperand())) return NULL;
+
+		ConstantInt* stored = NULL;
+		Value* slot = load->getPointerOperand();
+		for(Value::use_iterator u = slot->use_begin(); u != slot->use_end(); ++u)
+		{
+			if(isa<LoadInst>(*u)) continue;
+			StoreInst* store = dyn_cast<StoreInst>(*u);
+			if(store == NULL || store->getPointerOperand() != slot || stored != NULL) return NULL;
+			stored = dyn_cast<ConstantInt>(store->getValueOperand());
+			if(stored == NULL) return NULL;
+		}
+		return stored;
+	}
+
+	//The values an induction variable has in the blocks of its loop after the header's test, for loops like
+	//"for(i = first; i != bound; i++)" where first is the constant last stored before the loop and bound is fixed.
+	//A test with != only stops the variable if it starts on the right side of the bound. False if not known.
+	bool getInductionRange(Loop* loop, Value* slot, int64_t &lo, int64_t &hi)
+	{
+		BasicBlock* header = loop->getHeader();
+		BranchInst* exitBranch = dyn_cast<BranchInst>(header->getTerminator());
+		if(exitBranch == NULL || !exitBranch->isConditional()) return false;
+		if(!loop->contains(exitBranch->getSuccessor(0)) || loop->contains(exitBranch->getSuccessor(1))) return false;
+
+		ICmpInst* exitTest = dyn_cast<ICmpInst>(exitBranch->getCondition());
+		if(exitTest == NULL) return false;
+		LoadInst* load = dyn_cast<LoadInst>(exitTest->getOperand(0));
+		ConstantInt* bound = getFixedConstant(exitTest->getOperand(1));
+		if(load == NULL || load->getPointerOperand() != slot || bound == NULL) return false;
+
+		int step = getLatchStep(loop, slot);
+		if(step == 0) return false;
+
+		//The value the variable enters the loop with, from the stores on the line of single predecessors before it
+		ConstantInt* first = NULL;
+		for(BasicBlock* block = loop->getLoopPreheader(); block != NULL && first == NULL; block = block->getSinglePredecessor())
+		{
+			BasicBlock::iterator i = block->end();
+			while(i != block->begin())
+			{
+				--i;
+				StoreInst* store = dyn_cast<StoreInst>(i);
+				if(store == NULL || store->getPointerOperand() != slot) continue;
+				first = getFixedConstant(store->getValueOperand());
+				if(first == NULL) return false;
+				break;
+			}
+		}
+		if(first == NULL) return false;
+
+		int64_t start = first->getSExtValue();
+		int64_t end = bound->getSExtValue();
+		switch(exitTest->getPredicate())
+		{
+		case CmpInst::ICMP_ULT:
+		case CmpInst::ICMP_ULE:
+		case CmpInst::ICMP_UGT:
+		case CmpInst::ICMP_UGE:
+			if(start < 0 || end < 0) return false;
+			break;
+		default:
+			break;
+		}
+		switch(exitTest->getPredicate())
+		{
+		case CmpInst::ICMP_SLT:
+		case CmpInst::ICMP_ULT:
+			if(step != 1) return false;
+			lo = start; hi = end - 1;
+			return true;
+		case CmpInst::ICMP_SLE:
+		case CmpInst::ICMP_ULE:
+			if(step != 1) return false;
+			lo = start; hi = end;
+			return true;
+		case CmpInst::ICMP_SGT:
+		case CmpInst::ICMP_UGT:
+			if(step != -1) return false;
+			lo = end + 1; hi = start;
+			return true;
+		case CmpInst::ICMP_SGE:
+		case CmpInst::ICMP_UGE:
+			if(step != -1) return false;
+			lo = end; hi = start;
+			return true;
+		case CmpInst::ICMP_NE:
+			if(step == 1 && start <= end)
+			{
+				lo = start; hi = end - 1;
+				return true;
+			}
+			if(step == -1 && start >= end)
+			{
+				lo = end + 1; hi = start;
+				return true;
+			}
+			return false;
+		default:
+			return false;
+		}
+	}
+
+	//Find a loop of the form "for(i = first; i < bound; i++)": the header tests the variable against an invariant bound
+	//and the variable is only changed by one step of +1 or -1 in a latch. Gives the variable and its last value.
+	bool findInduction(Loop* loop, Value* &induction, Value* &last, Instruction* insertBefore)
+	{
+		BasicBlock* header = loop->getHeader();
+		BranchInst* exitBranch = dyn_cast<BranchInst>(header->getTerminator());
+		if(exitBranch == NULL || !exitBranch->isConditional()) return false;
+		if(!loop->contains(exitBranch->getSuccessor(0)) || loop->contains(exitBranch->getSuccessor(1))) return false;
+
+		ICmpInst* exitTest = dyn_cast<ICmpInst>(exitBranch->getCondition());
+		if(exitTest == NULL) return false;
+		LoadInst* load = dyn_cast<LoadInst>(exitTest->getOperand(0));
+		if(load == NULL || !isa<AllocaInst>(load->getPointerOperand())) return false;
+		Value* slot = load->getPointerOperand();
+		Value* bound = exitTest->getOperand(1);
+		if(!isInvariant(bound, loop, NULL)) return false;
+
+		//The only change is a single step in a latch
+		int step = getLatchStep(loop, slot);
+		if(step == 0) return false;
+
+		//The last value the variable has inside the loop
+		int adjust;
+		CmpInst::Predicate pred = exitTest->getPredicate();
+		if(step == 1 && (pred == CmpInst::ICMP_SLT || pred == CmpInst::ICMP_ULT)) adjust = -1;
+		else if(step == 1 && (pred == CmpInst::ICMP_SLE || pred == CmpInst::ICMP_ULE)) adjust = 0;
+		else if(step == -1 && (pred == CmpInst::ICMP_SGT || pred == CmpInst::ICMP_UGT)) adjust = 1;
+		else if(step == -1 && (pred == CmpInst::ICMP_SGE || pred == CmpInst::ICMP_UGE)) adjust = 0;
+		else return false;
+
+		induction = slot;
+		if(insertBefore != NULL)
+		{
+			last = copyExpression(bound, loop, NULL, NULL, insertBefore);
+			if(adjust != 0)
+				last = BinaryOperator::CreateAdd(last, ConstantInt::get(last->getType(), adjust, true), "last", insertBefore);
+		}
+		return true;
+	}
+
+	//The step of an induction variable found by findInduction, +1 or -1
+	int getStep(Loop* loop, Value* induction)
+	{
+		for(Value::use_iterator u = induction->use_begin(); u != induction->use_end(); ++u)
+		{
+			StoreInst* store = dyn_cast<StoreInst>(*u);
+			if(store == NULL || !loop->contains(store->getParent())) continue;
+			BinaryOperator* change = cast<BinaryOperator>(store->getValueOperand());
+			int amount = cast<ConstantInt>(change->getOperand(1))->getSExtValue();
+			return change->getOpcode() == Instruction::Add ? amount : -amount;
+		}
+		return 0;
+	}
+
+	//Match an index of the form "i + offset" with a constant offset, following sign extensions
+	bool getOffset(Value* value, Value* induction, int64_t &offset)
+	{
+		if(LoadInst* load = dyn_cast<LoadInst>(value))
+		{
+			offset = 0;
+			return load->getPointerOperand() == induction;
+		}
+		if(SExtInst* sext = dyn_cast<SExtInst>(value))
+			return getOffset(sext->getOperand(0), induction, offset);
+
+		BinaryOperator* inst = dyn_cast<BinaryOperator>(value);
+		if(inst == NULL) return false;
+		ConstantInt* amount = dyn_cast<ConstantInt>(inst->getOperand(1));
+		if(inst->getOpcode() == Instruction::Add && amount == NULL)
+		{
+			amount = dyn_cast<ConstantInt>(inst->getOperand(0));
+			if(amount == NULL || !getOffset(inst->getOperand(1), induction, offset)) return false;
+			offset += amount->getSExtValue();
+			return true;
+		}
+		if(amount == NULL || !getOffset(inst->getOperand(0), induction, offset)) return false;
+		if(inst->getOpcode() == Instruction::Add) offset += amount->getSExtValue();
+		else if(inst->getOpcode() == Instruction::Sub) offset -= amount->getSExtValue();
+		else return false;
+		return true;
+	}
+
+	//The loop can be entered without running the header's test again if the header only computes the test
+	bool isGuardable(Loop* loop)
+	{
+		BasicBlock* header = loop->getHeader();
+		BranchInst* exitBranch = dyn_cast<BranchInst>(header->getTerminator());
+		if(exitBranch == NULL || !exitBranch->isConditional()) return false;
+		for(BasicBlock::iterator i = header->begin(); i != header->end(); i++)
+		{
+			if(&*i == exitBranch) continue;
+			if(!isa<LoadInst>(i) && !isa<CmpInst>(i) && !(isSafeToRecompute(i))) return false;
+		}
+		return true;
+	}
+};
+
+#endif
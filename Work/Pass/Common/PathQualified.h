@@ -0,0 +1,169 @@
+#ifndef PATHQUALIFIED_H
+#define PATHQUALIFIED_H
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Support/CFG.h"
+#include "ReachingDefs.h"
+#include "LoopChecks.h"
+#include <map>
+#include <set>
+#include <vector>
+
+using namespace llvm;
+
+//Facts of a region qualified by the predecessor its head is entered from, found without copying anything.
+//
+//The reaching defs of the region are solved again with the head entered only from that predecessor, which is what
+//a copy of the region entered from it would see. Walking the blocks with them, a load has a constant when every def
+//of its variable reaching it stores that constant, and casts and arithmetic of constants fold. A bounds check whose
+//operands are both constant and which passes can be removed along that path, so a region only needs a copy for
+//the predecessors it removes a check for, and a check that passes whichever predecessor the head is entered from
+//is removed from the region itself, without a copy.
+struct PathQualified
+{
+	LoopChecks loopChecks;
+
+	//Stack slots whose every store is a def and whose address is only loaded from and stored to
+	std::map<Value*, bool> tracked;
+
+	bool isTracked(ReachingDefs &reachingDefs, Value* slot)
+	{
+		std::map<Value*, bool>::iterator found = tracked.find(slot);
+		if(found != tracked.end()) return found->second;
+
+		bool result = isa<AllocaInst>(slot);
+		for(Value::use_iterator u = slot->use_begin(); u != slot->use_end() && result; ++u)
+		{
+			if(isa<LoadInst>(*u)) continue;
+			StoreInst* store = dyn_cast<StoreInst>(*u);
+			result = store != NULL && store->getPointerOperand() == slot && reachingDefs.getDef(store) != -1;
+		}
+		tracked[slot] = result;
+		return result;
+	}
+
+	//The constant every one of the defs stores, NULL if they do not all store the same one
+	ConstantInt* getStored(ReachingDefs &reachingDefs, ReachingDefs::Defs &defs)
+	{
+		ConstantInt* value = NULL;
+		for(ReachingDefs::Defs::iterator d = defs.begin(); d != defs.end(); ++d)
+		{
+			ConstantInt* stored = dyn_cast<ConstantInt>(cast<StoreInst>(reachingDefs.defs[*d])->getValueOperand());
+			if(stored == NULL || (value != NULL && stored != value)) return NULL;
+			value = stored;
+		}
+		return value;
+	}
+
+	ConstantInt* getKnown(Value* value, std::map<Value*, ConstantInt*> &known)
+	{
+		if(ConstantInt* constant = dyn_cast<ConstantInt>(value)) return constant;
+		std::map<Value*, ConstantInt*>::iterator found = known.find(value);
+		return found == known.end() ? NULL : found->second;
+	}
+
+	//The bounds checks of region that always pass when the region is entered from pred through head
+	void findPassing(ReachingDefs &reachingDefs, BasicBlock* head, BasicBlock* pred, std::vector<BasicBlock*> &region, std::vector<ICmpInst*> &passing)
+	{
+		std::map<BasicBlock*, ReachingDefs::Defs> regionIn;
+		reachingDefs.solveRegion(head, pred, region, regionIn);
+		tracked.clear();
+
+		for(unsigned b = 0; b < region.size(); b++)
+		{
+			if(regionIn.count(region[b]) == 0) continue;
+			ReachingDefs::Defs reaching = regionIn[region[b]];
+			std::map<Value*, ConstantInt*> known;
+
+			for(BasicBlock::iterator i = region[b]->begin(); i != region[b]->end(); ++i)
+			{
+				ConstantInt* result = NULL;
+				if(LoadInst* load = dyn_cast<LoadInst>(i))
+				{
+					Value* slot = load->getPointerOperand();
+					if(isTracked(reachingDefs, slot))
+					{
+						ReachingDefs::Defs defs = reaching;
+						defs &= reachingDefs.ofVariable[slot];
+						if(!defs.empty())
+							result = getStored(reachingDefs, defs);
+					}
+				}
+				else if(CastInst* castInst = dyn_cast<CastInst>(i))
+				{
+					ConstantInt* op = getKnown(castInst->getOperand(0), known);
+					if(op != NULL)
+						result = dyn_cast<ConstantInt>(ConstantExpr::getCast(castInst->getOpcode(), op, castInst->getType()));
+				}
+				else if(i->getOpcode() == Instruction::Add || i->getOpcode() == Instruction::Sub || i->getOpcode() == Instruction::Mul)
+				{
+					ConstantInt* op1 = getKnown(i->getOperand(0), known);
+					ConstantInt* op2 = getKnown(i->getOperand(1), known);
+					if(op1 != NULL && op2 != NULL)
+						result = dyn_cast<ConstantInt>(ConstantExpr::get(i->getOpcode(), op1, op2));
+				}
+				else if(ICmpInst* cmp = dyn_cast<ICmpInst>(i))
+				{
+					BranchInst* branch;
+					ConstantInt* op1 = getKnown(cmp->getOperand(0), known);
+					ConstantInt* op2 = getKnown(cmp->getOperand(1), known);
+					if(loopChecks.isBoundCheck(cmp, branch) && op1 != NULL && op2 != NULL)
+					{
+						ConstantInt* holds = dyn_cast<ConstantInt>(ConstantExpr::getICmp(cmp->getPredicate(), op1, op2));
+						if(holds != NULL && holds->isOne())
+							passing.push_back(cmp);
+					}
+				}
+				if(result != NULL)
+					known[i] = result;
+
+				reachingDefs.apply(reaching, i);
+			}
+		}
+	}
+
+	//The checks of region that pass whichever predecessor head is entered from. They only hold in the original
+	//blocks if the region is entered nowhere but at its head, and never from inside itself
+	void findAlwaysPassing(ReachingDefs &reachingDefs, BasicBlock* head, std::vector<BasicBlock*> &region, std::vector<ICmpInst*> &passing)
+	{
+		std::set<BasicBlock*> inRegion(region.begin(), region.end());
+		for(unsigned b = 0; b < region.size(); b++)
+		{
+			for(pred_iterator p = pred_begin(region[b]); p != pred_end(region[b]); ++p)
+				if((region[b] == head) == (inRegion.count(*p) != 0)) return;
+		}
+
+		std::set<BasicBlock*> preds(pred_begin(head), pred_end(head));
+		if(preds.empty()) return;
+
+		std::map<ICmpInst*, unsigned> numPassing;
+		for(std::set<BasicBlock*>::iterator p = preds.begin(); p != preds.end(); ++p)
+		{
+			std::vector<ICmpInst*> found;
+			findPassing(reachingDefs, head, *p, region, found);
+			for(unsigned c = 0; c < found.size(); c++)
+				numPassing[found[c]]++;
+		}
+		for(std::map<ICmpInst*, unsigned>::iterator c = numPassing.begin(); c != numPassing.end(); ++c)
+			if(c->second == preds.size())
+				passing.push_back(c->first);
+	}
+
+	//Make a check that always passes go straight to its success block. Returns the failure block, which lost a
+	//predecessor
+	static BasicBlock* removeCheck(ICmpInst* cmp)
+	{
+		BranchInst* branch = cast<BranchInst>(*cmp->use_begin());
+		BasicBlock* failure = branch->getSuccessor(1);
+		failure->removePredecessor(branch->getParent());
+		BranchInst::Create(branch->getSuccessor(0), branch);
+		branch->eraseFromParent();
+		RecursivelyDeleteTriviallyDeadInstructions(cmp);
+		return failure;
+	}
+};
+
+#endif
@@ -0,0 +1,203 @@
+#ifndef REACHABILITY_H
+#define REACHABILITY_H
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/ADT/BitVector.h"
+#include <map>
+#include <vector>
+#include <algorithm>
+
+using namespace llvm;
+
+//Which blocks of a function can reach which, and the predecessors of each block, as they were when built.
+//
+//Blocks are numbered in function order. Blocks on a cycle all reach the same blocks, so they are first grouped
+//into strongly connected components (Tarjan). Each component gets one bitset of the blocks it reaches, filled
+//sinks first by OR-ing in the bitsets of its successors, so the closure takes one pass over the edges with 64
+//blocks handled per word. The blocks reaching each component are filled the same way, sources first, the first
+//time they are asked for. Every block is included, reachable from the entry or not.
+struct Reachability
+{
+	std::map<BasicBlock*, unsigned> index;
+	std::vector<BasicBlock*> blocks;
+	std::vector<std::vector<unsigned> > successors;
+	std::vector<std::vector<unsigned> > predecessors;		//sorted, each predecessor once
+
+	std::vector<unsigned> component;			//block -> component
+	std::vector<std::vector<unsigned> > members;		//component -> blocks
+	std::vector<bool> cyclic;				//component -> has a path from its blocks back to them
+	std::vector<BitVector> reach;				//component -> blocks reached by one or more edges
+	std::vector<BitVector> reachedBy;			//component -> blocks reaching it by one or more edges
+
+	void build(Function &F)
+	{
+		index.clear();
+		blocks.clear();
+		for(Function::iterator b = F.begin(); b != F.end(); ++b)
+		{
+			index[b] = blocks.size();
+			blocks.push_back(b);
+		}
+
+		unsigned numBlocks = blocks.size();
+		successors.assign(numBlocks, std::vector<unsigned>());
+		predecessors.assign(numBlocks, std::vector<unsigned>());
+		for(unsigned b = 0; b < numBlocks; b++)
+		{
+			TerminatorInst* term = blocks[b]->getTerminator();
+			for(unsigned s = 0; s < term->getNumSuccessors(); s++)
+			{
+				unsigned succ = index[term->getSuccessor(s)];
+				successors[b].push_back(succ);
+				predecessors[succ].push_back(b);
+			}
+		}
+		for(unsigned b = 0; b < numBlocks; b++)
+		{
+			std::sort(predecessors[b].begin(), predecessors[b].end());
+			predecessors[b].erase(std::unique(predecessors[b].begin(), predecessors[b].end()), predecessors[b].end());
+		}
+
+		unsigned numComponents = findComponents();
+
+		members.assign(numComponents, std::vector<unsigned>());
+		for(unsigned b = 0; b < numBlocks; b++)
+			members[component[b]].push_back(b);
+
+		//A component is finished after every component it reaches, so those are already filled in
+		cyclic.assign(numComponents, false);
+		reach.assign(numComponents, BitVector(numBlocks));
+		reachedBy.clear();
+		for(unsigned c = 0; c < numComponents; c++)
+			close(c, successors, reach);
+	}
+
+	//Fill the blocks one component reaches over the given edges, from the components its edges lead to
+	void close(unsigned c, std::vector<std::vector<unsigned> > &edges, std::vector<BitVector> &closure)
+	{
+		for(unsigned m = 0; m < members[c].size(); m++)
+		{
+			std::vector<unsigned> &targets = edges[members[c][m]];
+			for(unsigned t = 0; t < targets.size(); t++)
+			{
+				unsigned target = component[targets[t]];
+				closure[c].set(targets[t]);
+				if(target == c)
+					cyclic[c] = true;
+				else
+					closure[c] |= closure[target];
+			}
+		}
+
+		//Around a cycle every block of the component reaches every other
+		if(cyclic[c])
+			for(unsigned m = 0; m < members[c].size(); m++)
+				closure[c].set(members[c][m]);
+	}
+
+	//Tarjan's algorithm without recursion, so deep graphs do not run out of stack. Components are numbered in
+	//the order they finish. Returns the number of components.
+	unsigned findComponents()
+	{
+		unsigned numBlocks = blocks.size();
+		std::vector<int> number(numBlocks, -1);
+		std::vector<int> low(numBlocks, 0);
+		std::vector<bool> onStack(numBlocks, false);
+		std::vector<unsigned> stack;
+		std::vector<std::pair<unsigned, unsigned> > work;		//block, next successor to visit
+		component.assign(numBlocks, 0);
+
+		int counter = 0;
+		unsigned numComponents = 0;
+		for(unsigned root = 0; root < numBlocks; root++)
+		{
+			if(number[root] != -1) continue;
+
+			number[root] = low[root] = counter++;
+			stack.push_back(root);
+			onStack[root] = true;
+			work.push_back(std::make_pair(root, 0u));
+
+			while(!work.empty())
+			{
+				unsigned v = work.back().first;
+				if(work.back().second < successors[v].size())
+				{
+					unsigned w = successors[v][work.back().second++];
+					if(number[w] == -1)
+					{
+						number[w] = low[w] = counter++;
+						stack.push_back(w);
+						onStack[w] = true;
+						work.push_back(std::make_pair(w, 0u));
+					}
+					else if(onStack[w])
+						low[v] = std::min(low[v], number[w]);
+					continue;
+				}
+
+				//Every successor is done, v is the root of a component if nothing below it reaches higher
+				if(low[v] == number[v])
+				{
+					unsigned member;
+					do
+					{
+						member = stack.back();
+						stack.pop_back();
+						onStack[member] = false;
+						component[member] = numComponents;
+					} while(member != v);
+					numComponents++;
+				}
+
+				work.pop_back();
+				if(!work.empty())
+					low[work.back().first] = std::min(low[work.back().first], low[v]);
+			}
+		}
+		return numComponents;
+	}
+
+	//Is there a path of one or more edges from one block to the other. A block reaches itself only on a cycle
+	bool reaches(unsigned from, unsigned to)
+	{
+		return reach[component[from]].test(to);
+	}
+
+	//Blocks reached from block by one or more edges
+	BitVector &getReached(unsigned block)
+	{
+		return reach[component[block]];
+	}
+
+	//Blocks that reach block by one or more edges
+	BitVector &getReaching(unsigned block)
+	{
+		if(reachedBy.empty())
+		{
+			//Predecessor components finish later, so go from the last one down
+			reachedBy.assign(members.size(), BitVector(blocks.size()));
+			for(unsigned c = members.size(); c > 0; c--)
+				close(c - 1, predecessors, reachedBy);
+		}
+		return reachedBy[component[block]];
+	}
+
+	bool reaches(BasicBlock* from, BasicBlock* to)
+	{
+		return reaches(index[from], index[to]);
+	}
+
+	std::vector<unsigned> &getPredecessors(unsigned block)
+	{
+		return predecessors[block];
+	}
+
+	bool isPredecessor(unsigned from, unsigned to)
+	{
+		return std::binary_search(predecessors[to].begin(), predecessors[to].end(), from);
+	}
+};
+
+#endif
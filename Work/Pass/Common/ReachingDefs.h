@@ -0,0 +1,256 @@
+#ifndef REACHINGDEFS_H
+#define REACHINGDEFS_H
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/SparseBitVector.h"
+#include "Dataflow.h"
+#include <map>
+#include <set>
+#include <vector>
+
+using namespace llvm;
+
+//Reaching definitions of stack variables. The caller numbers the stores it counts as defs, and a def replaces
+//the others of its variable.
+//
+//Only the defs reaching the start and end of each block are solved and kept, as sparse bitsets, so memory grows
+//with the defs that reach each block instead of defs times instructions. Reaching definitions only add defs
+//as they go, so the reverse postorder sweeps stop after the deepest nest of back edges on any path has been
+//crossed, a couple of sweeps more than the loop nesting depth. The defs reaching an instruction are found when
+//asked for by walking its block from the start; asking about a block's instructions in order carries on from the
+//last answer instead of walking again.
+//
+//A copy of a def counts as the same def. Copying a region then leaves the defs reaching every block outside it as
+//they were, since each path through a copy carries the defs of a path through the original, and update only
+//solves again over the region and its copies.
+struct ReachingDefs
+{
+	typedef SparseBitVector<> Defs;
+
+	std::vector<Instruction*> defs;
+	std::map<Instruction*, int> defNumber;
+	std::map<Value*, Defs> ofVariable;		//variable -> all its defs
+	Dataflow<true, false, Defs> solution;
+
+	//The last walk: the defs reaching walkInst in walkBlock
+	BasicBlock* walkBlock;
+	Instruction* walkInst;
+	Defs walkDefs;
+
+	static Value* getVariable(Instruction* def)
+	{
+		return cast<StoreInst>(def)->getPointerOperand();
+	}
+
+	//The def an instruction makes, -1 if none. Only stores are looked up, so an instruction put where an erased
+	//def used to be is not taken for it
+	int getDef(Instruction* inst)
+	{
+		if(!isa<StoreInst>(inst)) return -1;
+		std::map<Instruction*, int>::iterator found = defNumber.find(inst);
+		return found == defNumber.end() ? -1 : found->second;
+	}
+
+	//Step over one instruction
+	void apply(Defs &reaching, Instruction* inst)
+	{
+		int def = getDef(inst);
+		if(def == -1) return;
+		reaching.intersectWithComplement(ofVariable[getVariable(inst)]);
+		reaching.set(def);
+	}
+
+	void run(Function &F, std::vector<Instruction*> &defsIn)
+	{
+		defs = defsIn;
+		defNumber.clear();
+		ofVariable.clear();
+		clearWalk();
+		for(unsigned d = 0; d < defs.size(); d++)
+		{
+			defNumber[defs[d]] = d;
+			ofVariable[getVariable(defs[d])].set(d);
+		}
+
+		solution.init(F, defs.size());
+		for(Function::iterator b = F.begin(); b != F.end(); ++b)
+		{
+			if(solution.reaches(b))
+				fill(b);
+		}
+		solution.solve();
+	}
+
+	//Gen and kill of a block
+	void fill(BasicBlock* block)
+	{
+		Defs &gen = solution.getGen(block);
+		Defs &kill = solution.getKill(block);
+		for(BasicBlock::iterator i = block->begin(); i != block->end(); ++i)
+		{
+			int def = getDef(i);
+			if(def == -1) continue;
+			apply(gen, i);
+			kill |= ofVariable[getVariable(i)];
+		}
+	}
+
+	//Count copy as the def original makes
+	void addCopy(Instruction* original, Instruction* copy)
+	{
+		int def = getDef(original);
+		if(def != -1)
+			defNumber[copy] = def;
+	}
+
+	//Solve again after the blocks of a region were copied, given the region and its copies. The copies must have
+	//been added with addCopy
+	void update(std::vector<BasicBlock*> &changed)
+	{
+		clearWalk();
+		for(unsigned b = 0; b < changed.size(); b++)
+		{
+			if(solution.reaches(changed[b])) continue;
+			solution.addBlock(changed[b]);
+			fill(changed[b]);
+		}
+		solution.update(changed);
+	}
+
+	//The defs reaching the start of each block of a region when it is entered only from pred through head, as a copy
+	//of the region entered from pred would see them. Blocks not reachable from the entry are left out
+	void solveRegion(BasicBlock* head, BasicBlock* pred, std::vector<BasicBlock*> &region, std::map<BasicBlock*, Defs> &regionIn)
+	{
+		std::set<BasicBlock*> inRegion(region.begin(), region.end());
+		std::map<BasicBlock*, Defs> regionOut;
+		regionIn.clear();
+
+		bool changed = true;
+		while(changed)
+		{
+			changed = false;
+			for(unsigned b = 0; b < region.size(); b++)
+			{
+				BasicBlock* block = region[b];
+				if(!solution.reaches(block)) continue;
+
+				Defs in;
+				if(block == head && solution.reaches(pred))
+					in = solution.getOut(pred);
+				for(pred_iterator p = pred_begin(block); p != pred_end(block); ++p)
+				{
+					if(inRegion.count(*p) && regionOut.count(*p))
+						in |= regionOut[*p];
+				}
+				regionIn[block] = in;
+
+				in.intersectWithComplement(solution.getKill(block));
+				in |= solution.getGen(block);
+				if(regionOut.count(block) == 0 || in != regionOut[block])
+				{
+					regionOut[block] = in;
+					changed = true;
+				}
+			}
+		}
+	}
+
+	//Forget the last walk. Needed once instructions of the walked block have been erased
+	void clearWalk()
+	{
+		walkBlock = NULL;
+		walkInst = NULL;
+		walkDefs.clear();
+	}
+
+	//The defs reaching inst, counting a def made by inst itself
+	Defs &reachingAt(Instruction* inst)
+	{
+		BasicBlock* block = inst->getParent();
+		if(walkBlock == block && walkInst == inst) return walkDefs;
+
+		//Carry on from the last walk if inst is further down the block
+		if(walkBlock == block)
+		{
+			BasicBlock::iterator i = walkInst;
+			for(i++; i != block->end(); i++)
+			{
+				apply(walkDefs, i);
+				if(&*i == inst)
+				{
+					walkInst = inst;
+					return walkDefs;
+				}
+			}
+		}
+
+		walkBlock = block;
+		walkInst = inst;
+		walkDefs.clear();
+		if(solution.reaches(block))
+			walkDefs = solution.getIn(block);
+		for(BasicBlock::iterator i = block->begin(); i != block->end(); i++)
+		{
+			apply(walkDefs, i);
+			if(&*i == inst) break;
+		}
+		return walkDefs;
+	}
+
+	bool reaches(int def, Instruction* inst)
+	{
+		return reachingAt(inst).test(def);
+	}
+
+	//The defs of variable reaching inst
+	Defs reachingOf(Value* variable, Instruction* inst)
+	{
+		Defs result = reachingAt(inst);
+		result &= ofVariable[variable];
+		return result;
+	}
+
+	//Blocks where different defs of a variable come in from different predecessors, with all the defs of that
+	//variable that reach them. merges is indexed by the caller's block numbers and has a bit per def
+	void getMerges(std::map<BasicBlock*, int> &blockIndex, std::vector<BitVector> &merges)
+	{
+		for(unsigned b = 0; b < solution.order.size(); b++)
+			getMergesAt(solution.order[b], merges[blockIndex[solution.order[b]]]);
+	}
+
+	//Set the defs merged at one block
+	void getMergesAt(BasicBlock* block, BitVector &merges)
+	{
+		if(!solution.reaches(block)) return;
+		Defs &in = solution.getIn(block);
+
+		std::set<Value*> variables;
+		for(Defs::iterator d = in.begin(); d != in.end(); ++d)
+			variables.insert(getVariable(defs[*d]));
+
+		for(std::set<Value*>::iterator v = variables.begin(); v != variables.end(); ++v)
+		{
+			Defs merged = in;
+			merged &= ofVariable[*v];
+			if(merged.count() < 2) continue;
+
+			//Merged here if some predecessor does not bring all of them
+			bool mergedHere = false;
+			for(pred_iterator p = pred_begin(block); p != pred_end(block); ++p)
+			{
+				if(!solution.reaches(*p)) continue;
+				Defs fromPred = solution.getOut(*p);
+				fromPred &= ofVariable[*v];
+				if(fromPred != merged) mergedHere = true;
+			}
+			if(!mergedHere) continue;
+
+			for(Defs::iterator d = merged.begin(); d != merged.end(); ++d)
+				merges.set(*d);
+		}
+	}
+};
+
+#endif
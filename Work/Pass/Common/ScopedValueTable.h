@@ -0,0 +1,101 @@
+#ifndef SCOPEDVALUETABLE_H
+#define SCOPEDVALUETABLE_H
+
+#include "llvm/IR/Instruction.h"
+#include "llvm/IR/Instructions.h"
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+using namespace llvm;
+
+//Value numbers of expressions, and the store holding each, for value numbering over the dominator tree.
+//
+//An expression is an opcode and the value numbers of its two operands, the smaller first for commutative
+//operations. Expressions are kept in one flat table, open addressing with linear probing, sized once so it never
+//grows: each instruction makes at most one expression. A number holds everywhere once given, since the same
+//operation on the same values gives the same value anywhere. Which store holds it only holds in the blocks the
+//store dominates, so setting it is undone when the scope it was set in closes. Opening a scope on the way into
+//each block of a depth first walk of the dominator tree and closing it on the way out, a store is available in
+//exactly the blocks it dominates.
+struct ScopedValueTable
+{
+	struct Entry
+	{
+		bool used;
+		unsigned opcode;
+		int first, second;
+		int id;				//value number, 0 until given one
+		StoreInst* available;		//store holding the value in the open scopes, NULL if none
+	};
+
+	std::vector<Entry> slots;
+	unsigned mask;
+	std::vector<std::pair<unsigned, StoreInst*> > undo;		//slot, store it had before
+	std::vector<unsigned> scopes;		//size of undo when each open scope was opened
+
+	void init(unsigned numExpressions)
+	{
+		unsigned size = 16;
+		while(size < 2 * numExpressions)
+			size *= 2;
+		Entry empty = {false, 0, 0, 0, 0, NULL};
+		slots.assign(size, empty);
+		mask = size - 1;
+		undo.clear();
+		scopes.clear();
+	}
+
+	static unsigned hash(unsigned opcode, int first, int second)
+	{
+		unsigned h = opcode * 0x9E3779B1u;
+		h = (h ^ (unsigned)first) * 0x85EBCA6Bu;
+		h = (h ^ (unsigned)second) * 0xC2B2AE35u;
+		return h ^ (h >> 16);
+	}
+
+	//The entry of an expression, added with no number and no store if it is new
+	Entry &get(unsigned opcode, int first, int second)
+	{
+		if(Instruction::isCommutative(opcode) && first > second)
+			std::swap(first, second);
+
+		unsigned s = hash(opcode, first, second) & mask;
+		while(slots[s].used && (slots[s].opcode != opcode || slots[s].first != first || slots[s].second != second))
+			s = (s + 1) & mask;
+
+		Entry &entry = slots[s];
+		if(!entry.used)
+		{
+			entry.used = true;
+			entry.opcode = opcode;
+			entry.first = first;
+			entry.second = second;
+		}
+		return entry;
+	}
+
+	//Make store hold the value of an expression until the open scope closes
+	void setAvailable(Entry &entry, StoreInst* store)
+	{
+		undo.push_back(std::make_pair((unsigned)(&entry - &slots[0]), entry.available));
+		entry.available = store;
+	}
+
+	void openScope()
+	{
+		scopes.push_back(undo.size());
+	}
+
+	void closeScope()
+	{
+		while(undo.size() > scopes.back())
+		{
+			slots[undo.back().first].available = undo.back().second;
+			undo.pop_back();
+		}
+		scopes.pop_back();
+	}
+};
+
+#endif
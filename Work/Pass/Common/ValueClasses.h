@@ -0,0 +1,80 @@
+#ifndef VALUECLASSES_H
+#define VALUECLASSES_H
+
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Constants.h"
+#include <algorithm>
+#include <map>
+
+using namespace llvm;
+
+//Classes of value numbers known to be the same value, with union-find, and the value standing for each class.
+//
+//Classes are merged by union by rank, and finding a class halves the path to its root as it goes, so a series of
+//merges and finds takes close to constant time each. Each class keeps one value to stand for it: a constant if one
+//is stored in the class, otherwise the first store of the class. Rewriting checks to use the values standing for
+//the classes of their operands makes checks of the same values the same check.
+struct ValueClasses
+{
+	std::map<int, int> parent;
+	std::map<int, int> rank;
+	std::map<int, Value*> representative;		//root -> constant or store standing for the class
+
+	int find(int id)
+	{
+		std::map<int, int>::iterator p = parent.find(id);
+		if(p == parent.end()) return id;
+		while(p->second != id)
+		{
+			std::map<int, int>::iterator grand = parent.find(p->second);
+			p->second = grand->second;
+			id = p->second;
+			p = parent.find(id);
+		}
+		return id;
+	}
+
+	void unite(int a, int b)
+	{
+		a = find(a);
+		b = find(b);
+		if(a == b) return;
+		parent[a] = a;
+		parent[b] = b;
+		if(rank[a] < rank[b]) std::swap(a, b);
+		parent[b] = a;
+		if(rank[a] == rank[b]) rank[a]++;
+
+		//The merged class keeps a constant if either had one
+		std::map<int, Value*>::iterator other = representative.find(b);
+		if(other != representative.end())
+		{
+			if(representative.count(a) == 0 || (!isa<Constant>(representative[a]) && isa<Constant>(other->second)))
+				representative[a] = other->second;
+			representative.erase(other);
+		}
+	}
+
+	//A store of a value of class id
+	void addStore(int id, StoreInst* store)
+	{
+		int root = find(id);
+		std::map<int, Value*>::iterator found = representative.find(root);
+		if(isa<Constant>(store->getValueOperand()))
+		{
+			if(found == representative.end() || !isa<Constant>(found->second))
+				representative[root] = store->getValueOperand();
+		}
+		else if(found == representative.end())
+			representative[root] = store;
+	}
+
+	//The constant or store standing for the class of id, NULL if nothing was stored in it
+	Value* getRepresentative(int id)
+	{
+		std::map<int, Value*>::iterator found = representative.find(find(id));
+		return found == representative.end() ? NULL : found->second;
+	}
+};
+
+#endif
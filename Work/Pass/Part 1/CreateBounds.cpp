@@ -1,21 +1,31 @@
 #define is64 true
+#define fusedCheck true		//Emit one unsigned compare per access where possible
 
 #include "llvm/IR/Function.h"
 #include "llvm/Support/InstIterator.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Operator.h"
 #include "llvm/Pass.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/DebugInfo.h"
+#include "llvm/Support/GetElementPtrTypeIterator.h"
+#include "../Common/ArraySize.h"
+#include "../Common/Intervals.h"
 #include <map>
 #include <set>
 #include <queue>
+#include <vector>
 
 using namespace llvm;
 using std::map;
 using std::set;
 using std::queue;
+using std::vector;
+using std::pair;
+using std::make_pair;
 
 namespace
 {
@@ -25,9 +35,285 @@ namespace
 		CreateBounds() : FunctionPass(ID){}
 
 		map<Value*, Value*> arraySizeMap;
+		ArraySize heapSizes;
+		Intervals ranges;		//ranges of the integers in the function before any check is added
 		set<BasicBlock*> visited;
 		BasicBlock* errorBlock;
 
+		//Number of checks, blocks and branches added by each mode in the current function
+		int fusedChecks, fusedBlocks, fusedBranches;
+		int splitChecks, splitBlocks, splitBranches;
+		int provenChecks;
+
+		//Get the shared exit block, creating it on first use
+		BasicBlock* getErrorBlock(Function &F, BasicBlock* block){
+			if(errorBlock == NULL)
+			{
+				errorBlock = BasicBlock::Create(block->getContext(), Twine(block->getName() + "exit"), &F);
+				ReturnInst::Create(block->getContext(),
+					ConstantInt::get(IntegerType::get(block->getContext(), 32), 0), errorBlock);
+			}
+			return errorBlock;
+		}
+
+		//Rows already checked on the path into each block, as (index variable, size) pairs
+		map<BasicBlock*, set<pair<Value*, Value*> > > checkedRows;
+
+		//A stack variable whose address is only loaded from and stored to, so nothing else can change it
+		bool isPrivateSlot(Value* value){
+			if (!isa<AllocaInst>(value)) return false;
+			for (Value::use_iterator u = value->use_begin(); u != value->use_end(); ++u){
+				if (isa<LoadInst>(*u)) continue;
+				StoreInst* store = dyn_cast<StoreInst>(*u);
+				if (store == NULL || store->getPointerOperand() != value) return false;
+			}
+			return true;
+		}
+
+		//Is the variable stored to between a load of it and the access using the load, as in "a[i++]". The load is
+		//found walking back from the access through single predecessors, if it is not found the answer is yes
+		bool isStoredSince(LoadInst* load, Instruction* access){
+			BasicBlock* block = access->getParent();
+			BasicBlock::iterator i = access;
+			while (true){
+				while (i != block->begin()){
+					--i;
+					if (&*i == load) return false;
+					StoreInst* store = dyn_cast<StoreInst>(i);
+					if (store != NULL && store->getPointerOperand() == load->getPointerOperand()) return true;
+				}
+				block = block->getSinglePredecessor();
+				if (block == NULL) return true;
+				i = block->end();
+			}
+		}
+
+		//Get the variable an index was loaded from, skipping casts, so reloads of an unchanged variable match.
+		//Only a single load from a private stack variable, still holding its value at the access, is looked through,
+		//anything else is its own row
+		Value* getIndexBase(Value* value, Instruction* access){
+			while (CastInst* castInst = dyn_cast<CastInst>(value)){
+				value = castInst->getOperand(0);
+			}
+			if (LoadInst* load = dyn_cast<LoadInst>(value)){
+				if (isPrivateSlot(load->getPointerOperand()) && !isStoredSince(load, access)){
+					return load->getPointerOperand();
+				}
+			}
+			return value;
+		}
+
+		//A store to a variable invalidates the checks made with it. A store through any other pointer may change
+		//any variable whose address was taken, so it invalidates them all
+		void forgetChecks(BasicBlock* block, Value* variable){
+			set<pair<Value*, Value*> > &checked = checkedRows[block];
+			if (!isa<AllocaInst>(variable)){
+				checked.clear();
+				return;
+			}
+			for (set<pair<Value*, Value*> >::iterator i = checked.begin(); i != checked.end();){
+				if (i->first == variable || i->second == variable){
+					checked.erase(i++);
+				}else{
+					++i;
+				}
+			}
+		}
+
+		//Remove a size load that ended up not being used by a check
+		void dropUnused(Value* value){
+			while (Instruction* inst = dyn_cast<Instruction>(value)){
+				if (!inst->use_empty() || !(isa<CastInst>(inst) || isa<LoadInst>(inst))) break;
+				value = inst->getOperand(0);
+				ranges.values.erase(inst);
+				inst->eraseFromParent();
+			}
+		}
+
+		//Match the size to the type of the index
+		Value* castSize(Value* size, Value* index, Instruction* insertBefore){
+			if (size->getType() == index->getType()){
+				return size;
+			}
+			if (Constant* constSize = dyn_cast<Constant>(size)){
+				return ConstantExpr::getIntegerCast(constSize, index->getType(), false);
+			}
+			return CastInst::CreateIntegerCast(size, index->getType(), false, "heapsize", insertBefore);
+		}
+
+		//Find the size of each dimension indexed by the GEP. The first index steps over whole objects,
+		//so it is only checked for runtime sized arrays. Each later index into an array type is checked
+		//against that array, including arrays nested inside structs.
+		void getDimensions(GEPOperator* getInst, Instruction* insertBefore, vector<pair<Value*, Value*> > &dimensions){
+			Value* pointer = getInst->getPointerOperand();
+			gep_type_iterator type = gep_type_begin(getInst);
+			for (User::op_iterator idx = getInst->idx_begin(); idx != getInst->idx_end(); ++idx, ++type){
+				Value* index = *idx;
+
+				if (idx == getInst->idx_begin()){
+					//Indexing the object itself is always in bounds
+					ConstantInt* CI = dyn_cast<ConstantInt>(index);
+					if (CI != NULL && CI->isZero()) continue;
+
+					//Runtime sized array on the stack or the heap
+					Value* size = NULL;
+					AllocaInst* alloc = dyn_cast<AllocaInst>(pointer);
+					if (alloc != NULL && alloc->isArrayAllocation()){
+						size = arraySizeMap[alloc];
+					}else if (alloc == NULL && !isa<Constant>(pointer)){
+						size = heapSizes.getSize(pointer, insertBefore);
+					}
+					if (size != NULL){
+						dimensions.push_back(make_pair(index, castSize(size, index, insertBefore)));
+					}
+					continue;
+				}
+
+				//Fields of structs are constants and always in bounds
+				ArrayType* at = dyn_cast<ArrayType>(*type);
+				if (at == NULL) continue;
+
+				Value* size = NULL;
+				if (at->getNumElements() > 0){
+					size = ConstantInt::get(index->getType(), at->getNumElements(), false);
+				}else if (idx == getInst->idx_begin() + 1){
+					//An extern array declared without a size, use the size of its definition if it was linked in
+					Value* base = pointer->stripPointerCasts();
+					if (isa<GlobalVariable>(base) && arraySizeMap.find(base) != arraySizeMap.end()){
+						size = castSize(arraySizeMap[base], index, insertBefore);
+					}
+				}
+				if (size != NULL){
+					dimensions.push_back(make_pair(index, size));
+				}
+			}
+		}
+
+		//Get the source line of an instruction, 0 without debug info
+		unsigned getLine(Instruction* inst){
+			unsigned Line = 0;
+			if (MDNode *N = inst->getMetadata("dbg")) {
+				DILocation Loc(N);                     
+				Line = Loc.getLineNumber();
+			}
+			return Line;
+		}
+
+		//Print an error for a constant index outside a constant size
+		void reportStatic(Instruction* inst, Value* array, unsigned dimension, ConstantInt* CI, ConstantInt* CI2){
+			int arrayIndex = CI->getSExtValue(); 	//Pull out the array index
+			int arraySize = CI2->getZExtValue(); 	//Pull out the array index
+
+			//Check size of array vs index
+			if (arrayIndex>=arraySize || arrayIndex<0){
+
+				//Get line number
+				unsigned Line = getLine(inst);
+
+				//Print error
+				errs()<<"Index outside of array bounds\n Line:"<<Line<<"\n Access index " <<arrayIndex<<" of dimension "<<dimension<<" of array "<<array->stripPointerCasts()->getName()<<" of size "<<arraySize<<"\n\n";
+			}
+		}
+
+		//Print an error for an index whose every possible value is outside the array. The check is still emitted.
+		void reportRange(Instruction* inst, Value* array, unsigned dimension, Interval index, Interval size){
+			errs()<<"Index always outside of array bounds\n Line:"<<getLine(inst)<<"\n Access index in ["<<index.lo<<", "<<index.hi<<"] of dimension "<<dimension<<" of array "<<array->stripPointerCasts()->getName()<<" of size at most "<<size.hi<<"\n\n";
+		}
+
+		//Check the constant GEPs in an operand of inst, they may be nested in casts
+		void checkConstantExpr(ConstantExpr* CE, Instruction* inst){
+			if (CE->getOpcode() == Instruction::GetElementPtr){
+				vector<pair<Value*, Value*> > dimensions;
+				getDimensions(cast<GEPOperator>(CE), inst, dimensions);
+				for (unsigned d = 0; d < dimensions.size(); d++){
+					ConstantInt* CI = dyn_cast<ConstantInt>(dimensions[d].first);
+					ConstantInt* CI2 = dyn_cast<ConstantInt>(dimensions[d].second);
+					if (CI != NULL && CI2 != NULL){
+						reportStatic(inst, CE->getOperand(0), d, CI, CI2);
+					}
+				}
+			}
+			for (unsigned op = 0; op < CE->getNumOperands(); op++){
+				if (ConstantExpr* inner = dyn_cast<ConstantExpr>(CE->getOperand(op))){
+					checkConstantExpr(inner, inst);
+				}
+			}
+		}
+
+		//Module stage: record the size of every global array before the functions are visited.
+		//After linking, uses of an extern array from other files refer to the definition through a cast.
+		virtual bool doInitialization(Module &M){
+			for (Module::global_iterator GV = M.global_begin(); GV != M.global_end(); ++GV){
+				ArrayType *at = dyn_cast<ArrayType>(GV->getType()->getElementType());
+				if (at == NULL || at->getNumElements() == 0) continue;
+
+				int arraySize = at->getNumElements();
+#if is64
+				ConstantInt* newValue = llvm::ConstantInt::get(llvm::IntegerType::get(M.getContext(), 64),arraySize,false);
+#else
+				ConstantInt* newValue = llvm::ConstantInt::get(llvm::IntegerType::get(M.getContext(), 32),arraySize,false);
+#endif
+				arraySizeMap[GV] = newValue;
+			}
+			return false;
+		}
+
+		//The single unsigned compare is only valid if the size can not be negative
+		bool isNonNegative(Value* size){
+			if (ConstantInt* CI = dyn_cast<ConstantInt>(size)){
+				return !CI->isNegative();
+			}
+			return heapSizes.isNonNegative(size);
+		}
+
+		//Check 0 <= index < size with one unsigned compare, a negative index wraps to a value larger than any size
+		BasicBlock* emitFusedCheck(Function &F, BasicBlock* block, Instruction* inst, Value* index, Value* size){
+			BasicBlock* exitBlock = getErrorBlock(F, block);
+
+			ICmpInst* boundCheck =  new ICmpInst(inst, CmpInst::ICMP_ULT, index, size, Twine("CmpTestBound"));
+			BasicBlock* followingBlock = block->splitBasicBlock(inst, Twine(block->getName() + "valid"));
+
+			//Replace the temporary terminator with the check
+			block->getTerminator()->eraseFromParent();
+			BranchInst::Create(followingBlock, exitBlock, boundCheck, block);
+
+			fusedChecks++;
+			fusedBlocks += 1;
+			fusedBranches += 1;
+
+			return followingBlock;
+		}
+
+		//Check the upper bound in the current block and the lower bound in a new block
+		BasicBlock* emitSplitCheck(Function &F, BasicBlock* block, Instruction* inst, Value* index, Value* size){
+			BasicBlock* exitBlock = getErrorBlock(F, block);
+
+			//Check to see if the index is less than the size
+			ICmpInst* upperBoundCheck =  new ICmpInst(inst, CmpInst::ICMP_SLT, index, size, Twine("CmpTestUpper"));
+			BasicBlock* followingBlock = block->splitBasicBlock(inst, Twine(block->getName() + "valid"));
+
+			//Check to see if index is negative
+			BasicBlock* secondCheckBlock = BasicBlock::Create(block->getContext(), Twine(block->getName() + "lowerBoundCheck"), &F);
+#if is64
+			ConstantInt* zeroValue = llvm::ConstantInt::get(llvm::IntegerType::get(block->getContext(),   64),-1,false);
+#else
+			ConstantInt* zeroValue = llvm::ConstantInt::get(llvm::IntegerType::get(block->getContext(),   32),-1,false);
+#endif
+			ICmpInst* lowerBoundCheck =  new ICmpInst(*secondCheckBlock, CmpInst::ICMP_SGT, index, zeroValue, Twine("CmpTestLower"));
+			BranchInst::Create(followingBlock, exitBlock, lowerBoundCheck, secondCheckBlock);
+
+			//Modify exisiting block
+			block->getTerminator()->eraseFromParent(); //Remove the temporary terminator
+			//Add our own terminator condition
+			BranchInst::Create(secondCheckBlock, exitBlock, upperBoundCheck, block);
+
+			splitChecks++;
+			splitBlocks += 2;
+			splitBranches += 2;
+
+			return followingBlock;
+		}
+
 		virtual bool runOnFunction(Function &F){
 
 			//Queue of blocks
@@ -35,6 +321,17 @@ namespace
 			nextBlocks.push(&F.getEntryBlock());
 
 			errorBlock = NULL;
+			checkedRows.clear();
+
+			fusedChecks = fusedBlocks = fusedBranches = 0;
+			splitChecks = splitBlocks = splitBranches = 0;
+			provenChecks = 0;
+
+			//Find the size of every heap allocation
+			heapSizes.run(F, true);
+
+			//Find the range of every index, so checks that can never fail are not emitted
+			ranges.run(F);
 
 			//Visit until nore more blocks left
 			while(!nextBlocks.empty()){
@@ -58,7 +355,8 @@ namespace
 						
 						PointerType *pt = alloc->getType();
 						//If it is an array and the previous if statement did not catch it
-						if (ArrayType *at = dyn_cast<ArrayType>(pt->getElementType())){
+						ArrayType *at = dyn_cast<ArrayType>(pt->getElementType());
+						if (at != NULL && !alloc->isArrayAllocation()){
 							//get size							
 							int arraySize = at->getNumElements();
 #if is64
@@ -73,74 +371,82 @@ namespace
 						}
 					}
 
+					//A store or call can change an index that was checked earlier on this path
+					if(StoreInst* store = dyn_cast<StoreInst>(inst)){
+						forgetChecks(block, store->getPointerOperand());
+					}
+					if(isa<CallInst>(inst)){
+						checkedRows[block].clear();
+					}
+
+					//Constant indexing of globals is folded into the operands, it can only be checked statically
+					for (unsigned op = 0; op < inst->getNumOperands(); op++){
+						if (ConstantExpr* CE = dyn_cast<ConstantExpr>(inst->getOperand(op))){
+							checkConstantExpr(CE, inst);
+						}
+					}
+
 					//An array element is being retrieved. We need to check if it's inbounds
 					if(&*inst != &block->front()){
 						if(GetElementPtrInst* getInst = dyn_cast<GetElementPtrInst>(inst)){
-							//Get index into array
-							int indexOperand = getInst->getNumIndices();
-							llvm::ConstantInt* CI = dyn_cast<llvm::ConstantInt>(getInst->getOperand(indexOperand));
-							
-							//Get info about array
-							Value *sizeArray = arraySizeMap[getInst->getOperand(0)];
-							llvm::ConstantInt* CI2 = dyn_cast<llvm::ConstantInt>(sizeArray);
-
-							if (CI==NULL || CI2==NULL) {		//Runtime analysis
-
-								//Create a new exit block
-								if(errorBlock == NULL)
-								{
-									errorBlock = BasicBlock::Create(block->getContext(), Twine(block->getName() + "exit"), &F);
-									ReturnInst::Create(block->getContext(), 
-										ConstantInt::get(IntegerType::get(block->getContext(), 32), 0), errorBlock);
-								}
-
-									
-								//Check to see if the index is less than the size
-								ICmpInst* upperBoundCheck =  new ICmpInst(getInst, CmpInst::ICMP_SLT, getInst->getOperand(indexOperand), sizeArray, Twine("CmpTestUpper"));
-								BasicBlock* followingBlock = block->splitBasicBlock(inst, Twine(block->getName() + "valid"));
-
-
-								//Check to see if index is negative
-								BasicBlock* secondCheckBlock = BasicBlock::Create(block->getContext(), Twine(block->getName() + "lowerBoundCheck"), &F);
-#if is64
-								ConstantInt* zeroValue = llvm::ConstantInt::get(llvm::IntegerType::get(block->getContext(),   64),-1,false);
-#else
-								ConstantInt* zeroValue = llvm::ConstantInt::get(llvm::IntegerType::get(block->getContext(),   32),-1,false);
-#endif
-								ICmpInst* lowerBoundCheck =  new ICmpInst(*secondCheckBlock, CmpInst::ICMP_SGT, getInst->getOperand(indexOperand), zeroValue, Twine("CmpTestLower"));
-								BranchInst::Create(followingBlock, errorBlock, lowerBoundCheck, secondCheckBlock);
-
-
-
-								//Modify exisiting block
-								block->getTerminator()->eraseFromParent(); //Remove the temporary terminator
-								//Add our own terminator condition
-								BranchInst::Create(secondCheckBlock, errorBlock, upperBoundCheck, block);
+							//Pair every index with the size of the dimension it indexes
+							vector<pair<Value*, Value*> > dimensions;
+							getDimensions(cast<GEPOperator>(getInst), getInst, dimensions);
+
+							//Each runtime check splits the block, the following checks go in the new block
+							BasicBlock* checkBlock = block;
+							for (unsigned d = 0; d < dimensions.size(); d++){
+								Value *index = dimensions[d].first;
+								Value *sizeArray = dimensions[d].second;
+
+								llvm::ConstantInt* CI = dyn_cast<llvm::ConstantInt>(index);
+								llvm::ConstantInt* CI2 = dyn_cast<llvm::ConstantInt>(sizeArray);
+
+								if (CI==NULL || CI2==NULL) {		//Runtime analysis
+
+									//The ranges of the index and size decide it
+									Interval indexRange = ranges.get(index);
+									Interval sizeRange = ranges.get(sizeArray);
+									if (indexRange.lo >= 0 && indexRange.hi < sizeRange.lo){
+										provenChecks++;
+										dropUnused(sizeArray);
+										continue;
+									}
+									if (indexRange.hi < 0 || indexRange.lo >= sizeRange.hi){
+										reportRange(getInst, getInst->getPointerOperand(), d, indexRange, sizeRange);
+									}
 
-								nextBlocks.push(followingBlock);
-								break;
-							}else{		//Static analysis - constant size and index
-								
-								int arrayIndex = CI->getZExtValue(); 	//Pull out the array index
-								int arraySize = CI2->getZExtValue(); 	//Pull out the array index
-
-								//Check size of array vs index
-								if (arrayIndex>=arraySize || arrayIndex<0){
-
-									//Get line number
-									unsigned Line;
-									if (MDNode *N = getInst->getMetadata("dbg")) {
-										DILocation Loc(N);                     
-										Line = Loc.getLineNumber();
+									//The same row was already checked on this path
+									pair<Value*, Value*> row(getIndexBase(index, getInst), getIndexBase(sizeArray, getInst));
+									if (checkedRows[checkBlock].count(row)){
+										dropUnused(sizeArray);
+										continue;
 									}
 
-									//Print error
-									errs()<<"Index outside of array bounds\n Line:"<<Line<<"\n Access index " <<arrayIndex<<" of array "<<getInst->getOperand(0)->getName()<<" of size "<<arraySize<<"\n\n";
+									//Fuse the two compares when the size is known to be non-negative
+									BasicBlock* followingBlock;
+									if (fusedCheck && isNonNegative(sizeArray)){
+										followingBlock = emitFusedCheck(F, checkBlock, inst, index, sizeArray);
+									}else{
+										followingBlock = emitSplitCheck(F, checkBlock, inst, index, sizeArray);
+									}
 
-								}				
+									//The checks hold for the rest of the path
+									checkedRows[followingBlock] = checkedRows[checkBlock];
+									checkedRows[followingBlock].insert(row);
+									checkBlock = followingBlock;
+								}else{		//Static analysis - constant size and index
+									
+									reportStatic(getInst, getInst->getPointerOperand(), d, CI, CI2);
 
+								}
 							}
 
+							//Continue in the block after the last check
+							if (checkBlock != block){
+								nextBlocks.push(checkBlock);
+								break;
+							}
 						}
 					}
 
@@ -155,6 +461,16 @@ namespace
 
 			}
 
+			//Report the cost of the checks for each mode, the shared exit block is counted once
+			if (provenChecks > 0){
+				errs()<<F.getName()<<": proven "<<provenChecks<<" checks\n";
+			}
+			if (errorBlock != NULL){
+				errs()<<F.getName()<<": fused "<<fusedChecks<<" checks, "<<fusedBlocks<<" blocks, "<<fusedBranches<<" branches\n";
+				errs()<<F.getName()<<": split "<<splitChecks<<" checks, "<<splitBlocks<<" blocks, "<<splitBranches<<" branches\n";
+				errs()<<F.getName()<<": exit 1 block\n\n";
+			}
+
 			//Print out resulting assembly
 			for(inst_iterator i = inst_begin(F), e = inst_end(F); i != e; ++i){
        				//errs()<<*i<<'\n';
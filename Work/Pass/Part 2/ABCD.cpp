@@ -0,0 +1,416 @@
+#include "llvm/IR/Function.h"
+#include "llvm/Support/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Analysis/Dominators.h"
+#include "llvm/ADT/DepthFirstIterator.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "../Common/LoopChecks.h"
+#include "../Common/Intervals.h"
+#include <map>
+#include <set>
+#include <vector>
+#include <stdint.h>
+
+using namespace llvm;
+using std::map;
+using std::set;
+using std::vector;
+using std::pair;
+using std::make_pair;
+
+//Array Bounds Checks on Demand (Bodik, Gupta, Sarkar).
+//
+//Each check is a question about an inequality graph over SSA values: an edge u -> v of weight w says
+//v - u <= w. The upper half "index < size" holds if there is a path from size to index of weight <= -1,
+//the lower half "index >= 0" is the same question on a graph of the negated values. Branches add pi nodes
+//that carry their condition into the blocks they guard. The graph is only built around the values a
+//question reaches, and answers are kept for later questions, so functions with many checks and few loops
+//stay cheap. In -O0 code the values are loads of stack slots: a load is given the value last stored to the
+//slot, or an earlier load of it, and the range of the slot when it is the induction variable of a loop.
+namespace
+{
+	struct ABCD : public FunctionPass
+	{
+		static char ID;
+		ABCD() : FunctionPass(ID){}
+
+		struct Edge
+		{
+			Value* from;
+			int64_t weight;
+		};
+
+		//The condition a pi node carries: "pi pred other"
+		struct Pi
+		{
+			Value* original;
+			CmpInst::Predicate pred;
+			Value* other;
+		};
+
+		//Known answers of "v - a <= c" for one pair: true from trueAt up, false from falseAt down
+		struct Answer
+		{
+			int64_t trueAt;
+			int64_t falseAt;
+			Answer() : trueAt(INT64_MAX), falseAt(INT64_MIN) {}
+		};
+
+		map<PHINode*, Pi> piNodes;
+		map<pair<Value*, bool>, vector<Edge> > inEdges;
+		map<pair<pair<Value*, Value*>, bool>, Answer> answers;
+
+		//Values on the current proof path, with the weight they were asked for
+		map<Value*, int64_t> active;
+		bool usedActive;
+
+		LoopChecks loopChecks;
+		LoopInfo* LI;
+
+		//Insert a pi node for value at the start of block and make the uses it dominates use it instead
+		void insertPi(DominatorTree &DT, BasicBlock* block, BasicBlock* pred, Value* value, CmpInst::Predicate relation, Value* other)
+		{
+			if(isa<Constant>(value) || !value->getType()->isIntegerTy()) return;
+
+			PHINode* pi = PHINode::Create(value->getType(), 1, Twine(value->getName() + ".pi"), block->begin());
+			pi->addIncoming(value, pred);
+
+			vector<Use*> dominated;
+			for(Value::use_iterator u = value->use_begin(); u != value->use_end(); ++u)
+			{
+				Instruction* user = cast<Instruction>(*u);
+				if(user == pi) continue;
+
+				BasicBlock* useBlock = user->getParent();
+				if(PHINode* phi = dyn_cast<PHINode>(user))
+					useBlock = phi->getIncomingBlock(u.getUse());
+				if(DT.dominates(block, useBlock))
+					dominated.push_back(&u.getUse());
+			}
+			for(unsigned i = 0; i < dominated.size(); i++)
+				dominated[i]->set(pi);
+
+			Pi info;
+			info.original = value;
+			info.pred = relation;
+			info.other = other;
+			piNodes[pi] = info;
+		}
+
+		//Give both operands of every compared branch a pi node in each successor the branch alone reaches.
+		//Blocks are visited in dominator order, so the pi nodes of nested branches refine the outer ones.
+		void insertPiNodes(Function &F)
+		{
+			DominatorTree &DT = getAnalysis<DominatorTree>();
+			for(df_iterator<DomTreeNode*> node = df_begin(DT.getRootNode()); node != df_end(DT.getRootNode()); ++node)
+			{
+				BasicBlock* block = node->getBlock();
+				BranchInst* branch = dyn_cast<BranchInst>(block->getTerminator());
+				if(branch == NULL || !branch->isConditional()) continue;
+				ICmpInst* cmp = dyn_cast<ICmpInst>(branch->getCondition());
+				if(cmp == NULL) continue;
+
+				for(unsigned s = 0; s < 2; s++)
+				{
+					BasicBlock* succ = branch->getSuccessor(s);
+					if(succ->getSinglePredecessor() != block) continue;
+
+					CmpInst::Predicate pred = s == 0 ? cmp->getPredicate() : cmp->getInversePredicate();
+					Value* left = cmp->getOperand(0);
+					Value* right = cmp->getOperand(1);
+					insertPi(DT, succ, block, left, pred, right);
+					insertPi(DT, succ, block, right, CmpInst::getSwappedPredicate(pred), left);
+				}
+			}
+		}
+
+		void removePiNodes()
+		{
+			for(map<PHINode*, Pi>::iterator itr = piNodes.begin(); itr != piNodes.end(); itr++)
+			{
+				itr->first->replaceAllUsesWith(itr->second.original);
+				itr->first->eraseFromParent();
+			}
+			piNodes.clear();
+		}
+
+		void addEdge(vector<Edge> &edges, Value* from, int64_t weight)
+		{
+			Edge edge;
+			edge.from = from;
+			edge.weight = weight;
+			edges.push_back(edge);
+		}
+
+		//What an instruction says a stack variable holds at that point: the value stored to it, an earlier load of
+		//it, or the pi node of such a load. NULL if it says nothing.
+		Value* getSlotValue(Instruction* inst, Value* slot)
+		{
+			if(StoreInst* store = dyn_cast<StoreInst>(inst))
+				return store->getPointerOperand() == slot ? store->getValueOperand() : NULL;
+			if(LoadInst* load = dyn_cast<LoadInst>(inst))
+				return load->getPointerOperand() == slot ? load : NULL;
+
+			PHINode* phi = dyn_cast<PHINode>(inst);
+			if(phi == NULL) return NULL;
+			map<PHINode*, Pi>::iterator pi = piNodes.find(phi);
+			if(pi == piNodes.end()) return NULL;
+			LoadInst* original = dyn_cast<LoadInst>(pi->second.original);
+			return original != NULL && original->getPointerOperand() == slot ? phi : NULL;
+		}
+
+		//A load of a stack variable whose address does not escape equals the first value found walking back on the
+		//line of single predecessors. In the body of a counted loop it is also within the range of the induction
+		//variable, unless the variable was stored earlier in the same block.
+		void addSlotEdges(vector<Edge> &edges, LoadInst* load, bool upper)
+		{
+			AllocaInst* slot = dyn_cast<AllocaInst>(load->getPointerOperand());
+			if(slot == NULL || !Intervals::isTrackable(slot)) return;
+
+			Value* same = NULL;
+			bool storedBefore = false;
+			set<BasicBlock*> seen;
+			for(BasicBlock* block = load->getParent(); same == NULL && block != NULL && seen.insert(block).second; block = block->getSinglePredecessor())
+			{
+				BasicBlock::iterator i = block == load->getParent() ? BasicBlock::iterator(load) : block->end();
+				while(same == NULL && i != block->begin())
+				{
+					--i;
+					same = getSlotValue(i, slot);
+					storedBefore = same != NULL && block == load->getParent() && isa<StoreInst>(i);
+				}
+			}
+			if(same != NULL)
+				addEdge(edges, same, 0);
+
+			for(Loop* loop = LI->getLoopFor(load->getParent()); loop != NULL && !storedBefore; loop = loop->getParentLoop())
+			{
+				int64_t lo, hi;
+				if(load->getParent() == loop->getHeader() || !loopChecks.getInductionRange(loop, slot, lo, hi)) continue;
+				addEdge(edges, ConstantInt::get(load->getType(), upper ? hi : lo), 0);
+				break;
+			}
+		}
+
+		//The edges into a value, read from its definition the first time it is asked for. On the graph of negated
+		//values (upper false) "v >= u + w" becomes an edge of weight -w.
+		vector<Edge> &getInEdges(Value* v, bool upper)
+		{
+			pair<Value*, bool> key(v, upper);
+			map<pair<Value*, bool>, vector<Edge> >::iterator found = inEdges.find(key);
+			if(found != inEdges.end()) return found->second;
+
+			vector<Edge> &edges = inEdges[key];
+			int sign = upper ? 1 : -1;
+
+			if(PHINode* phi = dyn_cast<PHINode>(v))
+			{
+				map<PHINode*, Pi>::iterator pi = piNodes.find(phi);
+				if(pi == piNodes.end())
+				{
+					for(unsigned i = 0; i < phi->getNumIncomingValues(); i++)
+						addEdge(edges, phi->getIncomingValue(i), 0);
+					return edges;
+				}
+
+				//A pi node is its original value, limited by the condition
+				addEdge(edges, pi->second.original, 0);
+				Value* other = pi->second.other;
+				switch(pi->second.pred)
+				{
+				case CmpInst::ICMP_SLT:
+					if(upper) addEdge(edges, other, -1);
+					break;
+				case CmpInst::ICMP_SLE:
+					if(upper) addEdge(edges, other, 0);
+					break;
+				case CmpInst::ICMP_SGT:
+					if(!upper) addEdge(edges, other, -1);
+					break;
+				case CmpInst::ICMP_SGE:
+					if(!upper) addEdge(edges, other, 0);
+					break;
+				case CmpInst::ICMP_EQ:
+					addEdge(edges, other, 0);
+					break;
+				default:
+					break;
+				}
+				return edges;
+			}
+
+			if(LoadInst* load = dyn_cast<LoadInst>(v))
+			{
+				addSlotEdges(edges, load, upper);
+				return edges;
+			}
+
+			if(SExtInst* sext = dyn_cast<SExtInst>(v))
+			{
+				addEdge(edges, sext->getOperand(0), 0);
+				return edges;
+			}
+
+			BinaryOperator* binary = dyn_cast<BinaryOperator>(v);
+			if(binary == NULL) return edges;
+			ConstantInt* amount = dyn_cast<ConstantInt>(binary->getOperand(1));
+			Value* base = binary->getOperand(0);
+			if(binary->getOpcode() == Instruction::Add && amount == NULL)
+			{
+				amount = dyn_cast<ConstantInt>(binary->getOperand(0));
+				base = binary->getOperand(1);
+			}
+			if(amount == NULL) return edges;
+
+			if(binary->getOpcode() == Instruction::Add)
+				addEdge(edges, base, sign * amount->getSExtValue());
+			else if(binary->getOpcode() == Instruction::Sub)
+				addEdge(edges, base, -sign * amount->getSExtValue());
+			return edges;
+		}
+
+		//Is "v - a <= c"? On the graph of negated values (upper false) this asks "a - v <= c".
+		bool prove(Value* a, Value* v, int64_t c, bool upper)
+		{
+			if(v == a) return c >= 0;
+
+			ConstantInt* constA = dyn_cast<ConstantInt>(a);
+			ConstantInt* constV = dyn_cast<ConstantInt>(v);
+			if(constA != NULL && constV != NULL)
+			{
+				int64_t difference = constV->getSExtValue() - constA->getSExtValue();
+				return (upper ? difference : -difference) <= c;
+			}
+
+			Answer &answer = answers[make_pair(make_pair(a, v), upper)];
+			if(c >= answer.trueAt) return true;
+			if(c <= answer.falseAt) return false;
+
+			//A cycle back to a value on the path only helps if it does not make the question harder
+			map<Value*, int64_t>::iterator onPath = active.find(v);
+			if(onPath != active.end())
+			{
+				usedActive = true;
+				return c >= onPath->second;
+			}
+
+			vector<Edge> edges = getInEdges(v, upper);
+			if(edges.empty())
+			{
+				answer.falseAt = std::max(answer.falseAt, c);
+				return false;
+			}
+
+			//Phis need every incoming value to satisfy it, other values need one reason
+			PHINode* phi = dyn_cast<PHINode>(v);
+			bool needAll = phi != NULL && piNodes.find(phi) == piNodes.end();
+
+			bool outerUsedActive = usedActive;
+			usedActive = false;
+			active[v] = c;
+
+			bool result = needAll;
+			for(unsigned i = 0; i < edges.size(); i++)
+			{
+				bool edgeResult = prove(a, edges[i].from, c - edges[i].weight, upper);
+				if(needAll && !edgeResult)
+				{
+					result = false;
+					break;
+				}
+				if(!needAll && edgeResult)
+				{
+					result = true;
+					break;
+				}
+			}
+			active.erase(v);
+
+			//Answers that leaned on a value still being proven are only valid on this path
+			if(!usedActive)
+			{
+				Answer &stored = answers[make_pair(make_pair(a, v), upper)];
+				if(result) stored.trueAt = std::min(stored.trueAt, c);
+				else stored.falseAt = std::max(stored.falseAt, c);
+			}
+			usedActive |= outerUsedActive;
+			return result;
+		}
+
+		//Does the check hold on every execution
+		bool isRedundant(ICmpInst* cmp)
+		{
+			Value* index = cmp->getOperand(0);
+			Value* bound = cmp->getOperand(1);
+			Constant* zero = ConstantInt::get(index->getType(), 0);
+
+			usedActive = false;
+			switch(cmp->getPredicate())
+			{
+			case CmpInst::ICMP_SLT:
+				return prove(bound, index, -1, true);
+			case CmpInst::ICMP_SGT:
+				return isa<ConstantInt>(bound) && cast<ConstantInt>(bound)->isMinusOne() && prove(zero, index, 0, false);
+			case CmpInst::ICMP_ULT:
+				return prove(bound, index, -1, true) && prove(zero, index, 0, false);
+			default:
+				return false;
+			}
+		}
+
+		virtual bool runOnFunction(Function &F){
+
+			piNodes.clear();
+			inEdges.clear();
+			answers.clear();
+			active.clear();
+			LI = &getAnalysis<LoopInfo>();
+
+			insertPiNodes(F);
+
+			//Ask about every check
+			vector<ICmpInst*> redundant;
+			int numChecks = 0;
+			for(inst_iterator i = inst_begin(F), e = inst_end(F); i != e; ++i)
+			{
+				ICmpInst* cmp = dyn_cast<ICmpInst>(&*i);
+				BranchInst* branch;
+				if(cmp == NULL || !loopChecks.isBoundCheck(cmp, branch)) continue;
+
+				numChecks++;
+				if(isRedundant(cmp))
+					redundant.push_back(cmp);
+			}
+
+			//The facts the pi nodes carry hold without them, so they can go before the checks are removed
+			removePiNodes();
+
+			for(unsigned i = 0; i < redundant.size(); i++)
+			{
+				ICmpInst* cmp = redundant[i];
+				BranchInst* branch = cast<BranchInst>(*cmp->use_begin());
+				errs() << "Proved " << *cmp << " in " << cmp->getParent()->getName() << "\n";
+
+				BranchInst::Create(branch->getSuccessor(0), branch);
+				branch->eraseFromParent();
+				RecursivelyDeleteTriviallyDeadInstructions(cmp);
+			}
+
+			errs() << F.getName() << ": " << redundant.size() << " of " << numChecks << " checks removed, " << inEdges.size() << " graph nodes built\n";
+			return redundant.size() > 0;
+		}
+
+		void getAnalysisUsage(AnalysisUsage &AU) const
+		{
+			AU.addRequired<DominatorTree>();
+			AU.addRequired<LoopInfo>();
+		}
+	};
+
+	char ABCD::ID = 0;
+	static RegisterPass<ABCD> X("ABCD", "Array Bounds Checks on Demand");
+}
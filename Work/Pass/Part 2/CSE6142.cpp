@@ -9,14 +9,27 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/DebugInfo.h"
 #include "llvm/Analysis/Dominators.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/ConstantRange.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "../Common/ArraySize.h"
+#include "../Common/LoopChecks.h"
+#include "../Common/Dataflow.h"
 #include <map>
 #include <set>
 #include <queue>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
 
 using namespace llvm;
 using std::map;
 using std::set;
 using std::queue;
+using std::vector;
 
 namespace
 {
@@ -25,79 +38,373 @@ namespace
 		static char ID;
 		CSE6142() : FunctionPass(ID){}
 
-		enum state {UNCHANGED, UNKNOWN, INCREASED, DECREASED};
-
 		struct Output
 		{
 			set<Value*> outSet;
 			map<Value*, BasicBlock*> outSrc;
-			map<Value*, state> outState;
+			map<Value*, int64_t> outDelta;		//how far the variable of each fact moved since the fact was made
+		};
+
+		//How the stores of a block change a variable: by a known constant delta, or in an unknown way
+		struct Change
+		{
+			bool known;
+			int64_t delta;
+
+			Change() : known(true), delta(0) {}
+			Change(bool knownIn, int64_t deltaIn) : known(knownIn), delta(deltaIn) {}
+
+			bool isUnchanged() const { return known && delta == 0; }
+
+			//This change followed by next
+			Change then(const Change &next) const
+			{
+				if(!known || !next.known) return Change(false, 0);
+				return Change(true, delta + next.delta);
+			}
+		};
+
+		//One half of a check: "variable + offset < bound" (upper) or "variable + offset >= bound" (lower, bound constant)
+		struct Half
+		{
+			bool upper;
+			Value* var;
+			int64_t offset;
+			Value* bound;
 		};
 
 		set<BasicBlock*> visited;
 
-		map<BasicBlock*, Output* > outputs;
 		map<BasicBlock*, set<Value*>* > genSet;
-		map<BasicBlock*, Output* > inSet;
 		map<BasicBlock*, set<BasicBlock*> > pred;
-		map<BasicBlock*, map<Value*, state> > stateChanges;
+		map<BasicBlock*, map<Value*, Change> > stateChanges;
 
 		map<BasicBlock*, BasicBlock*> original;
 
+		//Checks removed as redundant, and the fact each one was replaced with
+		map<Value*, Instruction*> replacedBy;
+
+		//Sizes of heap arrays found by CreateBounds
+		ArraySize heapSizes;
+
+		//Invariance and induction variables of loops
+		LoopChecks loopChecks;
+
 		BasicBlock* errorBlock;
 
-		state getState(StoreInst* inst)
+		//Facts from the program's own branch conditions, made true on the edge into each block
+		map<BasicBlock*, vector<Instruction*> > guardFacts;
+
+		//A variable that is only assigned once, so every load of it sees the same value
+		bool isFixedSlot(Value* slot)
+		{
+			if(!isa<AllocaInst>(slot)) return false;
+			int numStores = 0;
+			for(Value::use_iterator u = slot->use_begin(); u != slot->use_end(); ++u)
+			{
+				if(isa<LoadInst>(*u)) continue;
+				StoreInst* store = dyn_cast<StoreInst>(*u);
+				if(store == NULL || store->getPointerOperand() != slot) return false;
+				numStores++;
+			}
+			return numStores == 1;
+		}
+
+		//The compared value is a variable, and it is not stored to between the load and the end of the block
+		bool isGuardedIndex(Value* value, BasicBlock* block)
 		{
-			state retn = UNCHANGED;
+			if(SExtInst* sext = dyn_cast<SExtInst>(value)) value = sext->getOperand(0);
+			LoadInst* load = dyn_cast<LoadInst>(value);
+			if(load == NULL || load->getParent() != block || !isa<AllocaInst>(load->getPointerOperand())) return false;
 
-			Value* origInst = inst->getOperand(1);
+			BasicBlock::iterator i = load;
+			for(++i; i != block->end(); ++i)
+			{
+				if(isa<CallInst>(i)) return false;
+				if(StoreInst* store = dyn_cast<StoreInst>(i))
+					if(store->getPointerOperand() == load->getPointerOperand()) return false;
+			}
+			return true;
+		}
 
-			queue<Value*> evalList;
-			evalList.push(inst->getOperand(0));
+		//Bounds of a guard must not change after it, so constants or variables assigned once
+		bool isGuardBound(Value* value)
+		{
+			if(isa<ConstantInt>(value)) return true;
+			return isFixedSlot(getBaseValue(value));
+		}
 
-			//We will track if this variable was part of the equation, or just holds the value
-			bool varModified = false;
+		//Turn "index pred bound", known true at the start of block, into facts of the form the checks use:
+		//"index < bound" for the upper half and "index > constant" for the lower half
+		void addGuardFact(BasicBlock* block, CmpInst::Predicate pred, Value* index, Value* bound)
+		{
+			Instruction* insertPoint = block->getFirstInsertionPt();
+			ConstantInt* constBound = dyn_cast<ConstantInt>(bound);
+			vector<Instruction*> &facts = guardFacts[block];
 
-			while(!evalList.empty())
+			switch(pred)
+			{
+			case CmpInst::ICMP_ULT:
+				//Unsigned below a non-negative bound also means the index is not negative
+				if(constBound == NULL || constBound->isNegative()) return;
+				facts.push_back(new ICmpInst(insertPoint, CmpInst::ICMP_SGT, index, ConstantInt::get(index->getType(), -1, true), Twine("CmpGuard")));
+				//Fall through for the upper half
+			case CmpInst::ICMP_SLT:
+				facts.push_back(new ICmpInst(insertPoint, CmpInst::ICMP_SLT, index, bound, Twine("CmpGuard")));
+				break;
+			case CmpInst::ICMP_SLE:
+				if(constBound == NULL || constBound->isMaxValue(true)) return;
+				facts.push_back(new ICmpInst(insertPoint, CmpInst::ICMP_SLT, index, ConstantInt::get(constBound->getType(), constBound->getSExtValue() + 1, true), Twine("CmpGuard")));
+				break;
+			case CmpInst::ICMP_SGT:
+				if(constBound == NULL) return;
+				facts.push_back(new ICmpInst(insertPoint, CmpInst::ICMP_SGT, index, bound, Twine("CmpGuard")));
+				break;
+			case CmpInst::ICMP_SGE:
+				if(constBound == NULL || constBound->isMinValue(true)) return;
+				facts.push_back(new ICmpInst(insertPoint, CmpInst::ICMP_SGT, index, ConstantInt::get(constBound->getType(), constBound->getSExtValue() - 1, true), Twine("CmpGuard")));
+				break;
+			default:
+				break;
+			}
+		}
+
+		//Find the branches of the program that compare a variable against a fixed bound. The successor a branch
+		//reaches only through it gets the condition (or its inverse on the false edge) as facts at its start.
+		void addGuardFacts(Function &F)
+		{
+			guardFacts.clear();
+			for(Function::iterator block = F.begin(); block != F.end(); ++block)
 			{
-				Value* val = evalList.front();
-				evalList.pop();
+				BranchInst* branch = dyn_cast<BranchInst>(block->getTerminator());
+				if(branch == NULL || !branch->isConditional()) continue;
+				ICmpInst* cmp = dyn_cast<ICmpInst>(branch->getCondition());
+				if(cmp == NULL || cmp->getName().startswith("Cmp")) continue;
 
-				if(Instruction* valInst = dyn_cast<Instruction>(val))
+				for(unsigned s = 0; s < 2; s++)
 				{
-					//Check to see how the variable is changing (Constants only)
-					if(valInst->getOpcode() == Instruction::Add || valInst->getOpcode() == Instruction::Mul)
-					{
-						//If sub and add mix, we don't know the results
-						if(retn == INCREASED || retn == UNCHANGED)
-							retn = INCREASED;
-					}
-					if(valInst->getOpcode() == Instruction::Sub 
-						|| valInst->getOpcode() == Instruction::SDiv || valInst->getOpcode() == Instruction::UDiv)
-					{
-						//If sub and add mix, we don't know the results
-						if(retn == DECREASED || retn == UNCHANGED)
-							retn = DECREASED;
-					}
+					BasicBlock* succ = branch->getSuccessor(s);
+					if(succ->getSinglePredecessor() != block || isa<PHINode>(succ->begin())) continue;
+
+					CmpInst::Predicate pred = s == 0 ? cmp->getPredicate() : cmp->getInversePredicate();
+					Value* left = cmp->getOperand(0);
+					Value* right = cmp->getOperand(1);
+					if(isGuardedIndex(left, block) && isGuardBound(right))
+						addGuardFact(succ, pred, left, right);
+					else if(isGuardedIndex(right, block) && isGuardBound(left))
+						addGuardFact(succ, CmpInst::getSwappedPredicate(pred), right, left);
+				}
+			}
+		}
 
-					//If there's a load inst, variables are involved
-					if(LoadInst* load = dyn_cast<LoadInst>(valInst))
-					{
-						//Either the original variable was modified, or an unknown dynamic variable is involved
-						if(load->getOperand(0) == origInst) varModified = true;
-						else retn = UNKNOWN;
-					}
+		//The change a store makes to its variable: "i = i + c" and "i = i - c" are known deltas, anything else is unknown
+		Change getState(StoreInst* inst)
+		{
+			int64_t offset;
+			if(loopChecks.getOffset(inst->getValueOperand(), inst->getPointerOperand(), offset))
+				return Change(true, offset);
+			return Change(false, 0);
+		}
+
+		//The change of a variable by the stores from the start of the block up to (not including) end, or from begin to the end
+		Change changeBetween(Value* var, BasicBlock* block, Instruction* begin, Instruction* end)
+		{
+			Change change;
+			bool inRange = begin == NULL;
+			for(BasicBlock::iterator i = block->begin(); i != block->end(); i++)
+			{
+				if(&*i == begin) inRange = true;
+				if(&*i == end) break;
+				if(!inRange) continue;
+				if(StoreInst* store = dyn_cast<StoreInst>(i))
+					if(store->getPointerOperand() == var)
+						change = change.then(getState(store));
+			}
+			return change;
+		}
 
-					int numOp = valInst->getNumOperands();
-					for(int i = 0; i < numOp; i++)
-						evalList.push(valInst->getOperand(i));
+		//Split an index into the value a constant offset is added to and the offset, "sext(i + 2)" gives the load of i and 2
+		Value* stripOffset(Value* index, int64_t &offset)
+		{
+			offset = 0;
+			while(true)
+			{
+				if(SExtInst* sext = dyn_cast<SExtInst>(index))
+				{
+					index = sext->getOperand(0);
+					continue;
 				}
+				BinaryOperator* binary = dyn_cast<BinaryOperator>(index);
+				if(binary == NULL) break;
+				ConstantInt* amount = dyn_cast<ConstantInt>(binary->getOperand(1));
+				if(binary->getOpcode() == Instruction::Add && amount != NULL)
+					offset += amount->getSExtValue();
+				else if(binary->getOpcode() == Instruction::Sub && amount != NULL)
+					offset -= amount->getSExtValue();
+				else break;
+				index = binary->getOperand(0);
 			}
+			return index;
+		}
 
-			//We don't know what this value is in relation to the original variable
-			if(!varModified) retn = UNKNOWN;
+		//Split an index into the variable it was loaded from and a constant offset, "sext(i + 2)" gives i and 2
+		Value* getIndexVariable(Value* index, int64_t &offset)
+		{
+			index = stripOffset(index, offset);
+			if(LoadInst* load = dyn_cast<LoadInst>(index))
+				return load->getPointerOperand();
+			return index;
+		}
 
-			return retn;
+		//How far the variable of a compare moved between the load of its index and the compare, as in "a[i++]". The
+		//load must be on the line of single predecessors leading to the compare, otherwise the change is unknown
+		Change changeSinceLoad(CmpInst* cmp)
+		{
+			int64_t offset;
+			LoadInst* load = dyn_cast<LoadInst>(stripOffset(cmp->getOperand(0), offset));
+			if(load == NULL) return Change();
+
+			Value* var = load->getPointerOperand();
+			BasicBlock* block = cmp->getParent();
+			Change change = changeBetween(var, block, block == load->getParent() ? load : NULL, cmp);
+			while(block != load->getParent())
+			{
+				block = block->getSinglePredecessor();
+				if(block == NULL) return Change(false, 0);
+				Change before = changeBetween(var, block, block == load->getParent() ? load : NULL, NULL);
+				change = before.then(change);
+			}
+			return change;
+		}
+
+		//The halves of a check or fact. Upper halves compare with the size, lower halves with -1 or a constant.
+		void getHalves(CmpInst* cmp, vector<Half> &halves)
+		{
+			Half half;
+			half.var = getIndexVariable(cmp->getOperand(0), half.offset);
+			ConstantInt* bound = dyn_cast<ConstantInt>(cmp->getOperand(1));
+
+			switch(cmp->getPredicate())
+			{
+			case CmpInst::ICMP_ULT:
+				half.upper = false;
+				half.bound = ConstantInt::get(cmp->getOperand(0)->getType(), 0);
+				halves.push_back(half);
+				//Fall through for the upper half
+			case CmpInst::ICMP_SLT:
+				half.upper = true;
+				half.bound = cmp->getOperand(1);
+				halves.push_back(half);
+				break;
+			case CmpInst::ICMP_SGT:
+				if(bound == NULL || bound->isMaxValue(true)) break;
+				half.upper = false;
+				half.bound = ConstantInt::get(bound->getType(), bound->getSExtValue() + 1, true);
+				halves.push_back(half);
+				break;
+			default:
+				break;
+			}
+		}
+
+		//How much larger bound is than the other bound, false if that is not known
+		bool getSlack(Value* bound, Value* other, int64_t &slack)
+		{
+			ConstantInt* constBound = dyn_cast<ConstantInt>(bound);
+			ConstantInt* constOther = dyn_cast<ConstantInt>(other);
+			if(constBound != NULL && constOther != NULL)
+			{
+				slack = constBound->getSExtValue() - constOther->getSExtValue();
+				return true;
+			}
+			if(constBound == NULL && constOther == NULL && getBaseValue(bound) == getBaseValue(other))
+			{
+				slack = 0;
+				return true;
+			}
+			return false;
+		}
+
+		//Does fact imply check when the variable has moved by shift since the fact was made
+		bool implies(const Half &fact, const Half &check, int64_t shift)
+		{
+			int64_t slack;
+			if(fact.upper != check.upper || fact.var != check.var) return false;
+			if(fact.upper)
+				return getSlack(check.bound, fact.bound, slack) && check.offset + shift <= fact.offset + slack;
+			return getSlack(check.bound, fact.bound, slack) && check.offset + shift >= fact.offset + slack;
+		}
+
+		//Halves of each check (bit 1 lower, bit 2 upper) already implied by available facts
+		map<Instruction*, int> impliedBits;
+
+		//Checks that have passed, and guard facts, are true where they are available. Other compares made by this
+		//pass (busy copies) may be false, so they only replace an identical check.
+		bool isPassed(Value* fact)
+		{
+			return fact->getName().startswith("CmpTest") || fact->getName().startswith("CmpGuard");
+		}
+
+		//The variable a fact or check is about
+		Value* getFactVariable(Value* fact)
+		{
+			int64_t offset;
+			return getIndexVariable(cast<CmpInst>(fact)->getOperand(0), offset);
+		}
+
+		//Is an available fact killed by the block. A fact survives known changes of its variable, which are
+		//added to the delta it carries; an unknown change or a new heap array size kills it.
+		bool isKilled(Value* fact, BasicBlock* block)
+		{
+			CmpInst* cmp = cast<CmpInst>(fact);
+			if(!stateChanges[block][getFactVariable(fact)].known) return true;
+
+			Value* bound = getBaseValue(cmp->getOperand(1));
+			return heapSizes.isSizeSlot(bound) && !stateChanges[block][bound].isUnchanged();
+		}
+
+		//Compare a fact available on entry to the block, whose variable has moved by delta since it was made, with a
+		//compare of the block. A check whose halves are all implied by facts goes in toRemove.
+		void compareAvailable(Value* itr, int64_t delta, Value* localItr, map<Instruction*, Instruction*> &toRemove, BasicBlock* block)
+		{
+			CmpInst* inst = cast<CmpInst>(itr);
+			CmpInst* localInst = cast<CmpInst>(localItr);
+			if(!inst->getName().startswith("Cmp") || !localInst->getName().startswith("CmpTest")) return;
+
+			vector<Half> facts, checks;
+			getHalves(inst, facts);
+			getHalves(localInst, checks);
+			if(facts.empty() || checks.empty() || facts[0].var != checks[0].var) return;
+
+			//How far the variable moved between the fact and the load of the check's index
+			Change moved = changeBetween(checks[0].var, block, NULL, localInst);
+			Change sinceLoad = changeSinceLoad(localInst);
+			if(!moved.known || !sinceLoad.known) return;
+			int64_t shift = delta + moved.delta - sinceLoad.delta;
+
+			int needed = 0;
+			int &implied = impliedBits[localInst];
+			for(unsigned c = 0; c < checks.size(); c++)
+			{
+				int bit = checks[c].upper ? 2 : 1;
+				needed |= bit;
+				for(unsigned f = 0; f < facts.size(); f++)
+				{
+					//A compare that may be false can only stand in for the very same check
+					int64_t slack;
+					if(!isPassed(inst) && (shift != 0 || inst->getPredicate() != localInst->getPredicate() || checks[c].offset != facts[f].offset
+						|| !getSlack(checks[c].bound, facts[f].bound, slack) || slack != 0))
+						continue;
+					if(implies(facts[f], checks[c], shift))
+						implied |= bit;
+				}
+			}
+
+			if((implied & needed) == needed)
+			{
+				errs() << "Implied = " << *localInst << " by " << *inst << "\n";
+				toRemove[localInst] = inst;
+			}
 		}
 
 		//Finds the base value of an instruction. This means the method will skip passed cast instructions to find the original load.
@@ -131,34 +438,30 @@ namespace
 			Value* op1 = getBaseValue(inst->getOperand(0));
 			Value* op2 = getBaseValue(inst->getOperand(1));
 
-			state changeStateOp1 = stateChanges[block][op1];
-			state changeStateOp2 = stateChanges[block][op2];
+			Change changeOp1 = stateChanges[block][getFactVariable(inst)];
+			Change changeOp2 = stateChanges[block][op2];
 
-			//errs() << block->getName() << " --" << changeStateOp1 << "-> " << *itr << " :: " << *localItr << "\n";
+			//A heap array's size changes when its pointer is reassigned, and a check on the old size is no longer valid
+			if(heapSizes.isSizeSlot(op2) && !changeOp2.isUnchanged())
+			{
+				conflict = true;
+			}
 
 			//See if this block killed one of the compare's operands
-			if(changeStateOp1 != UNCHANGED)// || changeStateOp2 != UNCHANGED)
+			if(!changeOp1.known)
 			{
-				switch(changeStateOp1)
-				{
-				case UNKNOWN:
-					conflict = true;
-					break;
-				case INCREASED:
-					if(inst->getPredicate() == CmpInst::ICMP_SLT)
-					{
-						errs() << "Killing upper\n";
-						conflict = true;
-					}
-					break;
-				case DECREASED:
-					if(inst->getPredicate() == CmpInst::ICMP_SGT)
-					{
-						errs() << "Killing lower\n";
-						conflict = true;
-					}
-					break;
-				}
+				conflict = true;
+			}
+			else if(changeOp1.delta > 0 && (inst->getPredicate() == CmpInst::ICMP_SLT || inst->getPredicate() == CmpInst::ICMP_ULT))
+			{
+				//A fused check holds both bounds, so any change kills it
+				errs() << "Killing upper\n";
+				conflict = true;
+			}
+			else if(changeOp1.delta < 0 && (inst->getPredicate() == CmpInst::ICMP_SGT || inst->getPredicate() == CmpInst::ICMP_ULT))
+			{
+				errs() << "Killing lower\n";
+				conflict = true;
 			}
 
 			CmpInst* localInst = dyn_cast<CmpInst>(localItr);
@@ -224,8 +527,9 @@ namespace
 			return conflict;
 		}
 
-		//Despite being called "backwards" this method is actually used for both forward and backward data flow analysis
-		set<Value*>* backwards(Output* output, BasicBlock* block, bool doRemove=false)
+		//Despite being called "backwards" this method is actually used for both forward and backward data flow analysis.
+		//Returns the facts that pass through the block. With doRemove, the checks of the block implied by the facts are removed.
+		set<Value*>* backwards(Output* output, BasicBlock* block, bool isForward=false, bool doRemove=false)
 		{
 			set<Value*>* S = new set<Value*>();
 
@@ -234,12 +538,27 @@ namespace
 
 			//O(n^2) loop to check for matching compares
 			map<Instruction*, Instruction*> toRemove;
+			impliedBits.clear();
 			for(set<Value*>::iterator itr = output->outSet.begin(); itr != output->outSet.end(); itr++)
 			{
+				//Facts removed earlier in this pass are still named by the solution, but are gone
+				if(replacedBy.find(*itr) != replacedBy.end()) continue;
+
 				bool conflict = false;
-				for(set<Value*>::iterator localItr = gen->begin(); localItr != gen->end(); localItr++)
+				if(isForward)
 				{
-					conflict |= compareValues(*itr, *localItr, toRemove, block);
+					//Forward: facts carry how far their variable moved, and imply checks with a larger margin
+					conflict = isKilled(*itr, block);
+					if(doRemove)
+						for(set<Value*>::iterator localItr = gen->begin(); localItr != gen->end(); localItr++)
+							compareAvailable(*itr, output->outDelta[*itr], *localItr, toRemove, block);
+				}
+				else
+				{
+					for(set<Value*>::iterator localItr = gen->begin(); localItr != gen->end(); localItr++)
+					{
+						conflict |= compareValues(*itr, *localItr, toRemove, block);
+					}
 				}
 
 				//In the 3 step of the algorithm, we remove instructions that are redundant
@@ -250,290 +569,666 @@ namespace
 			if(doRemove)
 				for(map<Instruction*, Instruction*>::iterator remItr = toRemove.begin(); remItr != toRemove.end(); remItr++)
 				{
+					//A fact that was itself removed stands for the one that replaced it
+					Instruction* fact = remItr->second;
+					while(replacedBy.find(fact) != replacedBy.end())
+						fact = replacedBy[fact];
+
 					gen->erase(remItr->first);
-					remItr->first->replaceAllUsesWith(remItr->second);
+					replacedBy[remItr->first] = fact;
+					remItr->first->replaceAllUsesWith(fact);
 					remItr->first->eraseFromParent();
 				}
 
-			errs() << "S size: " << S->size() << "\n";
 			return S;
 		}
 
-		//Forward analysis. Remove redundant bound checks
-		void calculateRedundant(BasicBlock* entry)
+		//Blocks reachable from the entry, in reverse postorder
+		vector<BasicBlock*> getBlockOrder(Function &F)
 		{
-			queue<BasicBlock*> toVisit;
-			toVisit.push(entry);
-			set<BasicBlock*> visited;
+			vector<BasicBlock*> order;
+			ReversePostOrderTraversal<Function*> rpot(&F);
+			for(ReversePostOrderTraversal<Function*>::rpo_iterator itr = rpot.begin(); itr != rpot.end(); itr++)
+				order.push_back(*itr);
+			return order;
+		}
 
-			while(!toVisit.empty())
+		//Keep the facts of into that other also has, moved by the same amount
+		void meet(Output &into, Output &other)
+		{
+			set<Value*> toRemove;
+			for(set<Value*>::iterator outItr = into.outSet.begin(); outItr != into.outSet.end(); outItr++)
 			{
-				BasicBlock* block = toVisit.front();
-				toVisit.pop();
+				if(other.outSet.find(*outItr) == other.outSet.end() || other.outDelta[*outItr] != into.outDelta[*outItr])
+				{
+					toRemove.insert(*outItr);
+				}
+			}
 
-				if(visited.find(block) != visited.end()) continue;
+			for(set<Value*>::iterator outItr = toRemove.begin(); outItr != toRemove.end(); outItr++)
+			{
+				into.outSet.erase(*outItr);
+				into.outSrc.erase(*outItr);
+				into.outDelta.erase(*outItr);
+			}
+		}
 
-				//Retrieve genset and pred
-				set<Value*>* gen = genSet[block];
-				Output* outset = outputs[block];
-				Output* inset = inSet[block];
+		bool sameFacts(Output &first, Output &second)
+		{
+			return first.outSet == second.outSet && first.outDelta == second.outDelta;
+		}
 
-				//Create sets if they are null
-				if(inset == NULL)
-				{
-					//errs() << "Creating inset for block: " << block->getName() << "\n";
-					inset = new Output();
-					inSet[block] = inset;
-				}
-				if(outset == NULL)
-				{
-					//errs() << "Creating outset for block: " << block->getName() << "\n";
-					outset = new Output();
-					outputs[block] = outset;
-				}
+		//Forward IN of a block: the facts on the way out of every predecessor solved so far, and the program's
+		//own guard on the edge into the block. Unsolved predecessors count as holding every fact.
+		Output availableIn(BasicBlock* block, map<BasicBlock*, Output> &out, set<BasicBlock*> &solved)
+		{
+			Output in;
+			bool first = true;
+			set<BasicBlock*>* preds = &pred[block];
+			for(set<BasicBlock*>::iterator itr = preds->begin(); itr != preds->end(); itr++)
+			{
+				if(solved.find(*itr) == solved.end()) continue;
+				if(first)
+					in = out[*itr];
+				else
+					meet(in, out[*itr]);
+				first = false;
+			}
 
-				//Calculate IN
-				inset->outSet.clear();
-				inset->outSrc.clear();
+			vector<Instruction*> &facts = guardFacts[block];
+			for(unsigned i = 0; i < facts.size(); i++)
+			{
+				in.outSet.insert(facts[i]);
+				in.outSrc[facts[i]] = block;
+				in.outDelta[facts[i]] = 0;
+			}
+			return in;
+		}
 
-				set<BasicBlock*>* preds = &pred[block];
-				bool isReady = true;
-				for(set<BasicBlock*>::iterator itr = preds->begin(); itr != preds->end(); itr++)
-				{
-					Output* outs = outputs[*itr];
-					if(visited.find(*itr) == visited.end())
-					{
-						isReady = false;
-						break;
-					}
-					for(set<Value*>::iterator valItr = outs->outSet.begin(); valItr != outs->outSet.end(); valItr++)
-					{
-						if(itr == preds->begin())
-						{
-							inset->outSet.insert(*valItr);
-							inset->outSrc[*valItr] = outs->outSrc[*valItr];
-						}
-						else
-						{
-							set<Value*> toRemove;
+		//Forward analysis. Find the facts available on entry to each block, then remove the bound checks they imply.
+		//The solution is optimistic: a block starts out holding every fact, and loses the facts some path into it
+		//does not carry until nothing changes, so facts that go around a loop unchanged stay available in it.
+		void calculateRedundant(Function &F)
+		{
+			vector<BasicBlock*> order = getBlockOrder(F);
+			map<BasicBlock*, unsigned> position;
+			for(unsigned i = 0; i < order.size(); i++)
+				position[order[i]] = i;
 
-							//See if the comparison is in the inset set
-							for(set<Value*>::iterator outItr = inset->outSet.begin(); outItr != inset->outSet.end(); outItr++)
-							{
-								if(outs->outSet.find(*outItr) == outs->outSet.end())
-								{
-									toRemove.insert(*outItr);
-								}
-							}
+			map<BasicBlock*, Output> out;
+			set<BasicBlock*> solved;
 
-							for(set<Value*>::iterator outItr = toRemove.begin(); outItr != toRemove.end(); outItr++)
-							{
-								inset->outSet.erase(*outItr);
-								inset->outSrc.erase(*outItr);
-							}
-						}
+			//Visit in reverse postorder, so a block's predecessors are solved before it except over back edges
+			set<unsigned> worklist;
+			for(unsigned i = 0; i < order.size(); i++)
+				worklist.insert(i);
+
+			int numVisits = 0;
+			while(!worklist.empty())
+			{
+				BasicBlock* block = order[*worklist.begin()];
+				worklist.erase(worklist.begin());
+				numVisits++;
+
+				set<Value*>* gen = genSet[block];
+				Output inset = availableIn(block, out, solved);
+				set<Value*>* forward = backwards(&inset, block, true);
+
+				//Calculate OUT
+				Output outset;
+
+				//Add gen. The stores after the load of the index move its variable before the end of the block
+				for(set<Value*>::iterator itr = gen->begin(); itr != gen->end(); itr++)
+				{
+					Change after = changeSinceLoad(cast<CmpInst>(*itr)).then(changeBetween(getFactVariable(*itr), block, cast<Instruction>(*itr), NULL));
+					if(after.known)
+					{
+						outset.outSet.insert(*itr);
+						outset.outSrc[*itr] = block;
+						outset.outDelta[*itr] = after.delta;
 					}
 				}
 
-				//Check if the predecessors both have outsets available. If not, wait to try again later
-				if(!isReady)
+				//Add forward set
+				for(set<Value*>::iterator itr = forward->begin(); itr != forward->end(); itr++)
 				{
-					toVisit.push(block);
-					continue;
+					outset.outSet.insert(*itr);
+					outset.outSrc[*itr] = block;
+					outset.outDelta[*itr] = inset.outDelta[*itr] + stateChanges[block][getFactVariable(*itr)].delta;
 				}
+				delete forward;
 
-				visited.insert(block);
+				if(solved.find(block) != solved.end() && sameFacts(outset, out[block])) continue;
+				solved.insert(block);
+				out[block] = outset;
 
-				set<Value*>* forward = backwards(inset, block, true);
+				//Revisit successors
+				TerminatorInst* termInst = block->getTerminator();
+				for(unsigned i = 0; i < termInst->getNumSuccessors(); i++)
+					worklist.insert(position[termInst->getSuccessor(i)]);
+			}
+			errs() << "Available checks solved in " << numVisits << " visits of " << order.size() << " blocks\n";
 
-				//Calculate OUT
-				outset->outSet.clear();
-				outset->outSrc.clear();
+			//The solution no longer changes, so remove the implied checks. Earlier blocks go first, so a check is
+			//replaced before the checks it implies.
+			for(unsigned i = 0; i < order.size(); i++)
+			{
+				Output inset = availableIn(order[i], out, solved);
+				delete backwards(&inset, order[i], true, true);
+			}
+		}
 
-				map<Instruction*, Instruction*> toRemove;
+		//Backward analysis. Find the checks that are busy (made on every path) at the end of each block, then copy
+		//them up into the blocks they pass through. A check is killed by a block when it conflicts with one of the
+		//block's compares, so the problem is a plain gen/kill one with a bit per check.
+		void calculateSets(Function &F)
+		{
+			//Note: This dominator tree is not current, as we have added blocks/instructions
+			DominatorTree &domTree = getAnalysis<DominatorTree>();
 
-				//Add gen, while removing duplicate gen vars
+			//Number the checks
+			vector<BasicBlock*> order = getBlockOrder(F);
+			vector<Value*> checks;
+			map<Value*, unsigned> bitOf;
+			Output allChecks;
+			for(unsigned i = 0; i < order.size(); i++)
+			{
+				set<Value*>* gen = genSet[order[i]];
 				for(set<Value*>::iterator itr = gen->begin(); itr != gen->end(); itr++)
 				{
-					bool duplicate = false;
-					for(set<Value*>::iterator itr2 = gen->begin(); itr2 != itr; itr2++)
-					{
-						bool isDup = compareValues(*itr, *itr2, toRemove, block);
-						duplicate |= isDup;
-					}
+					bitOf[*itr] = checks.size();
+					checks.push_back(*itr);
+					allChecks.outSet.insert(*itr);
+				}
+			}
+
+			Dataflow<false, true> busy;
+			busy.init(F, checks.size());
+			for(unsigned i = 0; i < order.size(); i++)
+			{
+				BasicBlock* block = order[i];
+				set<Value*>* gen = genSet[block];
+				for(set<Value*>::iterator itr = gen->begin(); itr != gen->end(); itr++)
+					busy.getGen(block).set(bitOf[*itr]);
+
+				//Everything that does not pass through the block is killed by it
+				BitVector &kill = busy.getKill(block);
+				kill.set();
+				set<Value*>* S = backwards(&allChecks, block);
+				for(set<Value*>::iterator itr = S->begin(); itr != S->end(); itr++)
+					kill.reset(bitOf[*itr]);
+				delete S;
+			}
+			busy.solve();
+			errs() << "Busy checks solved in " << busy.numSweeps << " sweeps of " << order.size() << " blocks\n";
 
-					if(!duplicate)
+			//Create an extra redundant check at the end of each block for the busy checks that pass through it
+			for(unsigned i = 0; i < order.size(); i++)
+			{
+				BasicBlock* block = order[i];
+				BitVector passing = busy.getOut(block);
+				passing.reset(busy.getKill(block));
+				for(int bit = passing.find_first(); bit != -1; bit = passing.find_next(bit))
+				{
+					ICmpInst* cmp = dyn_cast<ICmpInst>(checks[bit]);
+					TerminatorInst* term = block->getTerminator();
+
+					Instruction* cmpOp1 = dyn_cast<Instruction>(cmp->getOperand(0));
+					Instruction* cmpOp2 = dyn_cast<Instruction>(cmp->getOperand(1));
+
+					if((cmpOp1 == NULL || domTree.dominates( cmpOp1, original[block])) && ( cmpOp2 == NULL || domTree.dominates(cmpOp2, original[block])))
 					{
-						outset->outSet.insert(*itr);
-						outset->outSrc[*itr] = block;
+						ICmpInst* boundCheck =  new ICmpInst(term, cmp->getPredicate(), cmp->getOperand(0), cmp->getOperand(1), Twine("CmpBusy"));
+						genSet[block]->insert(boundCheck);
 					}
 				}
-				//Remove the redundant gen statements
-				for(map<Instruction*, Instruction*>::iterator itr = toRemove.begin(); itr != toRemove.end(); itr++)
-				{
-					gen->erase(itr->first);
-					itr->first->replaceAllUsesWith(itr->second);
-					itr->first->eraseFromParent();
+			}
+		}
 
-					outset->outSet.erase(itr->first);
-					outset->outSrc.erase(itr->first);
-				}
+		//A check can run once before the loop if it runs on every iteration, and the loop can not be left
+		//before the check other than by the header's test (which the hoisted check is guarded by) or by another failed check.
+		//A monotonic check is hoisted as a test of the last value of the induction variable, so the loop must also not
+		//be left early after the check, or a search that breaks out while in bounds would fail the hoisted test
+		bool canHoist(Loop* loop, BasicBlock* checkBlock, BasicBlock* exitBlock, bool monotonic)
+		{
+			DominatorTree &domTree = getAnalysis<DominatorTree>();
 
+			if(loop->getLoopPreheader() == NULL) return false;
+			if(isa<PHINode>(loop->getHeader()->begin())) return false;
 
-				//Add forward set
-				for(set<Value*>::iterator itr = forward->begin(); itr != forward->end(); itr++)
-				{
-					outset->outSet.insert(*itr);
-					outset->outSrc[*itr] = block;
-				}
+			SmallVector<BasicBlock*, 4> latches;
+			loop->getLoopLatches(latches);
+			for(unsigned i = 0; i < latches.size(); i++)
+				if(!domTree.dominates(checkBlock, latches[i])) return false;
 
-				//Add Successors
-				TerminatorInst* termInst = block->getTerminator();
-				int numSucc = termInst->getNumSuccessors();
-				for(int i = 0; i < numSucc; i++)
-					toVisit.push(termInst->getSuccessor(i));
+			SmallVector<BasicBlock*, 4> exiting;
+			loop->getExitingBlocks(exiting);
+			for(unsigned i = 0; i < exiting.size(); i++)
+			{
+				if(exiting[i] == loop->getHeader() && loopChecks.isGuardable(loop)) continue;
+				if(!monotonic && domTree.dominates(checkBlock, exiting[i])) continue;
+
+				TerminatorInst* term = exiting[i]->getTerminator();
+				for(unsigned s = 0; s < term->getNumSuccessors(); s++)
+					if(!loop->contains(term->getSuccessor(s)) && term->getSuccessor(s) != exitBlock) return false;
 			}
-			
+			return true;
 		}
 
-		//Find busy checks and propagate the compares upward
-		void calculateSets(set<BasicBlock*>* term)
+		//Move the checks of a loop into a block run once before the header. Invariant checks are copied as they are,
+		//checks on the induction variable are made for its first and last value (Gupta, "Optimizing Array Bound Checks Using Flow Analysis")
+		int hoistLoopChecks(Function &F, Loop* loop)
 		{
-			queue<BasicBlock*> toVisit;
+			LoopInfo &LI = getAnalysis<LoopInfo>();
+			DominatorTree &domTree = getAnalysis<DominatorTree>();
 
-			for(set<BasicBlock*>::iterator itr = term->begin(); itr != term->end(); itr++)
-				toVisit.push(*itr);
-			set<BasicBlock*> visited;
+			BasicBlock* header = loop->getHeader();
+			BasicBlock* preheader = loop->getLoopPreheader();
 
-			//Note: This dominator tree is not current, as we have added blocks/instructions
-			DominatorTree &domTree = getAnalysis<DominatorTree>();
+			Value* induction = NULL;
+			Value* last = NULL;
+			bool hasInduction = loopChecks.findInduction(loop, induction, last, NULL);
 
-			while(!toVisit.empty())
+			//Find the checks that belong to this loop and can move
+			vector<ICmpInst*> checks;
+			BasicBlock* exitBlock = NULL;
+			for(Loop::block_iterator b = loop->block_begin(); b != loop->block_end(); ++b)
 			{
-				BasicBlock* block = toVisit.front();
-				toVisit.pop();
+				if(LI.getLoopFor(*b) != loop) continue;
+				for(BasicBlock::iterator i = (*b)->begin(); i != (*b)->end(); i++)
+				{
+					ICmpInst* cmp = dyn_cast<ICmpInst>(i);
+					BranchInst* branch;
+					if(cmp == NULL || !loopChecks.isBoundCheck(cmp, branch)) continue;
+					if(exitBlock != NULL && branch->getSuccessor(1) != exitBlock) continue;
+					if(!loopChecks.isInvariant(cmp->getOperand(1), loop, NULL)) continue;
+
+					bool invariant = loopChecks.isInvariant(cmp->getOperand(0), loop, NULL);
+					if(!invariant && !(hasInduction && loopChecks.isMonotonic(cmp->getOperand(0), loop, induction))) continue;
+					if(!canHoist(loop, *b, branch->getSuccessor(1), !invariant)) continue;
+
+					exitBlock = branch->getSuccessor(1);
+					checks.push_back(cmp);
+				}
+			}
+			if(checks.empty()) return 0;
 
-				if(visited.find(block) != visited.end()) continue;
+			LLVMContext &context = F.getContext();
 
-				//Retrieve genset and pred
-				set<Value*>* gen = genSet[block];
-				set<BasicBlock*>* predecessors = &pred[block];
-				Output* outset = outputs[block];
-				Output* inset = inSet[block];
+			//Block with the hoisted checks, entered from the preheader
+			BasicBlock* checkBlock = BasicBlock::Create(context, Twine(header->getName() + "hoisted"), &F, header);
+			BranchInst* checkTerm = BranchInst::Create(header, checkBlock);
+			BasicBlock* entry = checkBlock;
+
+			//If the header can leave the loop, only check when the loop is entered
+			BasicBlock* guardBlock = NULL;
+			SmallVector<BasicBlock*, 4> exiting;
+			loop->getExitingBlocks(exiting);
+			if(std::find(exiting.begin(), exiting.end(), header) != exiting.end())
+			{
+				guardBlock = BasicBlock::Create(context, Twine(header->getName() + "guard"), &F, checkBlock);
+				map<Value*, Value*> copies;
+				for(BasicBlock::iterator i = header->begin(); i != header->end(); i++)
+				{
+					Instruction* copy = i->clone();
+					for(unsigned op = 0; op < copy->getNumOperands(); op++)
+						if(copies.count(copy->getOperand(op))) copy->setOperand(op, copies[copy->getOperand(op)]);
+					guardBlock->getInstList().push_back(copy);
+					copies[i] = copy;
+				}
+				BranchInst* guardBranch = dyn_cast<BranchInst>(guardBlock->getTerminator());
+				guardBranch->setSuccessor(0, checkBlock);
+				guardBranch->setSuccessor(1, header);
+				entry = guardBlock;
+			}
 
+			Value* first = NULL;
+			if(hasInduction)
+			{
+				first = new LoadInst(induction, "first", checkTerm);
+				loopChecks.findInduction(loop, induction, last, checkTerm);
+			}
+
+			//Recreate the checks before the loop and combine them into one branch
+			Value* allValid = NULL;
+			for(unsigned c = 0; c < checks.size(); c++)
+			{
+				ICmpInst* cmp = checks[c];
+				Value* size = loopChecks.copyExpression(cmp->getOperand(1), loop, NULL, NULL, checkTerm);
 
-				if(inset == NULL)
+				vector<Value*> indexes;
+				if(loopChecks.isInvariant(cmp->getOperand(0), loop, NULL))
 				{
-					//errs() << "Creating inset for block: " << block->getName() << "\n";
-					inset = new Output();
-					inSet[block] = inset;
+					indexes.push_back(loopChecks.copyExpression(cmp->getOperand(0), loop, NULL, NULL, checkTerm));
 				}
-				if(outset == NULL)
+				else
 				{
-					//errs() << "Creating outset for block: " << block->getName() << "\n";
-					outset = new Output();
-					outputs[block] = outset;
+					indexes.push_back(loopChecks.copyExpression(cmp->getOperand(0), loop, induction, first, checkTerm));
+					indexes.push_back(loopChecks.copyExpression(cmp->getOperand(0), loop, induction, last, checkTerm));
 				}
 
-				//Get successors
-				TerminatorInst* termInst = block->getTerminator();
-				int numSucc = termInst->getNumSuccessors();
-				set<BasicBlock*> successors;
-				for(int i = 0; i < numSucc; i++) successors.insert(termInst->getSuccessor(i));
-
-				//Clear sets
-				inset->outSet.clear();
-				inset->outSrc.clear();
-				outset->outSet.clear();
-				outset->outSrc.clear();
-
-				//Create c_out set
-				bool isReady = true;
-				for(set<BasicBlock*>::iterator itr = successors.begin(); itr != successors.end(); itr++)
+				for(unsigned i = 0; i < indexes.size(); i++)
 				{
-					Output* succ = inSet[*itr];
-					if(succ == NULL)
-					{
-						//errs() << "ERROR(" << block->getName() << "): Null inset found for block: " << (*itr)->getName() << "\n";
-						//continue;
-						isReady = false;
-						break;
-					}
-					//Loop through successor values
-					for(set<Value*>::iterator comp = succ->outSet.begin(); comp != succ->outSet.end(); comp++)
-					{
-						if(itr == successors.begin())
-						{
-							outset->outSet.insert(*comp);
-							outset->outSrc[*comp] = succ->outSrc[*comp];
-						}
-						else
-						{
-							set<Value*> toRemove;
+					Value* valid = new ICmpInst(checkTerm, cmp->getPredicate(), indexes[i], size, Twine("CmpHoisted"));
+					if(allValid == NULL) allValid = valid;
+					else allValid = BinaryOperator::CreateAnd(allValid, valid, "CmpHoisted", checkTerm);
+				}
 
-							//See if the comparison is in the c_in set
-							for(set<Value*>::iterator outItr = outset->outSet.begin(); outItr != outset->outSet.end(); outItr++)
-							{
-								if(succ->outSet.find(*outItr) == succ->outSet.end())
-									toRemove.insert(*outItr);
-							}
+				//Remove the check from the loop
+				BranchInst* branch = dyn_cast<BranchInst>(*cmp->use_begin());
+				BranchInst::Create(branch->getSuccessor(0), branch);
+				branch->eraseFromParent();
+				Value* index = cmp->getOperand(0);
+				Value* bound = cmp->getOperand(1);
+				cmp->eraseFromParent();
+				RecursivelyDeleteTriviallyDeadInstructions(index);
+				RecursivelyDeleteTriviallyDeadInstructions(bound);
+			}
+			BranchInst::Create(header, exitBlock, allValid, checkBlock);
+			checkTerm->eraseFromParent();
 
-							for(set<Value*>::iterator outItr = toRemove.begin(); outItr != toRemove.end(); outItr++)
-							{
-								outset->outSet.erase(*outItr);
-								outset->outSrc.erase(*outItr);
-							}
-						}
-					}
-				}
-				if(!isReady) continue;
-				else visited.insert(block);
+			//Enter through the new blocks
+			preheader->getTerminator()->replaceUsesOfWith(header, entry);
 
-				errs() << block->getName() << "\n";
+			//Keep the dominator tree and loop info current for the loops that are still to be visited
+			BasicBlock* exitDom = domTree.findNearestCommonDominator(exitBlock, preheader);
+			if(guardBlock != NULL)
+			{
+				domTree.addNewBlock(guardBlock, preheader);
+				domTree.addNewBlock(checkBlock, guardBlock);
+				domTree.changeImmediateDominator(header, guardBlock);
+			}
+			else
+			{
+				domTree.addNewBlock(checkBlock, preheader);
+				domTree.changeImmediateDominator(header, checkBlock);
+			}
+			domTree.changeImmediateDominator(exitBlock, exitDom);
+			if(Loop* parent = loop->getParentLoop())
+			{
+				if(guardBlock != NULL) parent->addBasicBlockToLoop(guardBlock, LI.getBase());
+				parent->addBasicBlockToLoop(checkBlock, LI.getBase());
+			}
 
-				errs() << "Gen(" << gen << "): " << gen->size() << "\n";
-				errs() << "OutSet size: " << outset->outSet.size() << "\n";
+			errs() << "Hoisted " << checks.size() << " checks out of " << header->getName() << "\n";
+			return checks.size();
+		}
 
-				set<Value*>* S = backwards(outset, block);
+		//Hoist checks out of every loop, inner loops first
+		void hoistChecks(Function &F, Loop* loop)
+		{
+			for(Loop::iterator sub = loop->begin(); sub != loop->end(); ++sub)
+				hoistChecks(F, *sub);
+			hoistLoopChecks(F, loop);
+		}
 
-				//Add genset to c_in
-				for(set<Value*>::iterator itr = gen->begin(); itr != gen->end(); itr++)
+		//Range of an index made of constants and loads of induction variables with constant steps and offsets, as in
+		//a[2 * i + 1]. A load of an induction variable has the range of the variable in the body of its loop, unless it
+		//is in the header or after the step. False if the range is not known or wraps in the type it is computed in.
+		bool getIndexRange(Value* value, LoopInfo &LI, int64_t &lo, int64_t &hi)
+		{
+			if(ConstantInt* constant = dyn_cast<ConstantInt>(value))
+			{
+				if(constant->getBitWidth() > 32) return false;
+				lo = hi = constant->getSExtValue();
+				return true;
+			}
+			if(SExtInst* sext = dyn_cast<SExtInst>(value))
+				return getIndexRange(sext->getOperand(0), LI, lo, hi);
+
+			if(LoadInst* load = dyn_cast<LoadInst>(value))
+			{
+				Value* slot = load->getPointerOperand();
+				BasicBlock* block = load->getParent();
+				for(Loop* loop = LI.getLoopFor(block); loop != NULL; loop = loop->getParentLoop())
 				{
-					inset->outSet.insert(*itr);
-					inset->outSrc[*itr] = block;
+					if(block == loop->getHeader() || !loopChecks.getInductionRange(loop, slot, lo, hi)) continue;
+					return changeBetween(slot, block, NULL, load).isUnchanged() && cast<IntegerType>(load->getType())->getBitWidth() <= 32;
 				}
-				//Add backward() return
-				for(set<Value*>::iterator itr = S->begin(); itr != S->end(); itr++)
+				return false;
+			}
+
+			BinaryOperator* binary = dyn_cast<BinaryOperator>(value);
+			int64_t lo1, hi1, lo2, hi2;
+			if(binary == NULL || cast<IntegerType>(binary->getType())->getBitWidth() > 32) return false;
+			if(!getIndexRange(binary->getOperand(0), LI, lo1, hi1) || !getIndexRange(binary->getOperand(1), LI, lo2, hi2)) return false;
+			switch(binary->getOpcode())
+			{
+			case Instruction::Add:
+				lo = lo1 + lo2;
+				hi = hi1 + hi2;
+				break;
+			case Instruction::Sub:
+				lo = lo1 - hi2;
+				hi = hi1 - lo2;
+				break;
+			case Instruction::Mul:
+			{
+				int64_t products[4] = {lo1 * lo2, lo1 * hi2, hi1 * lo2, hi1 * hi2};
+				lo = *std::min_element(products, products + 4);
+				hi = *std::max_element(products, products + 4);
+				break;
+			}
+			default:
+				return false;
+			}
+			int64_t limit = (int64_t)1 << (cast<IntegerType>(binary->getType())->getBitWidth() - 1);
+			return lo >= -limit && hi < limit;
+		}
+
+		//Delete the checks that can never fail. The size a check compares against is the one CreateBounds found for
+		//the array, so the check is safe when the whole range of the index is below the smallest value the size can
+		//have. ScalarEvolution gives the range of SSA indexes. The indexes of -O0 code are loads of stack slots, which
+		//it knows nothing about, so their range is found from the induction variables of the loops around them.
+		int removeProvenChecks(Function &F)
+		{
+			ScalarEvolution &SE = getAnalysis<ScalarEvolution>();
+			LoopInfo &LI = getAnalysis<LoopInfo>();
+
+			vector<ICmpInst*> proven;
+			for(inst_iterator i = inst_begin(F), e = inst_end(F); i != e; ++i)
+			{
+				ICmpInst* cmp = dyn_cast<ICmpInst>(&*i);
+				BranchInst* branch;
+				if(cmp == NULL || !loopChecks.isBoundCheck(cmp, branch)) continue;
+
+				Value* index = cmp->getOperand(0);
+				Value* bound = cmp->getOperand(1);
+				if(!SE.isSCEVable(index->getType())) continue;
+
+				//The tighter of the two ranges
+				int64_t lo = INT64_MIN;
+				int64_t hi = INT64_MAX;
+				ConstantRange range = SE.getSignedRange(SE.getSCEV(index));
+				if(!range.isFullSet() && range.getBitWidth() <= 64)
 				{
-					inset->outSet.insert(*itr);
-					inset->outSrc[*itr] = block;
+					lo = range.getSignedMin().getSExtValue();
+					hi = range.getSignedMax().getSExtValue();
+				}
+				int64_t slotLo, slotHi;
+				if(getIndexRange(index, LI, slotLo, slotHi))
+				{
+					lo = std::max(lo, slotLo);
+					hi = std::min(hi, slotHi);
+				}
+				bool aboveZero = lo >= 0;
 
-					//Create an extra redundant check in this block
-					ICmpInst* cmp = dyn_cast<ICmpInst>(*itr);
-					TerminatorInst* term = block->getTerminator();
+				//Lower half of a split check: index > -1
+				ConstantInt* minusOne = dyn_cast<ConstantInt>(bound);
+				if(cmp->getPredicate() == CmpInst::ICMP_SGT && minusOne != NULL && minusOne->isMinusOne())
+				{
+					if(aboveZero) proven.push_back(cmp);
+					continue;
+				}
 
-					Instruction* cmpOp1 = dyn_cast<Instruction>(cmp->getOperand(0));
-					Instruction* cmpOp2 = dyn_cast<Instruction>(cmp->getOperand(1));
+				ConstantRange size = SE.getSignedRange(SE.getSCEV(bound));
+				if(size.getBitWidth() > 64) continue;
+				bool belowSize = hi < size.getSignedMin().getSExtValue();
+				if(cmp->getPredicate() == CmpInst::ICMP_SLT && belowSize)
+					proven.push_back(cmp);
+				else if(cmp->getPredicate() == CmpInst::ICMP_ULT && belowSize && aboveZero)
+					proven.push_back(cmp);
+			}
 
-					if((cmpOp1 == NULL || domTree.dominates( cmpOp1, original[block])) && ( cmpOp2 == NULL || domTree.dominates(cmpOp2, original[block])))
-					{
-						errs() << *cmpOp1 << " -> " << original[block]->getName() << "\n";
-						ICmpInst* boundCheck =  new ICmpInst(term, cmp->getPredicate(), cmp->getOperand(0), cmp->getOperand(1), Twine("CmpBusy"));
-						gen->insert(boundCheck);
-					}
+			for(unsigned i = 0; i < proven.size(); i++)
+			{
+				ICmpInst* cmp = proven[i];
+				BranchInst* branch = cast<BranchInst>(*cmp->use_begin());
+				BasicBlock* block = cmp->getParent();
+
+				errs() << "Proved " << *cmp << " in " << block->getName() << "\n";
+
+				//The exits of the loop change, so the trip counts it knows are stale
+				if(Loop* loop = LI.getLoopFor(block))
+					SE.forgetLoop(loop);
+
+				BranchInst::Create(branch->getSuccessor(0), branch);
+				branch->eraseFromParent();
+				RecursivelyDeleteTriviallyDeadInstructions(cmp);
+			}
+			return proven.size();
+		}
+
+		//The check that ends a block, NULL if the block does not end in one
+		ICmpInst* getEndingCheck(BasicBlock* block)
+		{
+			BranchInst* branch = dyn_cast<BranchInst>(block->getTerminator());
+			if(branch == NULL || !branch->isConditional()) return NULL;
+			ICmpInst* cmp = dyn_cast<ICmpInst>(branch->getCondition());
+			BranchInst* checkBranch;
+			if(cmp == NULL || !loopChecks.isBoundCheck(cmp, checkBranch)) return NULL;
+			return cmp;
+		}
+
+		//The block that always runs after this one if its check passes, NULL if control can go elsewhere
+		BasicBlock* getChainNext(BasicBlock* block)
+		{
+			BranchInst* branch = dyn_cast<BranchInst>(block->getTerminator());
+			if(branch == NULL) return NULL;
+			if(branch->isConditional() && getEndingCheck(block) == NULL) return NULL;
+
+			BasicBlock* next = branch->getSuccessor(0);
+			if(next->getSinglePredecessor() != block || isa<PHINode>(next->begin())) return NULL;
+			return next;
+		}
+
+		//Add a check "index + adjust pred bound" before the check at, in its own block
+		void emitCombined(ICmpInst* at, CmpInst::Predicate pred, int64_t adjust, Value* bound)
+		{
+			DominatorTree &domTree = getAnalysis<DominatorTree>();
+			LoopInfo &LI = getAnalysis<LoopInfo>();
+
+			BasicBlock* block = at->getParent();
+			BasicBlock* exitBlock = cast<BranchInst>(*at->use_begin())->getSuccessor(1);
+
+			DomTreeNode* node = domTree.getNode(block);
+			vector<DomTreeNode*> children(node->begin(), node->end());
+
+			BasicBlock* rest = block->splitBasicBlock(at, Twine(block->getName() + "combined"));
+			domTree.addNewBlock(rest, block);
+			for(unsigned i = 0; i < children.size(); i++)
+				domTree.changeImmediateDominator(children[i], domTree.getNode(rest));
+			if(Loop* loop = LI.getLoopFor(block))
+				loop->addBasicBlockToLoop(rest, LI.getBase());
+
+			TerminatorInst* term = block->getTerminator();
+			Value* index = at->getOperand(0);
+			if(adjust != 0)
+				index = BinaryOperator::CreateAdd(index, ConstantInt::get(index->getType(), adjust, true), "combinedIndex", term);
+			ICmpInst* cmp = new ICmpInst(term, pred, index, bound, Twine("CmpTestCombined"));
+			BranchInst::Create(rest, exitBlock, cmp, block);
+			term->eraseFromParent();
+		}
+
+		//Gupta's check combining: the checks of one straight-line chain that index the same variable against the same
+		//bound become one check at the smallest offset for the lower bound and one at the largest for the upper bound,
+		//placed at the first of them. The checks they cover are removed later by calculateRedundant.
+		int combineGroups(vector<ICmpInst*> &checks)
+		{
+			int combined = 0;
+			set<ICmpInst*> grouped;
+			for(unsigned first = 0; first < checks.size(); first++)
+			{
+				ICmpInst* at = checks[first];
+				if(grouped.count(at)) continue;
+
+				vector<Half> atHalves;
+				getHalves(at, atHalves);
+				if(atHalves.empty()) continue;
+
+				//Checks of the same kind on the same variable and bound
+				int64_t lowest = atHalves[0].offset;
+				int64_t highest = atHalves[0].offset;
+				int members = 1;
+				for(unsigned other = first + 1; other < checks.size(); other++)
+				{
+					vector<Half> halves;
+					getHalves(checks[other], halves);
+					int64_t slack;
+					if(halves.empty() || checks[other]->getPredicate() != at->getPredicate() || halves[0].var != atHalves[0].var
+						|| !getSlack(halves[0].bound, atHalves[0].bound, slack) || slack != 0)
+						continue;
+
+					grouped.insert(checks[other]);
+					lowest = std::min(lowest, halves[0].offset);
+					highest = std::max(highest, halves[0].offset);
+					members++;
 				}
+				if(members < 2) continue;
+
+				//Widen the group at its first check, the split checks only need the side they test
+				Value* bound = at->getOperand(1);
+				bool needsLower = at->getPredicate() != CmpInst::ICMP_SLT;
+				bool needsUpper = at->getPredicate() != CmpInst::ICMP_SGT;
+				if(needsLower && lowest < atHalves[0].offset)
+					emitCombined(at, at->getPredicate(), lowest - atHalves[0].offset, bound);
+				if(needsUpper && highest > atHalves[0].offset)
+					emitCombined(at, at->getPredicate(), highest - atHalves[0].offset, bound);
+
+				errs() << "Combined " << members << " checks on " << atHalves[0].var->getName() << " into offsets " << lowest << " to " << highest << "\n";
+				combined += members;
+			}
+			return combined;
+		}
 
-				//errs() << "Gen size: " << gen->size() << "\n";
-				errs() << "InSet size: " << inset->outSet.size() << "\n-------------------------\n";
+		//Collect the checks along each chain of blocks that always run one after another. A call may not return and a
+		//store may change the index, so those end the group collected so far.
+		int combineChecks(Function &F)
+		{
+			vector<BasicBlock*> starts;
+			for(Function::iterator block = F.begin(); block != F.end(); ++block)
+			{
+				BasicBlock* previous = block->getSinglePredecessor();
+				if(previous == NULL || getChainNext(previous) != block)
+					starts.push_back(block);
+			}
 
-				//Add predecessors
-				for(set<BasicBlock*>::iterator itr = predecessors->begin(); itr != predecessors->end(); itr++)
+			int combined = 0;
+			for(unsigned s = 0; s < starts.size(); s++)
+			{
+				vector<ICmpInst*> checks;
+				set<Value*> indexed;
+				for(BasicBlock* block = starts[s]; block != NULL; block = getChainNext(block))
 				{
-					//errs() << block->getName() << " -> " << (*itr)->getName() << "\n";
-					toVisit.push(*itr);
+					for(BasicBlock::iterator i = block->begin(); i != block->end(); i++)
+					{
+						StoreInst* store = dyn_cast<StoreInst>(i);
+						if((isa<CallInst>(i) && !isa<IntrinsicInst>(i)) || (store != NULL && indexed.count(store->getPointerOperand())))
+						{
+							combined += combineGroups(checks);
+							checks.clear();
+							indexed.clear();
+						}
+					}
+					if(ICmpInst* check = getEndingCheck(block))
+					{
+						checks.push_back(check);
+						indexed.insert(getFactVariable(check));
+					}
 				}
-				
+				combined += combineGroups(checks);
 			}
+			return combined;
 		}
 
 		virtual bool runOnFunction(Function &F){
@@ -542,11 +1237,27 @@ namespace
 			queue<BasicBlock*> nextBlocks;
 			nextBlocks.push(&F.getEntryBlock());
 
-			set<BasicBlock*> lastBlock;
-
 			set<BasicBlock*> visited;
 
 			errorBlock = NULL;
+			genSet.clear();
+			pred.clear();
+			stateChanges.clear();
+			original.clear();
+			replacedBy.clear();
+
+			heapSizes.run(F, false);
+
+			//Checks that can never fail do not need to take part in the rest
+			removeProvenChecks(F);
+
+			//Move checks out of loops before looking for redundant ones
+			LoopInfo &LI = getAnalysis<LoopInfo>();
+			for(LoopInfo::iterator loop = LI.begin(); loop != LI.end(); ++loop)
+				hoistChecks(F, *loop);
+
+			//Cover groups of nearby accesses with one check per side
+			combineChecks(F);
 
 			//Visit until nore more blocks left
 			while(!nextBlocks.empty()){
@@ -581,9 +1292,9 @@ namespace
 					//Trace through the store instruction to see if we can determine how this value changed
 					if(StoreInst* storeInst = dyn_cast<StoreInst>(inst))
 					{
-						state varState = getState(storeInst);
+						Change varState = getState(storeInst);
 						Value* changingVar = storeInst->getOperand(1);
-						stateChanges[block][changingVar] = varState;
+						stateChanges[block][changingVar] = stateChanges[block][changingVar].then(varState);
 					}
 
 					//add new blocks to go to
@@ -595,11 +1306,6 @@ namespace
 							pred[term].insert(block);
 							//errs() << block->getName() << " -> " << term->getName() << "\n";
 						}
-
-						if(numSucc == 0)
-						{
-							lastBlock.insert(block);
-						}
 					}
 				}
 				//errs() << genSet.size() << " : " << genSet[block]->size() << " : " << c_gen << "\n";
@@ -607,8 +1313,15 @@ namespace
 			}
 
 			//Optimize bounds checks
-			calculateSets(&lastBlock);
-			calculateRedundant(&F.getEntryBlock());
+			calculateSets(F);
+			addGuardFacts(F);
+			calculateRedundant(F);
+
+			//Guard facts that did not replace a check are not needed
+			for(map<BasicBlock*, vector<Instruction*> >::iterator itr = guardFacts.begin(); itr != guardFacts.end(); itr++)
+				for(unsigned i = 0; i < itr->second.size(); i++)
+					if(itr->second[i]->use_empty())
+						itr->second[i]->eraseFromParent();
 
 			//Queue of blocks
 			nextBlocks.push(&F.getEntryBlock());
@@ -665,6 +1378,8 @@ namespace
 		void getAnalysisUsage(AnalysisUsage &AU) const
 		{
 			AU.addRequired<DominatorTree>();
+			AU.addRequired<LoopInfo>();
+			AU.addRequired<ScalarEvolution>();
 			//AU.addPreserved<DominatorTree>();
 		}
 	};
@@ -8,6 +8,7 @@
 #include "llvm/Pass.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/DebugInfo.h"
+#include "../Common/ArraySize.h"
 #include <map>
 #include <set>
 #include <queue>
@@ -23,8 +24,13 @@ namespace {
 		static char ID; 
 		p11() : FunctionPass(ID) {}
 
+		//Sizes of heap arrays found by CreateBounds
+		ArraySize heapSizes;
+
 		//Run for each function
 		virtual bool runOnFunction(Function &F){
+
+			heapSizes.run(F, false);
 			
 			//Queue of blocks
 			queue<BasicBlock*> blocksToOptimize;
@@ -64,8 +70,8 @@ namespace {
 
 							//Do some comparisons to see if delete if less than instructions
 							if (comparison==CmpInst::ICMP_SLT){
-								//if bounds are same
-								if (bound==reachingComparison->getOperand(1)){
+								//if bounds are same, loads of one heap array's size count as the same bound
+								if (heapSizes.sameSize(bound, reachingComparison->getOperand(1))){
 									//if the values compared are the same
 									if (valChecked==reachingComparison->getOperand(0)){
 										deleteFlag = 1;
@@ -109,7 +115,7 @@ namespace {
 							//Do some comparisons to see if delete if greater than instructions
 							if (comparison==CmpInst::ICMP_SGT){
 								//if bounds are same
-								if (bound==reachingComparison->getOperand(1)){
+								if (heapSizes.sameSize(bound, reachingComparison->getOperand(1))){
 									//if the values compared are the same
 									if (valChecked==reachingComparison->getOperand(0)){
 										deleteFlag = 1;
@@ -1,7 +1,24 @@
 clang++ -c CSE6142.cpp `llvm-config --cxxflags`;
-clang++ -shared -o pass.so CSE6142.o `llvm-config --ldflags`
+clang++ -c ABCD.cpp `llvm-config --cxxflags`;
+clang++ -c "../Part 1/CreateBounds.cpp" `llvm-config --cxxflags`;
+clang++ -shared -o pass.so CSE6142.o ABCD.o CreateBounds.o `llvm-config --ldflags`
 #opt -load ./pass.so -CSE6142 -dot-cfg <../../Test/hello.bc> result.bc
 #llc result.bc
 #clang++ result.s
 #rm result.bc
+#Only the check of y = a[i] in the first case is implied, it prints 32 and the failed check of the guarded a[i] returns 0
+opt -load ./pass.so -CreateBounds -CSE6142 <../../Test/guards.bc> result.bc 2> result.txt
+grep "Implied" result.txt
+lli result.bc; echo $?
+rm result.bc result.txt
+#The three checks of the != loops are proved from the range of i, it prints 20
+opt -load ./pass.so -CreateBounds -CSE6142 <../../Test/proven.bc> result.bc 2> result.txt
+grep "Proved" result.txt
+lli result.bc
+rm result.bc result.txt
+#ABCD proves the check of a[i] in the first loop from the induction of i, 2 * i is not a difference it can follow
+opt -load ./pass.so -CreateBounds -ABCD <../../Test/proven.bc> result.bc 2> result.txt
+grep "Proved\|checks removed" result.txt
+lli result.bc
+rm result.bc result.txt
 #rm -f *~ pass.so *.o *.s
@@ -1,5 +1,12 @@
 #define DEBUG_TYPE "p11"
+#define cloneCost 4		//Instructions a region copy may duplicate for each check or merged load it can save per call
+#define functionGrowth 100	//Percent a function may grow by copying regions
+#define moduleGrowth 30		//Percent the module may grow by copying regions
+#ifndef pathQualified
+#define pathQualified false	//Copy a region only for the predecessors along which it removes a check
+#endif
 #include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
 #include "llvm/Support/InstIterator.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/DerivedTypes.h"
@@ -9,12 +16,21 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/DebugInfo.h"
 #include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Local.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
 #include "llvm/Analysis/Dominators.h"
-#include "llvm/Analysis/PostDominators.h"
+#include "../../Common/ReachingDefs.h"
+#include "../../Common/Reachability.h"
+#include "../../Common/ClonedRegion.h"
+#include "../../Common/PathQualified.h"
+#include "../../Common/ScopedValueTable.h"
+#include "../../Common/ValueClasses.h"
 #include <map>
 #include <set>
 #include <queue>
+#include <vector>
+#include <algorithm>
 
 using namespace llvm;
 using std::set;
@@ -36,26 +52,100 @@ namespace {
 		}
 	} defInstruct;
 
-	typedef struct _instTranslation{
-		Instruction* oldInst;
-		Instruction* newInst;
-					
-		//Constructor
-		 _instTranslation(Instruction* oldInstIn, Instruction* newInstIn){
-			oldInst = oldInstIn;
-			newInst = newInstIn;
-		}
-	}instTranslation;
-
 	struct p11 : public FunctionPass {
 		// Pass identification, replacement for typeid
 		static char ID; 
 		p11() : FunctionPass(ID) {}
 
+		//Estimated runs of each block per call of the function, from BlockFrequencyInfo and kept up to date as regions are copied
+		std::map<BasicBlock*, double> frequency;
+
+		//Checks that always pass along the path into a region
+		PathQualified qualified;
+
+		//Instructions the module may still grow by
+		int moduleBudget;
+
+		virtual bool doInitialization(Module &M){
+			int moduleSize = 0;
+			for (Module::iterator f = M.begin(); f != M.end(); ++f){
+				for (Function::iterator b = f->begin(); b != f->end(); ++b){
+					moduleSize += b->size();
+				}
+			}
+			moduleBudget = moduleSize * moduleGrowth / 100;
+			return false;
+		}
+
+		//Blocks made after the frequencies were read are taken to run once
+		double getFrequency(BasicBlock* block){
+			std::map<BasicBlock*, double>::iterator found = frequency.find(block);
+			return found == frequency.end() ? 1 : found->second;
+		}
+
+		//Bounds checks in a block
+		int countChecks(BasicBlock* block){
+			int checks = 0;
+			for (BasicBlock::iterator i = block->begin(); i != block->end(); ++i){
+				if (isa<ICmpInst>(i) && i->getName().startswith("CmpTest")){
+					checks++;
+				}
+			}
+			return checks;
+		}
+
+		//Value id of an operand, constants get one the first time they are seen
+		int getValueID(Value* value, std::map<Value*, int> &valueID, int &ID){
+			int &id = valueID[value];
+			if (id == 0){
+				id = ID++;
+			}
+			return id;
+		}
+
+		//An expression whose operands are only loaded or constant for it, and whose value is only stored
+		bool isRemovable(BinaryOperator* expressionInst){
+			if (!expressionInst->hasOneUse()){
+				return false;
+			}
+			for (int j = 0; j < expressionInst->getNumOperands(); j++){
+				Value* operand = expressionInst->getOperand(j);
+				if (!isa<Constant>(operand) && !(isa<LoadInst>(operand) && operand->hasOneUse())){
+					return false;
+				}
+			}
+			return true;
+		}
+
+		//The value cast the way extension casts its operand, the value itself if there is no extension
+		Value* extend(Value* value, CastInst* extension, Instruction* insertBefore){
+			if (extension == NULL){
+				return value;
+			}
+			if (Constant* constant = dyn_cast<Constant>(value)){
+				return ConstantExpr::getCast(extension->getOpcode(), constant, extension->getType());
+			}
+			return CastInst::Create(extension->getOpcode(), value, extension->getType(), "Canonical", insertBefore);
+		}
+
+		//Erase a store of an expression, the expression and the loads feeding it
+		void removeExpression(StoreInst* storeInst, BinaryOperator* expressionInst){
+			Value* first = expressionInst->getOperand(0);
+			Value* second = expressionInst->getOperand(1);
+			storeInst->eraseFromParent();
+			expressionInst->eraseFromParent();
+			if (LoadInst* load = dyn_cast<LoadInst>(first)){
+				load->eraseFromParent();
+			}
+			if (second != first){
+				if (LoadInst* load = dyn_cast<LoadInst>(second)){
+					load->eraseFromParent();
+				}
+			}
+		}
+
 		//Run for each function
 		virtual bool runOnFunction(Function &F){
-      		PostDominatorTree& PDT = getAnalysis<PostDominatorTree>();
-
 			//Information about structure of program
 			std::map<BasicBlock*, int> basicBlockIndex;
 			std::map<int, BasicBlock*> basicBlockReverseIndex;
@@ -64,533 +154,366 @@ namespace {
 			std::map<Instruction*, int> instructionDefInstrIndex;
 			std::set<Instruction*> icmpExamined;
 
-			int *dist = NULL;						//Hold distance between any two blocks
-			int* reachDef = NULL;						//Hold reaching def for each instruction
-			std::map<BasicBlock*, std::set<int> > killedDef;	//Hold killed def for each block	
-			std::map<BasicBlock*, std::set<int> > usedDef;		//Hold used def for each bock
-			std::map<BasicBlock*, std::set<BasicBlock*> > influencedNode;		//Hold used dbock
+			Reachability reachability;					//Hold which blocks reach each other
+			ReachingDefs reachingDefs;					//Hold reaching def for each block
+			std::vector<BitVector> killedDef;	//Hold killed def for each block index
+			std::vector<BitVector> usedDef;		//Hold used def for each block index
+			std::vector<int> usedLoads;		//Hold number of loads with several reaching defs for each block index
+			std::vector<BitVector> influencedNode;		//Hold influenced blocks for each block index
 			std::map<BasicBlock*, std::set<BasicBlock*> > ROI;		//Hold used def for each bock
-			std::map<std::vector<BasicBlock*>, std::vector<BasicBlock*> > cloned;		//hold relation between original and clone
-			std::map<std::vector<BasicBlock*>, BasicBlock* > headCloned;		//hold relation between original and clone
-			std::map<std::vector<BasicBlock*>, std::vector<instTranslation*> > renameBlock;	//hold relation between ROI and new names
+			BitVector merging;		//Blocks that killed defs, by block index
+
+			//Read the block frequencies and the growth allowed, before anything is changed
+			BlockFrequencyInfo &BFI = getAnalysis<BlockFrequencyInfo>();
+			double entryFrequency = BFI.getBlockFreq(&F.getEntryBlock()).getFrequency();
+			int functionBudget = 0;
+			frequency.clear();
+			for (Function::iterator i = F.begin(); i != F.end(); ++i){
+				frequency[i] = BFI.getBlockFreq(i).getFrequency() / entryFrequency;
+				functionBudget += i->size();
+			}
+			functionBudget = functionBudget * functionGrowth / 100;
+			int numCopies = 0;
+			int grown = 0;
+			int numRemoved = 0;
+			std::vector<BasicBlock*> changedBlocks;		//Regions the last round copied, and their copies
+			std::vector<ClonedRegion*> copiedRegions;		//Every copy made, in order, to merge back those that bought nothing
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////INITIALIZE////////////////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 			int cloningFlag = 1;
-			int numBlock;		
+			int numBlock = 0;	//Number of blocks
+			int numDef = 0;			//number of defs
+
+			//The first round analyses the whole function. Later ones only find again the facts of the regions the round
+			//before copied, their copies and the blocks they exit to; everything else keeps its cached facts
+			bool fullAnalysis = true;
 		
 		while (cloningFlag == 1){
 
 			//Reset Flag
 			cloningFlag = 0;
 
-			//Free memory
-			if (dist!=NULL){
-				free(dist);
-			}
-			if (reachDef!=NULL){
-				free(reachDef);
-			}
-
 			//Clear maps
-			killedDef.clear();
-			usedDef.clear();
-			influencedNode.clear();
 			ROI.clear();
-			cloned.clear();
-			headCloned.clear();
-			renameBlock.clear();
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-///////////////////////////////////////////DISTANCE BETWEEN BLOCKS///////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////REACHABILITY BETWEEN BLOCKS///////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-			numBlock = 0;	//Number of blocks
-
 			//Get list of basic blocks			
 			Function::BasicBlockListType &allblocks = F.getBasicBlockList();
-			//Go through basic blocks
-			for (Function::iterator i = allblocks.begin(); i != allblocks.end(); i++) {
-				basicBlockReverseIndex[numBlock] = i;
-				basicBlockIndex[i] = numBlock++;		//hold information about where the basic block is
-			}
-
-			//Allocate array
-			dist = (int*) malloc(numBlock*numBlock*sizeof(int*));
-			for (int i = 0; i<numBlock; i++){
-				//Init to infinite
-				for(int j =0; j<numBlock; j++){
-					if (i==j){
-						dist[i*numBlock + j] = 0;
-					}else{
-						dist[i*numBlock + j] = 1000000000;
-					}
+			//Go through basic blocks, copies made since were numbered as they were made
+			if (fullAnalysis){
+				numBlock = 0;
+				basicBlockIndex.clear();
+				basicBlockReverseIndex.clear();
+				for (Function::iterator i = allblocks.begin(); i != allblocks.end(); i++) {
+					basicBlockReverseIndex[numBlock] = i;
+					basicBlockIndex[i] = numBlock++;		//hold information about where the basic block is
 				}
 			}
 
-			//Fill array will all with distance 1;
-			BasicBlock* successorBlock;	//Next basic block
-			//Block indexes
-			int sourceBlock = 0;
-			int destinationBlock;
-			for (Function::iterator i = allblocks.begin(); i != allblocks.end(); i++) {
-				//For each successor
-				for (int j = 0; j < (i->getTerminator())->getNumSuccessors();j++){
-					successorBlock = (i->getTerminator())->getSuccessor(j);	//Successor
-					destinationBlock = basicBlockIndex[successorBlock];
-					dist[sourceBlock*numBlock + destinationBlock] = 1;			//Set distance to 1
-				}
-				sourceBlock++;
-			}
-
-			//Perform the algorithm
-			for (int i = 0; i<numBlock ;i++){
-				for (int j = 0; j<numBlock ;j++){
-					for (int k = 0; k<numBlock ;k++){
-						if (j!=k){
-							if (dist[j*numBlock + k] > (dist[j*numBlock + i] + dist[i*numBlock + k])){ 
-								dist[j*numBlock + k] = dist[j*numBlock + i] + dist[i*numBlock + k];
-							}
-						}
-					}
-				}
-			}
+			//Find which blocks reach each other
+			reachability.build(F);
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////REACHING DEFINTION ANALYSIS////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-			int numInst = 0;		//number of instructions
-			int numDef = 0;			//number of defs
-
-			//Get loopinfo
-  			LoopInfo &LI = getAnalysis<LoopInfo>();
-
-			std::vector<Instruction*> instructionLists;	//List of instructions
-
-			//Put each instruction into list			
-			for(inst_iterator i = inst_begin(F), e = inst_end(F); i != e; ++i){
-				instructionLists.insert(instructionLists.end(), &*i);
-
-				//Get line number
-				unsigned int line;
-				MDNode *N = i->getMetadata("dbg");
-				if (N) {
-					DILocation Loc(N);                     
-					line = Loc.getLineNumber();
-				}
-
-				//Store data about variables in list - include line number, variable name, and actual instr
-				if (i->getOpcode()==28 && N && i->getOperand(1)->getName()!=""){
-					//Insert information about instruction
-					defInstruct* curInstuction = new defInstruct(i->getOperand(1)->getName(), numInst, line);
-					instructionDefIndex[numDef++] = curInstuction;
-				}
-				
-				//Store index number of instruction
-				instructionIndex[&*i] = numInst++;
-   			}
-
-			//Allocate 2d array to hold reaching def
-			reachDef = (int*)calloc((numInst)*numDef,sizeof(int));
-			
-			//Hold defentions that are being studied
-			int prevDef = 0;
-			int curDef = 0;
-			//go through each instruction and fix successor reaching defs
-			for(int i = 0; i < numInst; i++){
-				Instruction* curInst = instructionLists[i];	//Instruction being studied
-				BasicBlock *curBlock = curInst->getParent();	//block with current instruction
-				prevDef = curDef;				//defs being studied
-				
-				//Get which defs this instruction added
-				for (curDef = 0; curDef < numDef; curDef++){
-					//compare def to the instruction being studied
-					if(instructionDefIndex[curDef]->instructNum > i){
-						curDef--;
-						break;
+			std::vector<BasicBlock*> usedBlocks;		//blocks to find used defs for
+			std::vector<BasicBlock*> mergeBlocks;		//blocks to find killed defs for
+
+			if (fullAnalysis){
+				int numInst = 0;		//number of instructions
+				numDef = 0;
+				instructionIndex.clear();
+				instructionDefIndex.clear();
+
+				//Get loopinfo
+	  			LoopInfo &LI = getAnalysis<LoopInfo>();
+
+				std::vector<Instruction*> instructionLists;	//List of instructions
+				std::vector<Instruction*> defStores;		//Store making each def
+
+				//Put each instruction into list			
+				for(inst_iterator i = inst_begin(F), e = inst_end(F); i != e; ++i){
+					instructionLists.insert(instructionLists.end(), &*i);
+
+					//Get line number
+					unsigned int line;
+					MDNode *N = i->getMetadata("dbg");
+					if (N) {
+						DILocation Loc(N);                     
+						line = Loc.getLineNumber();
 					}
-				}
 
-				//copy prev instruction if not first instr in block
-				if (i > 0 && (curInst->getParent()->getFirstNonPHI()!=curInst)){
-					//Copy previous reach def
-					for (int j = 0; j < numDef; j++){
-						//if it is marked as reaching, mark it as reaching in next
-						if (reachDef[(i-1)*numDef+j] > 0){
-							reachDef[i*numDef+j] = reachDef[(i-1)*numDef+j]; 
-						}
+					//Store data about variables in list - include line number, variable name, and actual instr
+					if (i->getOpcode()==28 && N && i->getOperand(1)->getName()!=""){
+						//Insert information about instruction
+						defInstruct* curInstuction = new defInstruct(i->getOperand(1)->getName(), numInst, line);
+						instructionDefIndex[numDef++] = curInstuction;
+						defStores.push_back(&*i);
 					}
-				}
 				
-				//Add new defitions reachable because of new isntruction
-				for (int j = prevDef+1; j <= curDef && j < numDef; j++){
-					reachDef[i*numDef+j] = basicBlockIndex[curBlock] + 1;		//mark instruction as reaching
-					//Check if need to get rid of def
-					for (int k = 0; k < numDef; k++){
-						//if instruction  is marked as reaching and not the same instruction
-						if (reachDef[i*numDef+k] > 0 && instructionDefIndex[k]->instructNum!=i){
-							//if the instructions are for the same variable, mark the others so
-							if(instructionDefIndex[j]->def == instructionDefIndex[k]->def){
-								reachDef[i*numDef+k] = 0;
-							}
-						}
-					}
+					//Store index number of instruction
+					instructionIndex[&*i] = numInst++;
+	   			}
+
+				//Solve reaching def for each block
+				reachingDefs.run(F, defStores);
+				killedDef.assign(numBlock, BitVector(numDef));
+				usedDef.assign(numBlock, BitVector(numDef));
+				usedLoads.assign(numBlock, 0);
+				merging = BitVector(numBlock);
+				for (Function::iterator i = allblocks.begin(); i != allblocks.end(); i++) {
+					usedBlocks.push_back(i);
 				}
-
-				int changedFlag = 0;	//Flag to hold whether any changes where made
-				int killedFlag = 0;	//Flag to hold whether a def was killed
-
-				//If  it is a terminating instruction and is doing a call
-				if (curInst->isTerminator() && (((curBlock->getTerminator())->getNumSuccessors()>1)||curInst->getOpcode()==2)){
-					for (int j = 0; j<curBlock->getTerminator()->getNumSuccessors(); j++){
-						//Get the destination of the call
-						BasicBlock* nextBlock = curBlock->getTerminator()->getSuccessor(j);
-						Instruction* nextInst = nextBlock->getFirstNonPHI();
-
-						//Get index of the instruction
-						int nextInstIndex = instructionIndex[nextInst];
-
-						for (int k = 0; k<numDef; k++){
-							//Copy the reach definitions
-							if (reachDef[i*numDef+k] > 0){
-								if (reachDef[nextInstIndex*numDef+k] < 1){ 
-									changedFlag = 1;	//mark  there was a change
-									//Copy def
-									reachDef[nextInstIndex*numDef+k] = basicBlockIndex[curBlock] + 1; 
-								     
-									std::set<int> newKill;	//set of defs killed
-
-								     	//check for killed def
-									for (int d = 0; d < numDef;d++){
-										//if a diff def for same variable, and both reach
-										if (d!=k && instructionDefIndex[d]->def==instructionDefIndex[k]->def && reachDef[nextInstIndex*numDef+d]>0){
-											//if they are from diff blocks, then it is killed
-											if (reachDef[nextInstIndex*numDef+d] != reachDef[nextInstIndex*numDef+k]){
-												killedFlag = 1;
-											}
-
-										       	newKill.insert(d);	//insert it as newly killed
-										  }
-									}
-								     
-									//if there is a def killed, add the intial that triggered 
-								     	if (killedFlag){
-										killedFlag = 0;		//reset flag
-
-								          	std::set<int> currentKill = killedDef[nextBlock];	//get set
-										
-										//Add newly killed
-								         	currentKill.insert(k);
-										currentKill.insert(newKill.begin(), newKill.end());
-								          	
-										killedDef[nextBlock] = currentKill;			//Add back
-								     	}
-								}
-							}
+				mergeBlocks = usedBlocks;
+			}else{
+				//The copies count as the defs they were copied from, so only the changed blocks are solved again
+				reachingDefs.update(changedBlocks);
+				killedDef.resize(numBlock, BitVector(numDef));
+				usedDef.resize(numBlock, BitVector(numDef));
+				usedLoads.resize(numBlock, 0);
+				merging.resize(numBlock);
+				usedBlocks = changedBlocks;
+
+				//The blocks the regions exit to now also come in from the copies
+				std::set<BasicBlock*> seen(changedBlocks.begin(), changedBlocks.end());
+				mergeBlocks = changedBlocks;
+				for (int j = 0; j < changedBlocks.size(); j++){
+					for (succ_iterator k = succ_begin(changedBlocks[j]); k != succ_end(changedBlocks[j]); ++k){
+						if (seen.insert(*k).second){
+							mergeBlocks.push_back(*k);
 						}
-
-						//If there was a change restart analysis earlier - add to procset
-						if (changedFlag){
-							changedFlag = 0;	//reset flag
-
-							//if modified an earlier instruction, go back
-							if (i>nextInstIndex){
-								i = nextInstIndex;
-							}
-
-							//Modify def analysis based on moving back
-							for (curDef = 0; curDef < numDef; curDef++){
-								if(instructionDefIndex[curDef]->instructNum > i){
-									curDef--;
-									break;
-								}
-							}
-
-							//go back to new successor block if backwards
-							if (i>nextInstIndex){
-								break;
-							}
-						}
-
 					}
 				}
 			}
+
+			//Find the defs merged in each block
+			BitVector refreshed(numBlock);		//blocks whose killed or used defs were found again
+			for (int j = 0; j < mergeBlocks.size(); j++){
+				int block = basicBlockIndex[mergeBlocks[j]];
+				refreshed.set(block);
+				killedDef[block].reset();
+				reachingDefs.getMergesAt(mergeBlocks[j], killedDef[block]);
+				merging[block] = killedDef[block].any();
+			}
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////USED DEF ANALYSIS//////////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-			int curInstIndex = 0;
-			//Go through each instruction
-			for(inst_iterator i = inst_begin(F), e = inst_end(F); i != e; ++i){
-				if (i->getOpcode()==27){		//Is a load instruction
-					std::set<int> defsUsed;
-					//Go throuch reaching defs
-					for (int d = 0 ;d<numDef; d++){
-						//if the variable used has multiple reachinf defs, insert them
-						if (reachDef[curInstIndex*numDef + d] > 0 && instructionDefIndex[d]->def == i->getOperand(0)->getName()){
-							defsUsed.insert(d);		//add to used
+			//Go through each instruction of the blocks
+			for (int j = 0; j < usedBlocks.size(); j++){
+				int block = basicBlockIndex[usedBlocks[j]];
+				BitVector &currentUsed = usedDef[block];
+				currentUsed.reset();
+				usedLoads[block] = 0;
+				refreshed.set(block);
+				for (BasicBlock::iterator i = usedBlocks[j]->begin(); i != usedBlocks[j]->end(); ++i){
+					if (i->getOpcode()==27){		//Is a load instruction
+						//Go throuch reaching defs of the variable used
+						ReachingDefs::Defs reaching = reachingDefs.reachingOf(i->getOperand(0), &*i);
+
+						//if there are mutliple reach defs, then add to used defs list
+						if (reaching.count()>1){
+							usedLoads[block]++;
+							for (ReachingDefs::Defs::iterator d = reaching.begin(); d != reaching.end(); ++d){
+								currentUsed.set(*d);		//add to used
+							}
 						}
-					}
-					//if there are mutliple reach defs, then add to used defs list
-					if (defsUsed.size()>1){
-						std::set<int> currentUsed = usedDef[i->getParent()];
-						currentUsed.insert(defsUsed.begin(), defsUsed.end());
-						usedDef[i->getParent()] = currentUsed;
-					}
 
+					}
 				}
-				curInstIndex++;
 			}
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////INFLUENCED NODE//////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-			//Go through each block
-			for (Function::iterator i = allblocks.begin(); i != allblocks.end(); i++){	
-				//if it has mutliple defs that it killed
-				if (killedDef[i].size() > 0){
-					//Go through each block and look for a path
-					for (Function::iterator j = allblocks.begin(); j != allblocks.end(); j++){
-						//Get indexes for block
-						int sourceBlock = basicBlockIndex[i];
-						int destBlock = basicBlockIndex[j];
-
-						if (usedDef[j].size() > 0){
-							//If they are different blocks and one source reaches dest or the same block
-							if ((dist[sourceBlock*numBlock + destBlock]>0 && dist[sourceBlock*numBlock + destBlock]<100000000) || sourceBlock==destBlock){
-								//Go through the killed defs for source block
-								for (std::set<int>::iterator k = killedDef[i].begin(); k != killedDef[i].end(); ++k){
-									int killed = *k;
-					
-									//GO through used defs for dest blocks
-									for (std::set<int>::iterator m = usedDef[j].begin(); m != usedDef[j].end(); ++m){
-										int used = *m;
-
-										//if there is an interesection between killed and used, dest is influenced
-										if (used==killed){
-											std::set<BasicBlock*> influencedBlocks = influencedNode[i];
-											influencedBlocks.insert(j);
-											influencedNode[i] = influencedBlocks;
-										}
-									}
-								}
-							}
-						}		
+			//Go through each block that killed defs, and the blocks it reaches
+			influencedNode.assign(numBlock, BitVector());
+			for (int sourceBlock = merging.find_first(); sourceBlock != -1; sourceBlock = merging.find_next(sourceBlock)){
+				BitVector reached = reachability.getReached(sourceBlock);
+				reached.set(sourceBlock);
+
+				//Every source that influenced a block was copied or turned down last round. The others only influence something
+				//now if their killed defs or the used defs of a block they reach were found again
+				if (!reached.anyCommon(refreshed)){
+					continue;
+				}
+				influencedNode[sourceBlock].resize(numBlock);
+				for (int destBlock = reached.find_first(); destBlock != -1; destBlock = reached.find_next(destBlock)){
+					//if there is an interesection between killed and used, dest is influenced
+					if (killedDef[sourceBlock].anyCommon(usedDef[destBlock])){
+						influencedNode[sourceBlock].set(destBlock);
 					}
 				}
 			}
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////ROI//////////////////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-			int maxSize = 10000000;
-			//int 			
-			for (std::map<BasicBlock*, std::set<BasicBlock*> >::iterator i = ROI.begin(); i != ROI.end(); ++i){
-				int size = i->second.size();
-			}
-			
-			int ROIFlag = 1;			
-			//Go through all blocks
-			for (Function::iterator i = allblocks.begin(); i != allblocks.end() ; i++){
-				int sourceBlock = basicBlockIndex[i];	//Initial block
-	
-				//GO through influenced blocks for each blocks
-				for (std::set<BasicBlock*>::iterator j = influencedNode[i].begin(); j != influencedNode[i].end(); ++j){ 
-					int endBlock = basicBlockIndex[*j]; 	//last block
-
-					std::set<BasicBlock*> curROI;
-					//Go through all the blocks and set as an intermediate block
-					for (Function::iterator k = allblocks.begin(); (k != allblocks.end()) && ROIFlag==1; k++){	
-						int intermediateBlock = basicBlockIndex[k];
-
-						//if source reaches intermediate, and intermediate reaches dest, then in ROI
-						if ((dist[sourceBlock*numBlock+intermediateBlock]>0 && dist[sourceBlock*numBlock+intermediateBlock]<1000000000)|| sourceBlock==intermediateBlock){ 
-							if ((dist[intermediateBlock*numBlock+endBlock]>0 && dist[intermediateBlock*numBlock+endBlock]<1000000000)|| endBlock==intermediateBlock){
-								curROI.insert(k);	
-							}
-						}	
-					}
+			//The ROI of a block is every block on a path from it to a block it influences
+			for (int sourceBlock = merging.find_first(); sourceBlock != -1; sourceBlock = merging.find_next(sourceBlock)){
+				if (influencedNode[sourceBlock].none()){
+					continue;
+				}
 
-					//Insert into list of ROI
-					if (curROI.size()>0){
-						ROI[i] =curROI;
-						//ROIFlag = 0;
-						//break;			//FIX
-					}
+				//Blocks reaching any of the influenced blocks
+				BitVector towards(numBlock);
+				for (int endBlock = influencedNode[sourceBlock].find_first(); endBlock != -1; endBlock = influencedNode[sourceBlock].find_next(endBlock)){
+					towards |= reachability.getReaching(endBlock);
+					towards.set(endBlock);
 				}
-				
-				//if (ROI[i].size()>1){		//FIX
-				//	break;			//FIX
-				//}
 
+				//that the source reaches
+				BitVector curROI = reachability.getReached(sourceBlock);
+				curROI.set(sourceBlock);
+				curROI &= towards;
+
+				//Insert into list of ROI
+				for (int k = curROI.find_first(); k != -1; k = curROI.find_next(k)){
+					ROI[basicBlockReverseIndex[sourceBlock]].insert(basicBlockReverseIndex[k]);
+				}
 			}
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////REPLICATING//////////////////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-			//Go through all the ROI sets and clone them		
+			//Go through all the ROI sets and clone them
+			std::vector<ClonedRegion*> clonedRegions;
+			std::vector<BasicBlock*> enteringBlocks;		//predecessor of the head that enters each clone
+			std::vector<BasicBlock*> failureBlocks;		//blocks on either end of the edge of a removed check
 			for (std::map<BasicBlock*, std::set<BasicBlock*> >::iterator i = ROI.begin(); i != ROI.end(); ++i){
 
-				//Count number of predecessor blocks
+				//Get predecessor blocks
 				int sourceBlock = basicBlockIndex[i->first];	//get index of top of ROI block
-				int numPred = 0;
-				for (int j = 0; j<numBlock; j++){
-					if (dist[j*numBlock + sourceBlock]==1){
-						numPred++;	//Increment
+				std::vector<unsigned> &preds = reachability.getPredecessors(sourceBlock);
+				std::vector<BasicBlock*> originalROI(i->second.begin(), i->second.end());
+
+				//Instructions a copy duplicates, and the checks and merged loads in the influenced blocks it could
+				//make redundant, in runs per call
+				int size = 0;
+				double work = 0;
+				for (int j = 0; j < originalROI.size(); j++){
+					int block = basicBlockIndex[originalROI[j]];
+					size += originalROI[j]->size();
+					if (influencedNode[sourceBlock].test(block)){
+						work += getFrequency(originalROI[j]) * (usedLoads[block] + countChecks(originalROI[j]));
 					}
 				}
-
-				//Create 1 for each predecessor
-				for (int k = 1; k<numPred; k++){
-
-					std::vector<BasicBlock*> originalROI;				
-					std::vector<BasicBlock*> clonedROI;
-					std::vector<instTranslation*> newTranslations;
-
-					//Go through a specific set of ROI blocks
-					for (std::set<BasicBlock*>::iterator j=(i->second).begin(); j!=(i->second).end(); ++j){
-
-						BasicBlock *cloneBB = BasicBlock::Create((*j)->getContext(), Twine((*j)->getName() + "clone"), &F);
-						//Go through instructions for each block
-						for (BasicBlock::iterator m = (*j)->begin(); m!=(*j)->end(); ++m) {
-							//clone instruction     
-							Instruction *cloneInst = m->clone();
-							if (m->hasName()){
-								cloneInst->setName(m->getName() + "clone");
-							}
-
-							//Insert name translation
-							instTranslation* curInstTranlate = new instTranslation(m, cloneInst);
-							newTranslations.insert(newTranslations.end(), curInstTranlate);
-
-							cloneBB->getInstList().push_back(cloneInst);
-						}
-						//Add cloned BB
-						clonedROI.insert(clonedROI.end(), cloneBB);
-						originalROI.insert(originalROI.end(), *j);
-
+				double headFrequency = getFrequency(i->first);
+
+#if pathQualified
+				//Checks that pass along every way into the region need no copy, they are removed from the region itself
+				std::vector<ICmpInst*> alwaysPassing;
+				qualified.findAlwaysPassing(reachingDefs, i->first, originalROI, alwaysPassing);
+				for (int j = 0; j < alwaysPassing.size(); j++){
+					failureBlocks.push_back(alwaysPassing[j]->getParent());
+					failureBlocks.push_back(PathQualified::removeCheck(alwaysPassing[j]));
+					numRemoved++;
+				}
+				reachingDefs.clearWalk();
+#endif
+
+				//Create 1 for each predecessor it pays for, the first predecessor can just use the original
+				std::vector<std::pair<ClonedRegion*, double> > copies;
+				double movedShare = 0;
+				for (int k = 1; k<preds.size(); k++){
+					//The part of the runs of the head that come from this predecessor
+					BasicBlock* prevBlock = basicBlockReverseIndex[preds[k]];
+					double share = 0;
+					if (headFrequency > 0){
+						share = std::min(1.0, getFrequency(prevBlock) / prevBlock->getTerminator()->getNumSuccessors() / headFrequency);
+					}
+					double benefit = share * work;
+#if pathQualified
+					//Only the checks the copy removes along the path from this predecessor count
+					std::vector<ICmpInst*> passing;
+					qualified.findPassing(reachingDefs, i->first, prevBlock, originalROI, passing);
+					if (passing.size() == 0){
+						continue;
+					}
+					benefit = 0;
+					for (int j = 0; j < passing.size(); j++){
+						benefit += share * getFrequency(passing[j]->getParent());
 					}
-					//Map orininal to cloned
-					cloned[clonedROI] = originalROI;
-					headCloned[clonedROI] = i->first;
-					renameBlock[clonedROI] = newTranslations;
+#endif
+					if (benefit * cloneCost < size || size > functionBudget || size > moduleBudget){
+						continue;
+					}
+					functionBudget -= size;
+					moduleBudget -= size;
+					grown += size;
+					numCopies++;
+
+					ClonedRegion* clonedROI = new ClonedRegion();
+					clonedROI->clone(i->first, originalROI, "clone");
+					clonedRegions.push_back(clonedROI);
+					enteringBlocks.push_back(prevBlock);
+					copies.push_back(std::make_pair(clonedROI, share));
+					movedShare += share;
+#if pathQualified
+					for (int j = 0; j < passing.size(); j++){
+						failureBlocks.push_back(PathQualified::removeCheck(cast<ICmpInst>(clonedROI->getCopy(passing[j]))));
+						numRemoved++;
+					}
+#endif
 				}
-			}
 
-			//Fix up names
-			//Go throuch each clone
-			for (std::map<std::vector<BasicBlock*>, std::vector<instTranslation*> >::iterator i = renameBlock.begin(); i!=renameBlock.end(); ++i){
-				//Go throuch each block in clone
-				for (std::vector<BasicBlock*>::const_iterator j=(i->first).begin(); j!=(i->first).end(); ++j){
-					//Go throuch each instruction					
-					for (BasicBlock::iterator k = (*j)->begin(); k!=(*j)->end(); ++k) {
-						//Go throuch each operand in each instruction
-						for (int m = 0; m<k->getNumOperands() ;m++){
-							//Go through each rename
-							for (int n = 0; n<i->second.size();n++){
-								instTranslation* instFixing = i->second[n];
-								//if refer to old, replace
-								if (k->getOperand(m)==instFixing->oldInst){
-									k->setOperand(m,instFixing->newInst);
-								}
-							}
-						}
+				//Copies take the runs of their predecessor, the original keeps the rest
+				movedShare = std::min(1.0, movedShare);
+				for (int j = 0; j < originalROI.size(); j++){
+					double original = getFrequency(originalROI[j]);
+					for (int k = 0; k < copies.size(); k++){
+						frequency[copies[k].first->clones[j]] = original * copies[k].second;
 					}
-
+					frequency[originalROI[j]] = original * (1 - movedShare);
 				}
 			}
 
-			//Go through cloned and fix up pointers
-			for (std::map<std::vector<BasicBlock*>, std::vector<BasicBlock*> >::iterator i = cloned.begin(); i!=cloned.end(); ++i){
-				for (std::vector<BasicBlock*>::const_iterator j=(i->first).begin(); j!=(i->first).end(); ++j){
-					//Fix up terminator pointers
-					for (int k = 0; k<(*j)->getTerminator()->getNumSuccessors(); k++){
-						//Get the destination of the call
-						BasicBlock* nextBlock = (*j)->getTerminator()->getSuccessor(k);
-
-						//Try to find the block within the ROI
-						std::vector<BasicBlock*>::iterator it;
-						it = std::find((i->second).begin(),(i->second).end(), nextBlock);
-
-						//If it is found, we have to redirect it
-						if (it!=(i->second).end()){
-							//cast as branch
-							BranchInst* bi = dyn_cast<BranchInst>((*j)->getTerminator());
-							if (bi){
-								//get next block in clone and set as successor
-								BasicBlock* cloneNextBlock = i->first[it - (i->second).begin()];
-								bi->setSuccessor (k, cloneNextBlock);
-							}
-						}
-					}				
+			//Fix up predecessor pointers, once all regions are cloned from the original blocks
+			fullAnalysis = false;
+			for (int i = 0; i < clonedRegions.size(); i++){
+				if (clonedRegions[i]->enterFrom(enteringBlocks[i])){
+					cloningFlag = 1;
+				}else{
+					//Erasing blocks moves the block numbers, so the next round starts over
+					clonedRegions[i]->discard();
+					fullAnalysis = true;
 				}
 			}
 
-			//Fix up predecessor  pointers
-			while(cloned.size()>0){
-				//Go through each ROI
-				for (std::map<std::vector<BasicBlock*>, std::vector<BasicBlock*> >::iterator i = cloned.begin(); i!=cloned.end(); ++i){
-					std::vector<BasicBlock*> clonedROI = i->first;
-					std::vector<BasicBlock*> originalROI = i->second;
-
-					//Get information about head of basic block	
-					BasicBlock* headBlock = headCloned[i->first];
-					int headBlockIndex = basicBlockIndex[headBlock];
-
-					//Find the predecessors of block
-					int numPred = 0;
-					for (int j = 0; j<numBlock; j++){
-						if (dist[j*numBlock + headBlockIndex]==1){
-							numPred++;	//Increment
-							//First predecessor can just use the original
-							if (numPred==1){
-								continue;
-							}
-
-							cloningFlag = 1;
-
-							//Get cloned head block
-							BasicBlock* cloneHeadBlock;
-							std::vector<BasicBlock*>::iterator it;
-							it = std::find(originalROI.begin(),originalROI.end(), headBlock);
-							if (it!=originalROI.end()){
-								//get next block in clone and set as successor
-								cloneHeadBlock = clonedROI[it - originalROI.begin()];
-							}
-
-
-							//Get the previous block
-							BasicBlock* prevBlock = basicBlockReverseIndex[j];
-							//Go through the successors for the prdedecessor block
-							for (int k = 0; k<prevBlock->getTerminator()->getNumSuccessors(); k++){
-								//Get the destination of the call and check if dest is head
-								BasicBlock* nextBlock = prevBlock->getTerminator()->getSuccessor(k);
-								if (nextBlock!=headBlock){
-									continue;
-								}
-
-								//cast as branch
-								BranchInst* bi = dyn_cast<BranchInst>(prevBlock->getTerminator());
-								if (bi){
-									//get head block in clone and set as successor
-									bi->setSuccessor (k, cloneHeadBlock);
-									
-									//Remove from maps
-									cloned.erase(clonedROI);
-									headCloned.erase(clonedROI);
-									break;
-								}						
-							}
-						}
-
-						//Go through all clones
-						for (std::map<std::vector<BasicBlock*>, std::vector<BasicBlock*> >::iterator k = cloned.begin(); k!=cloned.end(); ++k){ 
-							//Find another clone for same blocks
-							if (k->second==originalROI){
-								clonedROI = k->first;
-								break; 
-							}
+			//Number the copies, which were added at the end of the function, and note what changed
+			changedBlocks.clear();
+			std::set<BasicBlock*> changedSet;
+			for (int i = 0; i < clonedRegions.size(); i++){
+				ClonedRegion* clonedROI = clonedRegions[i];
+				for (int j = 0; j < clonedROI->clones.size() && !fullAnalysis; j++){
+					basicBlockReverseIndex[numBlock] = clonedROI->clones[j];
+					basicBlockIndex[clonedROI->clones[j]] = numBlock++;
+					if (changedSet.insert(clonedROI->originals[j]).second){
+						changedBlocks.push_back(clonedROI->originals[j]);
+					}
+					changedSet.insert(clonedROI->clones[j]);
+					changedBlocks.push_back(clonedROI->clones[j]);
+
+					//Copied stores make the same defs
+					for (BasicBlock::iterator m = clonedROI->originals[j]->begin(); m != clonedROI->originals[j]->end(); ++m){
+						//The copies of checks removed along the path are gone
+						Value* copy = clonedROI->getCopy(m);
+						if (copy != NULL){
+							reachingDefs.addCopy(m, cast<Instruction>(copy));
 						}
-
-
 					}
 				}
+				if (clonedROI->clones.size() > 0){
+					copiedRegions.push_back(clonedROI);
+				}else{
+					delete clonedROI;
+				}
+			}
+			for (int i = 0; i < failureBlocks.size() && !fullAnalysis; i++){
+				if (changedSet.insert(failureBlocks[i]).second){
+					changedBlocks.push_back(failureBlocks[i]);
+				}
 			}
 		}
+			errs()<<F.getName()<<": "<<numCopies<<" region copies, "<<grown<<" instructions added, "<<numRemoved<<" checks removed along paths\n";
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////GVN////////////////////////////////////////////////////////////////////////////////
@@ -607,7 +530,6 @@ namespace {
 
 			std::map<int, Instruction*> instructionReverseIndex;
 
-			free(reachDef);						//Hold reaching def for each instruction
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 			int numInst = 0;		//number of instructions
 			int numDef = 0;			//number of defs
@@ -616,6 +538,7 @@ namespace {
   			LoopInfo &LI = getAnalysis<LoopInfo>();
 
 			std::vector<Instruction*> instructionLists;	//List of instructions
+			std::vector<Instruction*> defStores;		//Store making each def
 
 			//Put each instruction into list			
 			for(inst_iterator i = inst_begin(F), e = inst_end(F); i != e; ++i){
@@ -635,6 +558,7 @@ namespace {
 					defInstruct* curInstuction = new defInstruct(i->getOperand(1)->getName(), numInst, line);
 					instructionDefIndex[numDef] = curInstuction;
 					instructionDefInstrIndex[&*i] = numDef++;
+					defStores.push_back(&*i);
 				}
 				
 				//Store index number of instruction
@@ -643,113 +567,17 @@ namespace {
 
    			}
 
-			//Allocate 2d array to hold reaching def
-			reachDef = (int*)calloc((numInst)*numDef,sizeof(int));
-			
-			//Hold defentions that are being studied
-			int prevDef = 0;
-			int curDef = 0;
-			//go through each instruction and fix successor reaching defs
-			for(int i = 0; i < numInst; i++){
-				Instruction* curInst = instructionLists[i];	//Instruction being studied
-				BasicBlock *curBlock = curInst->getParent();	//block with current instruction
-				prevDef = curDef;				//defs being studied
-				
-				//Get which defs this instruction added
-				for (curDef = 0; curDef < numDef; curDef++){
-					//compare def to the instruction being studied
-					if(instructionDefIndex[curDef]->instructNum > i){
-						curDef--;
-						break;
-					}
-				}
-
-				//copy prev instruction if not first instr in block
-				if (i > 0 && (curInst->getParent()->getFirstNonPHI()!=curInst)){
-					//Copy previous reach def
-					for (int j = 0; j < numDef; j++){
-						//if it is marked as reaching, mark it as reaching in next
-						if (reachDef[(i-1)*numDef+j] > 0){
-							reachDef[i*numDef+j] = reachDef[(i-1)*numDef+j]; 
-						}
-					}
-				}
-				
-				//Add new defitions reachable because of new isntruction
-				for (int j = prevDef+1; j <= curDef && j < numDef; j++){
-					reachDef[i*numDef+j] = basicBlockIndex[curBlock] + 1;		//mark instruction as reaching
-					//Check if need to get rid of def
-					for (int k = 0; k < numDef; k++){
-						//if instruction  is marked as reaching and not the same instruction
-						if (reachDef[i*numDef+k] > 0 && instructionDefIndex[k]->instructNum!=i){
-							//if the instructions are for the same variable, mark the others so
-							if(instructionDefIndex[j]->def == instructionDefIndex[k]->def){
-								reachDef[i*numDef+k] = 0;
-							}
-						}
-					}
-				}
-
-				int changedFlag = 0;	//Flag to hold whether any changes where made
-				int killedFlag = 0;	//Flag to hold whether a def was killed
-
-				//If  it is a terminating instruction and is doing a call
-				if (curInst->isTerminator() && (((curBlock->getTerminator())->getNumSuccessors()>1)||curInst->getOpcode()==2)){
-					for (int j = 0; j<curBlock->getTerminator()->getNumSuccessors(); j++){
-						//Get the destination of the call
-						BasicBlock* nextBlock = curBlock->getTerminator()->getSuccessor(j);
-						Instruction* nextInst = nextBlock->getFirstNonPHI();
-
-						//Get index of the instruction
-						int nextInstIndex = instructionIndex[nextInst];
-
-						for (int k = 0; k<numDef; k++){
-							//Copy the reach definitions
-							if (reachDef[i*numDef+k] > 0){
-								if (reachDef[nextInstIndex*numDef+k] < 1){ 
-									changedFlag = 1;	//mark  there was a change
-									//Copy def
-									reachDef[nextInstIndex*numDef+k] = basicBlockIndex[curBlock] + 1; 
-								  
-								}
-							}
-						}
-
-						//If there was a change restart analysis earlier - add to procset
-						if (changedFlag){
-							changedFlag = 0;	//reset flag
-
-							//if modified an earlier instruction, go back
-							if (i>nextInstIndex){
-								i = nextInstIndex;
-							}
-
-							//Modify def analysis based on moving back
-							for (curDef = 0; curDef < numDef; curDef++){
-								if(instructionDefIndex[curDef]->instructNum > i){
-									curDef--;
-									break;
-								}
-							}
-
-							//go back to new successor block if backwards
-							if (i>nextInstIndex){
-								break;
-							}
-						}
-
-					}
-				}
-			}
+			//Solve reaching def for each block
+			reachingDefs.run(F, defStores);
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-			std::map<std::vector<int>, int> hashTable;		//hold relation between expression and id
-			std::map<int, std::vector<int> > reverseHashTable;		//hold relation between expression and id
-			std::map<std::vector<int>, BasicBlock*> hashTableBlock;		//hold relation between expression and id
+			ScopedValueTable expressions;		//expressions of values and the stores holding them
+			expressions.init(numInst);
 
 			std::map<std::set<defInstruct*>, int> phiTable;		//hold relation between phi expression and phi id
 
 			std::map<Value*, int> valueID;		//memory location and id
 			std::map<int, std::vector<Value*> > reverseValueID;		//id to memory locations
+			ValueClasses classes;		//ids known to be the same value
 
 
 			//Get Dominator info
@@ -757,28 +585,22 @@ namespace {
 			dominatorTree = new DominatorTreeBase<BasicBlock>(false);
 			dominatorTree->recalculate(F);
 
-			//Queue of blocks
-			set<BasicBlock*> visited;
-			queue<BasicBlock*> nextBlocks;
-			nextBlocks.push(&F.getEntryBlock());
+			//Path from the root of the dominator tree to the block being visited, with the next child to go to
+			std::vector<std::pair<DomTreeNodeBase<BasicBlock>*, unsigned> > dominatorPath;
+			DomTreeNodeBase<BasicBlock>* nextNode = dominatorTree->getRootNode();
 
 			int ID = 1;
 			int phiID = -1;
 
-			//Visit until nore more blocks left
-			while(!nextBlocks.empty()){
+			//Visit the dominator tree depth first, so a block sees the expressions of the blocks dominating it
+			while(nextNode != NULL){
 
 				//Get next block
-				BasicBlock* block = nextBlocks.front();
-				nextBlocks.pop();
-
-				//If already have gone to this block, skip it
-				if(visited.find(block) != visited.end()) continue;
-				visited.insert(block);
+				BasicBlock* block = nextNode->getBlock();
+				dominatorPath.push_back(std::make_pair(nextNode, 0u));
+				expressions.openScope();
 
 				int curID;
-				std::vector<int> curInstComboID;
-				std::vector<Instruction*> curInstCombo;
 
 				int isArrayFlag = 0;
 				//Visit the instructions
@@ -796,103 +618,35 @@ namespace {
 									continue;
 								}
 
-								//If value store is a constant
-								if (isa<Constant>(storeInst->getValueOperand())){
-
-									//Insert into ValueID table
-									if (valueID[storeInst->getValueOperand()]!=0){		//already in value table
-										curID = valueID[storeInst->getValueOperand()];
-									}else{							//not in table
-										curID = ID++;	//increment ID
-									}
-
-									//List as a current instruction
-									curInstComboID.clear();
-									curInstCombo.clear();
-									curInstComboID.insert(curInstComboID.end(), curID);
-
-									//Update ValueID Table
-									valueID[storeInst->getValueOperand()] = curID;
-								}
-
-								int deleteFlag = 0;	//flag to hold info about deletions
-								int sizeFlag = 0;	//flag to hold info about size
-
-								//Reorganize elements to ensure that similar expression get same value #
-								if (curInstComboID.size()==3){
-									sizeFlag = 1;
-									//Smaller number first
-									if (curInstComboID[0]>curInstComboID[1]){
-										int tempValue = curInstComboID[1];
-										curInstComboID[1] = curInstComboID[0];
-										curInstComboID[0] = tempValue;
-									}
-								}
-
-								//Check Hash table to see if already exists
-								if (hashTable[curInstComboID]!=0){		//already in hash table
-									curID = hashTable[curInstComboID];
-									deleteFlag = 1;
-								}else{							//not in table
-									hashTableBlock[curInstComboID] = block;
-									curID = ID++;	//Increment ID
-								}
-
-								//If it is an eqaulity, just give id of the other element
-								if (curInstComboID.size()==1){
-									curID = curInstComboID[0];
-								}
-
-								if (deleteFlag && sizeFlag && reverseValueID[curID].size()>0 && dominatorTree->dominates(hashTableBlock[curInstComboID],block)){
-	
-									int canReplaceFlag = 0;
-									StoreInst* storeInstWithValue;
-									for (int k = 0; k<reverseValueID[curID].size();k++){
-										//Create new instructions as replacements
-										storeInstWithValue = dyn_cast<StoreInst>(reverseValueID[curID][k]);
-										if (storeInstWithValue){
-											int defIndex = instructionDefInstrIndex[storeInstWithValue];	
-											int curIndex = instructionIndex[storeInst];
-											if (reachDef[curIndex*numDef+defIndex]>0){
-
-												canReplaceFlag = 1;
-												break;
-											}
-										}		
-									}
-
-									if (canReplaceFlag && simplifiedFlag == 0){
-										LoadInst *replacementLoad = new LoadInst(storeInstWithValue->getPointerOperand(), "GVN", storeInst);
-										replacementLoad->setAlignment(4);
-										StoreInst *replacementStore = new StoreInst(replacementLoad, storeInst->getPointerOperand(), storeInst);
-										replacementStore->setAlignment(4);
-									
-										//Remove old instructions
-										i++;
-										storeInst->eraseFromParent();
-
-										if (curInstCombo.size()==3){
-											curInstCombo[2]->eraseFromParent();
+								//The value stored has the id of what computed it
+								curID = getValueID(storeInst->getValueOperand(), valueID, ID);
+
+								//An expression already held by a store dominating this one is loaded from it instead, while
+								//that store is the only def of its variable reaching here
+								BinaryOperator* expressionInst = dyn_cast<BinaryOperator>(storeInst->getValueOperand());
+								if (expressionInst){
+									ScopedValueTable::Entry &expression = expressions.get(expressionInst->getOpcode(), getValueID(expressionInst->getOperand(0), valueID, ID), getValueID(expressionInst->getOperand(1), valueID, ID));
+									if (expression.available == NULL){
+										expressions.setAvailable(expression, storeInst);
+									}else if (isRemovable(expressionInst) && simplifiedFlag == 0){
+										StoreInst* storeInstWithValue = expression.available;
+										ReachingDefs::Defs reaching = reachingDefs.reachingOf(storeInstWithValue->getPointerOperand(), storeInst);
+										if (reaching.count() == 1 && reaching.test(instructionDefInstrIndex[storeInstWithValue])){
+											LoadInst *replacementLoad = new LoadInst(storeInstWithValue->getPointerOperand(), "GVN", storeInst);
+											replacementLoad->setAlignment(4);
+											StoreInst *replacementStore = new StoreInst(replacementLoad, storeInst->getPointerOperand(), storeInst);
+											replacementStore->setAlignment(4);
+
+											//Remove old instructions
+											removeExpression(storeInst, expressionInst);
+											reachingDefs.clearWalk();
+
+											//change pointers for ease of use
+											storeInst = replacementStore;
+											i = replacementStore;
+
+											simplifiedFlag = 1;
 										}
-										curInstCombo[1]->eraseFromParent();	
-										curInstCombo[0]->eraseFromParent();	
-
-										//change pointers for ease of use
-										storeInst = replacementStore;
-
-										simplifiedFlag = 1;
-									}
-								}
-								//Some conditions for changing block of expression
-								else if (deleteFlag && sizeFlag && reverseValueID[curID].size()>0){
-
-									if (PDT.dominates(block, hashTableBlock[curInstComboID])){
-										hashTableBlock[curInstComboID] = block;
-									}
-									int srcBlock = basicBlockIndex[hashTableBlock[curInstComboID]];
-									int destBlock = basicBlockIndex[block]; 
-									if (dist[srcBlock*numBlock + destBlock]>=10000000){
-										hashTableBlock[curInstComboID] = block;
 									}
 								}
 
@@ -900,24 +654,11 @@ namespace {
 								valueID[storeInst] = curID;
 								//Add to reverse look up table
 								reverseValueID[curID].insert(reverseValueID[curID].end(), storeInst);
-
-								//Insert into hash table
-								hashTable[curInstComboID] = curID;
-								reverseHashTable[curID] = curInstComboID;
-			
-								//Get ready for next instruction
-								curInstCombo.clear();
-								curInstComboID.clear();
+								classes.addStore(curID, storeInst);
 							}
 						}
 						//if it is a load instruction
 						if (LoadInst* loadInst = dyn_cast<LoadInst>(i)){
-							//Clear information about current instruction if something broke
-							if (curInstComboID.size()>1){
-								curInstComboID.clear();
-								curInstCombo.clear();
-							}
-
 							int instID;
 
 							//Get information about components
@@ -927,14 +668,11 @@ namespace {
 							std::set<defInstruct*> phiSet;
 							defInstruct* firstReaching;
 
-							for (int j = 0; j< numDef;j++){
-
-								//Find all reaching for same var
-								int reachDefIndex = instructionIndex[loadInst];
-								if (reachDef[reachDefIndex*numDef + j]>0 && allocValue->getName()==instructionDefIndex[j]->def){
-									phiSet.insert(instructionDefIndex[j]);
-									firstReaching = instructionDefIndex[j];
-								}
+							//Find all reaching for same var
+							ReachingDefs::Defs reaching = reachingDefs.reachingOf(allocValue, loadInst);
+							for (ReachingDefs::Defs::iterator j = reaching.begin(); j != reaching.end(); ++j){
+								phiSet.insert(instructionDefIndex[*j]);
+								firstReaching = instructionDefIndex[*j];
 							}
 							//Check if there are multiple reaching and thus phi needed
 							if (phiSet.size()>1){		//needed
@@ -945,13 +683,27 @@ namespace {
 								}else{	//int
 									instID = phiTable[phiSet];
 								}
+
+								//A phi of defs that all store the same value has that value
+								int sameID = 0;
+								for (std::set<defInstruct*>::iterator j = phiSet.begin(); j != phiSet.end(); ++j){
+									std::map<Value*, int>::iterator stored = valueID.find(instructionReverseIndex[(*j)->instructNum]);
+									int storedID = (stored == valueID.end() || stored->second == 0) ? 0 : classes.find(stored->second);
+									if (storedID == 0 || (sameID != 0 && storedID != sameID)){
+										sameID = 0;
+										break;
+									}
+									sameID = storedID;
+								}
+								if (sameID != 0){
+									classes.unite(sameID, instID);
+								}
 							}else{		//not needed
 								instID = valueID[instructionReverseIndex[firstReaching->instructNum]];
 							}		
 
-							//Insert info about ongoing instruction
-							curInstComboID.insert(curInstComboID.end(), instID);
-							curInstCombo.insert(curInstCombo.end(), &*i);
+							//The load has the value of the store reaching it
+							valueID[loadInst] = instID;
 						}
 
 						//Compare instruction
@@ -961,221 +713,124 @@ namespace {
 								continue;
 							}	
 							icmpExamined.insert(compareInst);	
-				
-							int valChecked = 0; 
-							
-							if (isa<Constant>(compareInst->getOperand(0))){
-								valChecked = valueID[compareInst->getOperand(0)];	//get the value being checked
-							}else{
-								//Check if phi instruction needed
-								std::set<defInstruct*> phiSet;
-								defInstruct* firstReaching;
-								for (int j = 0; j< numDef;j++){
-									LoadInst* loadInst = dyn_cast<LoadInst>(compareInst->getOperand(0));
-									//Find all reaching for same var
-									int reachDefIndex = instructionIndex[compareInst];
-									if (reachDef[reachDefIndex*numDef + j]>0 && loadInst->getOperand(0)->getName()==instructionDefIndex[j]->def){
-										phiSet.insert(instructionDefIndex[j]);
-										firstReaching = instructionDefIndex[j];
 
-									}
-								}
-								//Check if there are multiple reaching and thus phi needed
-								if (phiSet.size()>1){		//needed
-									//check if arleady exists
-									if (phiTable[phiSet]==0){	//not in
-										phiTable[phiSet] = phiID;
-										valChecked = phiID--;
-									}else{	//int
-										valChecked = phiTable[phiSet];
-									}
-								}else{		//not needed
-									valChecked = valueID[instructionReverseIndex[firstReaching->instructNum]];
+							//Use the value standing for the class of each operand, if it can be had here
+							Value* canonical[2];
+							int changedFlag = 0;
+							for (int k = 0; k < 2; k++){
+								Value* operand = compareInst->getOperand(k);
+								canonical[k] = operand;
+								if (isa<Constant>(operand)){
+									continue;
 								}
-							}
 
-							int bound = 0; 
-							if (isa<Constant>(compareInst->getOperand(1))){
-								bound = valueID[compareInst->getOperand(1)];		//get the bound compared
-							}else{
-								//Check if phi instruction needed
-								std::set<defInstruct*> phiSet;
-								defInstruct* firstReaching;
-								for (int j = 0; j< numDef;j++){
-									LoadInst* loadInst = dyn_cast<LoadInst>(compareInst->getOperand(1));
-									//Find all reaching for same var
-									int reachDefIndex = instructionIndex[compareInst];
-									if (reachDef[reachDefIndex*numDef + j]>0 && loadInst->getOperand(0)->getName()==instructionDefIndex[j]->def){
-										phiSet.insert(instructionDefIndex[j]);
-										firstReaching = instructionDefIndex[j];
-									}
-								}
-								//Check if there are multiple reaching and thus phi needed
-								if (phiSet.size()>1){		//needed
-									//check if arleady exists
-									if (phiTable[phiSet]==0){	//not in
-										phiTable[phiSet] = phiID;
-										bound = phiID--;
-									}else{	//int
-										bound = phiTable[phiSet];
-									}
-								}else{		//not needed
-									bound = valueID[instructionReverseIndex[firstReaching->instructNum]];
+								//Checks compare an extension of the index, look for the value it extends and extend what
+								//stands for it the same way
+								CastInst* extension = dyn_cast<CastInst>(operand);
+								if (extension != NULL){
+									operand = extension->getOperand(0);
 								}
-							}
-
-							llvm::CmpInst::Predicate comparison = compareInst->getSignedPredicate();// equality
-
-							//Try combo of values to see if a particular variation reaches
-							//if (bound > 0 && valChecked > 0)
-errs()<<"asd\n";
-							int nextBlockFlag = 0;
-							ICmpInst* newCheck;
-							for (std::vector<Value*>::iterator itr = reverseValueID[valChecked].begin(); itr != reverseValueID[valChecked].end() && nextBlockFlag==0; ++itr){
-
-								StoreInst* firstStore = dyn_cast<StoreInst>(*itr);
-								//Find all reaching for same var
-								int reachDefIndex = instructionDefInstrIndex[firstStore];
-								int instrIndex = instructionIndex[compareInst];
-								if (reachDef[instrIndex*numDef + reachDefIndex]==0){
+								Value* representative = classes.getRepresentative(getValueID(operand, valueID, ID));
+								if (representative == NULL){
 									continue;
 								}
 
-								for (std::vector<Value*>::iterator it = reverseValueID[bound].begin(); it != reverseValueID[bound].end() && nextBlockFlag==0; ++it){
-
-									StoreInst* secondStore = dyn_cast<StoreInst>(*it);
-									//Find all reaching for same var
-									int reachDefIndex = instructionDefInstrIndex[secondStore];
-									int instrIndex = instructionIndex[compareInst];
-errs()<<reachDef[instrIndex*numDef + reachDefIndex]<<"\n";
-									if (reachDef[instrIndex*numDef + reachDefIndex]==0){
-										continue;
+								//A constant of the class is used as it is
+								if (isa<Constant>(representative)){
+									if (representative->getType() == operand->getType()){
+										canonical[k] = extend(representative, extension, compareInst);
+										changedFlag = 1;
 									}
-									
-									//if we are using exact same operands, dont do it
-									if (*itr==compareInst->getOperand(0) && *it==compareInst->getOperand(1)){
-										continue;
-									}
-
-									StoreInst* storeITR = dyn_cast<StoreInst>(*itr);
-									StoreInst* storeIT = dyn_cast<StoreInst>(*it);
-
-									LoadInst *loadITR = new LoadInst(storeITR->getOperand(1), "ITR", compareInst);
-									LoadInst *loadIT = new LoadInst(storeIT->getOperand(1), "IT", compareInst);
-									ICmpInst* testCheck =  new ICmpInst(compareInst, comparison,loadITR, loadIT, Twine("Test"));
-									icmpExamined.insert(testCheck);	
-									newCheck = testCheck;
-
-									nextBlockFlag = 1;
-
-									if (1){
-										//if there is a match, remove compare instruction and branch
-										//testCheck->eraseFromParent();	//Erase instruction
-										//compareInst->eraseFromParent();	//Erase instruction
-										//loadITR->eraseFromParent();
-										//loadIT->eraseFromParent();
-
-										//Go to next instruction and check if 
-										/*if (BranchInst* branchAfterCheck = dyn_cast<BranchInst>(i)){
-											if (branchAfterCheck->getNumSuccessors()==2){
-
-												BasicBlock *nextBlock = branchAfterCheck->getSuccessor(0);
-												BasicBlock *errorBlock = branchAfterCheck->getSuccessor(1);
-
-												int deleteBlock = 0;
-												if (errorBlock->getSinglePredecessor()){
-													deleteBlock = 1;		
-												}
-
-												BranchInst::Create(nextBlock, branchAfterCheck->getParent());
-												branchAfterCheck->eraseFromParent(); //Remove the
-
-												//if exit block only has 1 predecessor
-												if (deleteBlock){
-													errorBlock->eraseFromParent();
-												}
-
-												//Add to block to examine and go to next block
-												nextBlocks.push(nextBlock);
-												break;
-											}
-
-										}*/
+									continue;
+								}
 
-									}else{
-										//if there is no match, just erase the new instruction
-										testCheck->eraseFromParent();
-										loadITR->eraseFromParent();
-										loadIT->eraseFromParent();
-									}
+								//Otherwise the variable the store standing for the class wrote, if that is the only def of it reaching here
+								StoreInst* representativeStore = cast<StoreInst>(representative);
+								Value* allocValue = representativeStore->getPointerOperand();
+								LoadInst* loadInst = dyn_cast<LoadInst>(operand);
+								if (representativeStore->getValueOperand()->getType() != operand->getType() || (loadInst && loadInst->getPointerOperand() == allocValue)){
+									continue;
+								}
+								std::map<Instruction*, int>::iterator def = instructionDefInstrIndex.find(representativeStore);
+								ReachingDefs::Defs reaching = reachingDefs.reachingOf(allocValue, compareInst);
+								if (def != instructionDefInstrIndex.end() && reaching.count() == 1 && reaching.test(def->second)){
+									canonical[k] = extend(new LoadInst(allocValue, "Canonical", compareInst), extension, compareInst);
+									changedFlag = 1;
 								}
 							}
 
-							if (nextBlockFlag == 1){
+							//Rewrite the check once, keeping its name so it is still known as a check
+							if (changedFlag){
+								ICmpInst* newCheck = new ICmpInst(compareInst, compareInst->getPredicate(), canonical[0], canonical[1]);
+								newCheck->takeName(compareInst);
+								icmpExamined.insert(newCheck);
 								compareInst->replaceAllUsesWith(newCheck);
-								i++;
-								compareInst->eraseFromParent();
-								while (!i->isTerminator()){
-									i++;
-								}
-
+								i = newCheck;
+								RecursivelyDeleteTriviallyDeadInstructions(compareInst);
+								reachingDefs.clearWalk();
 							}
 						}
 
 						if (i->isBinaryOp()){		//binary operation - add, sub, etc.
-
-							//Check if an operand is a constant
-							for (int j = 0; j<i->getNumOperands(); j++){
-								//If value used is a constant
-								if (isa<Constant>(i->getOperand(j))){
-									//Insert into ValueID table
-									if (valueID[i->getOperand(j)]!=0){	//not in table
-										curID = valueID[i->getOperand(j)];
-									}else{					//in table
-										curID = ID++;	//Increment ID
-									}
-
-									//List as a current instruction
-									curInstComboID.insert(curInstComboID.end(), curID);
-
-									//Update ValueID Table
-									valueID[i->getOperand(j)] = curID;
-								}
+							//Same operation on the same values, same id
+							ScopedValueTable::Entry &expression = expressions.get(i->getOpcode(), getValueID(i->getOperand(0), valueID, ID), getValueID(i->getOperand(1), valueID, ID));
+							if (expression.id == 0){
+								expression.id = ID++;	//Increment ID
 							}
-
-
-							//Get Operand
-							int instOp = i->getOpcode();
-
-							//Insert info about ongoing instruction
-							curInstComboID.insert(curInstComboID.end(), i->getOpcode());
-							curInstCombo.insert(curInstCombo.end(), &*i);
-						}
-
-						//if operation
-						if (TerminatorInst* termInst = dyn_cast<TerminatorInst>(i)){
-							int numSucc = termInst->getNumSuccessors();
-							for(int i = 0; i < numSucc; i++){
-								nextBlocks.push(termInst->getSuccessor(i));
+							valueID[i] = expression.id;
+						}else if (CastInst* castInst = dyn_cast<CastInst>(i)){
+							//The same cast of the same value to the same type, same id. The type is told apart by the
+							//id of its null value
+							ScopedValueTable::Entry &expression = expressions.get(castInst->getOpcode(), getValueID(castInst->getOperand(0), valueID, ID), getValueID(Constant::getNullValue(castInst->getType()), valueID, ID));
+							if (expression.id == 0){
+								expression.id = ID++;
 							}
+							valueID[castInst] = expression.id;
 						}
 
 					}
 				}
 
-
+				//Go to the next block in the dominator tree, leaving the blocks whose subtree is done
+				nextNode = NULL;
+				while (nextNode == NULL && !dominatorPath.empty()){
+					DomTreeNodeBase<BasicBlock>* node = dominatorPath.back().first;
+					if (dominatorPath.back().second < node->getNumChildren()){
+						nextNode = node->getChildren()[dominatorPath.back().second++];
+					}else{
+						expressions.closeScope();
+						dominatorPath.pop_back();
+					}
+				}
 			}
+			delete dominatorTree;
 
 		}
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////MERGE UNCHANGED COPIES//////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+			//A copy nothing was removed from is the same as its original, so send its predecessors back. Latest first,
+			//since a later copy may have been made from an earlier one
+			int numMerged = 0;
+			for (int i = copiedRegions.size() - 1; i >= 0; i--){
+				std::map<Value*, Value*> toOriginal;
+				if (copiedRegions[i]->isUnchanged(toOriginal)){
+					for (int j = 0; j < copiedRegions[i]->clones.size(); j++){
+						grown -= copiedRegions[i]->clones[j]->size();
+					}
+					copiedRegions[i]->mergeBack(toOriginal);
+					numMerged++;
+				}
+				delete copiedRegions[i];
+			}
+			errs()<<F.getName()<<": "<<numMerged<<" region copies merged back, "<<grown<<" instructions added\n";
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 			//Print Hash Table
 /*			errs()<<"Hash Table\n";
-			for (std::map<std::vector<int>, int>::iterator itr = hashTable.begin(); itr != hashTable.end(); ++itr){
-			   	errs() << "id:" << itr->second<<" set:";
-				for (std::vector<int>::const_iterator it=(itr->first).begin(); it!=(itr->first).end(); ++it){
-				   	errs() << *it<<"-";
+			for (int j = 0; j < expressions.slots.size(); j++){
+				if (expressions.slots[j].used){
+				   	errs() << "id:" << expressions.slots[j].id<<" set:"<<expressions.slots[j].first<<"-"<<expressions.slots[j].second<<"-"<<expressions.slots[j].opcode<<"\n";
 				}
-				errs()<<"\n";
 			}
 
 			//Print Value Table
@@ -1204,7 +859,7 @@ errs()<<reachDef[instrIndex*numDef + reachDefIndex]<<"\n";
 
 		virtual void getAnalysisUsage(AnalysisUsage &AU) const {
 		  	AU.addRequired<LoopInfo>();		//add request
-      			AU.addRequired<PostDominatorTree>();	//init request
+		  	AU.addRequired<BlockFrequencyInfo>();
 	
 		}
 
@@ -9,8 +9,11 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/DebugInfo.h"
 #include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Local.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/IR/Dominators.h"
+#include "../../Common/ScopedValueTable.h"
+#include "../../Common/ValueClasses.h"
 #include <map>
 #include <set>
 #include <queue>
@@ -38,6 +41,76 @@ namespace {
 		static char ID; 
 		p11() : FunctionPass(ID) {}
 
+		//Value id of an operand, constants get one the first time they are seen
+		int getValueID(Value* value, std::map<Value*, int> &valueID, int &ID){
+			int &id = valueID[value];
+			if (id == 0){
+				id = ID++;
+			}
+			return id;
+		}
+
+		//An expression whose operands are only loaded or constant for it, and whose value is only stored
+		bool isRemovable(BinaryOperator* expressionInst){
+			if (!expressionInst->hasOneUse()){
+				return false;
+			}
+			for (int j = 0; j < expressionInst->getNumOperands(); j++){
+				Value* operand = expressionInst->getOperand(j);
+				if (!isa<Constant>(operand) && !(isa<LoadInst>(operand) && operand->hasOneUse())){
+					return false;
+				}
+			}
+			return true;
+		}
+
+		//The value cast the way extension casts its operand, the value itself if there is no extension
+		Value* extend(Value* value, CastInst* extension, Instruction* insertBefore){
+			if (extension == NULL){
+				return value;
+			}
+			if (Constant* constant = dyn_cast<Constant>(value)){
+				return ConstantExpr::getCast(extension->getOpcode(), constant, extension->getType());
+			}
+			return CastInst::Create(extension->getOpcode(), value, extension->getType(), "Canonical", insertBefore);
+		}
+
+		//Erase a store of an expression, the expression and the loads feeding it
+		void removeExpression(StoreInst* storeInst, BinaryOperator* expressionInst){
+			Value* first = expressionInst->getOperand(0);
+			Value* second = expressionInst->getOperand(1);
+			storeInst->eraseFromParent();
+			expressionInst->eraseFromParent();
+			if (LoadInst* load = dyn_cast<LoadInst>(first)){
+				load->eraseFromParent();
+			}
+			if (second != first){
+				if (LoadInst* load = dyn_cast<LoadInst>(second)){
+					load->eraseFromParent();
+				}
+			}
+		}
+
+		//Whether store is the only def of the variable it writes that reaches instruction
+		bool isOnlyReaching(StoreInst* store, Instruction* instruction, int* reachDef, int numDef, std::map<Instruction*, int> &instructionIndex, std::map<int, defInstruct*> &instructionDefIndex){
+			std::map<Instruction*, int>::iterator storeIndex = instructionIndex.find(store);
+			std::map<Instruction*, int>::iterator reachDefIndex = instructionIndex.find(instruction);
+			if (storeIndex == instructionIndex.end() || reachDefIndex == instructionIndex.end()){
+				return false;
+			}
+			int numReaching = 0;
+			int reachingFlag = 0;
+			for (int j = 0; j < numDef; j++){
+				if (reachDef[reachDefIndex->second*numDef + j] > 0 && store->getPointerOperand()->getName()==instructionDefIndex[j]->def){
+					numReaching++;
+					if (instructionDefIndex[j]->instructNum == storeIndex->second){
+						reachingFlag = 1;
+					}
+				}
+			}
+			return numReaching == 1 && reachingFlag;
+		}
+
 		//Run for each function
 		virtual bool runOnFunction(Function &F){
 
@@ -182,14 +255,14 @@ namespace {
 				}
 			}
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-			std::map<std::vector<int>, int> hashTable;		//hold relation between expression and id
-			std::map<int, std::vector<int> > reverseHashTable;		//hold relation between expression and id
-			std::map<std::vector<int>, BasicBlock*> hashTableBlock;		//hold relation between expression and id
+			ScopedValueTable expressions;		//expressions of values and the stores holding them
+			expressions.init(numInst);
 
 			std::map<std::set<defInstruct*>, int> phiTable;		//hold relation between phi expression and phi id
 
 			std::map<Value*, int> valueID;		//memory location and id
 			std::map<int, std::vector<Value*> > reverseValueID;		//id to memory locations
+			ValueClasses classes;		//ids known to be the same value
 
 
 			//Get Dominator info
@@ -197,28 +270,22 @@ namespace {
 			dominatorTree = new DominatorTreeBase<BasicBlock>(false);
 			dominatorTree->recalculate(F);
 
-			//Queue of blocks
-			set<BasicBlock*> visited;
-			queue<BasicBlock*> nextBlocks;
-			nextBlocks.push(&F.getEntryBlock());
+			//Path from the root of the dominator tree to the block being visited, with the next child to go to
+			std::vector<std::pair<DomTreeNodeBase<BasicBlock>*, unsigned> > dominatorPath;
+			DomTreeNodeBase<BasicBlock>* nextNode = dominatorTree->getRootNode();
 
 			int ID = 1;
 			int phiID = -1;
 
-			//Visit until nore more blocks left
-			while(!nextBlocks.empty()){
+			//Visit the dominator tree depth first, so a block sees the expressions of the blocks dominating it
+			while(nextNode != NULL){
 
 				//Get next block
-				BasicBlock* block = nextBlocks.front();
-				nextBlocks.pop();
-
-				//If already have gone to this block, skip it
-				if(visited.find(block) != visited.end()) continue;
-				visited.insert(block);
+				BasicBlock* block = nextNode->getBlock();
+				dominatorPath.push_back(std::make_pair(nextNode, 0u));
+				expressions.openScope();
 
 				int curID;
-				std::vector<int> curInstComboID;
-				std::vector<Instruction*> curInstCombo;
 
 				//Visit the instructions
 				for(BasicBlock::iterator i = block->begin(), ei = block->end(); i != ei; ++i){
@@ -226,100 +293,41 @@ namespace {
 					if ((&*i)!=NULL){
 						if (StoreInst* storeInst = dyn_cast<StoreInst>(i)){
 							if(storeInst->getPointerOperand()->getName()!=""){
-								//If value store is a constant
-								if (isa<Constant>(storeInst->getValueOperand())){
-
-									//Insert into ValueID table
-									if (valueID[storeInst->getValueOperand()]!=0){		//already in value table
-										curID = valueID[storeInst->getValueOperand()];
-									}else{							//not in table
-										curID = ID++;	//increment ID
+								//The value stored has the id of what computed it
+								curID = getValueID(storeInst->getValueOperand(), valueID, ID);
+
+								//An expression already held by a store dominating this one is loaded from it instead, while
+								//that store is the only def of its variable reaching here
+								BinaryOperator* expressionInst = dyn_cast<BinaryOperator>(storeInst->getValueOperand());
+								if (expressionInst){
+									ScopedValueTable::Entry &expression = expressions.get(expressionInst->getOpcode(), getValueID(expressionInst->getOperand(0), valueID, ID), getValueID(expressionInst->getOperand(1), valueID, ID));
+									if (expression.available == NULL){
+										expressions.setAvailable(expression, storeInst);
+									}else if (isRemovable(expressionInst) && isOnlyReaching(expression.available, expressionInst, reachDef, numDef, instructionIndex, instructionDefIndex)){
+										//Create new instructions as replacements
+										LoadInst *replacementLoad = new LoadInst(expression.available->getPointerOperand(), "GVN", storeInst);
+										replacementLoad->setAlignment(4);
+										StoreInst *replacementStore = new StoreInst(replacementLoad, storeInst->getPointerOperand(), storeInst);
+										replacementStore->setAlignment(4);
+
+										//Remove old instructions
+										removeExpression(storeInst, expressionInst);
+
+										//change pointers for ease of use
+										storeInst = replacementStore;
+										i = replacementStore;
 									}
-
-									//List as a current instruction
-									curInstComboID.clear();
-									curInstCombo.clear();
-									curInstComboID.insert(curInstComboID.end(), curID);
-
-									//Update ValueID Table
-									valueID[storeInst->getValueOperand()] = curID;
-								}
-
-								int deleteFlag = 0;	//flag to hold info about deletions
-								int sizeFlag = 0;	//flag to hold info about size
-
-								//Reorganize elements to ensure that similar expression get same value #
-								if (curInstComboID.size()==3){
-
-									sizeFlag = 1;
-									//Smaller number first
-									if (curInstComboID[0]>curInstComboID[1]){
-										int tempValue = curInstComboID[1];
-										curInstComboID[1] = curInstComboID[0];
-										curInstComboID[0] = tempValue;
-									}
-								}
-
-								//Check Hash table to see if already exists
-								if (hashTable[curInstComboID]!=0){		//already in hash table
-									curID = hashTable[curInstComboID];
-									deleteFlag = 1;
-								}else{							//not in table
-									hashTableBlock[curInstComboID] = block;
-									curID = ID++;	//Increment ID
-								}
-
-								//If it is an eqaulity, just give id of the other element
-								if (curInstComboID.size()==1){
-									curID = curInstComboID[0];
-								}
-
-
-								if (deleteFlag && sizeFlag && reverseValueID[curID].size()>0 && dominatorTree->dominates(hashTableBlock[curInstComboID],block)){
-	
-									//Create new instructions as replacements
-									StoreInst* storeInstWithValue = dyn_cast<StoreInst>(reverseValueID[curID][0]);		
-									LoadInst *replacementLoad = new LoadInst(storeInstWithValue->getPointerOperand(), "GVN", storeInst);
-									replacementLoad->setAlignment(4);
-									StoreInst *replacementStore = new StoreInst(replacementLoad, storeInst->getPointerOperand(), storeInst);
-									replacementStore->setAlignment(4);
-									
-									//Remove old instructions
-									i++;
-									storeInst->eraseFromParent();
-
-									if (curInstCombo.size()==3){
-										curInstCombo[2]->eraseFromParent();
-									}
-									curInstCombo[1]->eraseFromParent();	
-									curInstCombo[0]->eraseFromParent();	
-
-									//change pointers for ease of use
-									storeInst = replacementStore;
 								}
 
 								//Insert into ValueID table
 								valueID[storeInst] = curID;
 								//Add to reverse look up table
 								reverseValueID[curID].insert(reverseValueID[curID].end(), storeInst);
-
-								//Insert into hash table
-								hashTable[curInstComboID] = curID;
-								reverseHashTable[curID] = curInstComboID;
-			
-								//Get ready for next instruction
-								curInstCombo.clear();
-								curInstComboID.clear();
+								classes.addStore(curID, storeInst);
 							}
 						}
 						//if it is a load instruction
 						if (LoadInst* loadInst = dyn_cast<LoadInst>(i)){
-							//Clear information about current instruction if something broke
-							if (curInstComboID.size()>1){
-								curInstComboID.clear();
-								curInstCombo.clear();
-							}
-
 							int instID;
 
 							//Get information about components
@@ -345,189 +353,138 @@ namespace {
 								}else{	//int
 									instID = phiTable[phiSet];
 								}
+
+								//A phi of defs that all store the same value has that value
+								int sameID = 0;
+								for (std::set<defInstruct*>::iterator j = phiSet.begin(); j != phiSet.end(); ++j){
+									std::map<Value*, int>::iterator stored = valueID.find(instructionReverseIndex[(*j)->instructNum]);
+									int storedID = (stored == valueID.end() || stored->second == 0) ? 0 : classes.find(stored->second);
+									if (storedID == 0 || (sameID != 0 && storedID != sameID)){
+										sameID = 0;
+										break;
+									}
+									sameID = storedID;
+								}
+								if (sameID != 0){
+									classes.unite(sameID, instID);
+								}
 							}else{		//not needed
 								instID = valueID[instructionReverseIndex[firstReaching->instructNum]];
 							}		
 
-							//Insert info about ongoing instruction
-							curInstComboID.insert(curInstComboID.end(), instID);
-							curInstCombo.insert(curInstCombo.end(), &*i);
-						}
-						//if operation
-						if (TerminatorInst* termInst = dyn_cast<TerminatorInst>(i)){
-							int numSucc = termInst->getNumSuccessors();
-							for(int i = 0; i < numSucc; i++){
-								nextBlocks.push(termInst->getSuccessor(i));
-							}
+							//The load has the value of the store reaching it
+							valueID[loadInst] = instID;
 						}
 						//Compare instruction
 						if (ICmpInst* compareInst = dyn_cast<ICmpInst>(i)){
-							int valChecked = 0; 
-							
-							if (isa<Constant>(compareInst->getOperand(0))){
-								valChecked = valueID[compareInst->getOperand(0)];	//get the value being checked
-							}else{
-								//Check if phi instruction needed
-								std::set<defInstruct*> phiSet;
-								defInstruct* firstReaching;
-								for (int j = 0; j< numDef;j++){
-									LoadInst* loadInst = dyn_cast<LoadInst>(compareInst->getOperand(0));
-									//Find all reaching for same var
-									int reachDefIndex = instructionIndex[compareInst];
-									if (reachDef[reachDefIndex*numDef + j]==1 && loadInst->getOperand(0)->getName()==instructionDefIndex[j]->def){
-										phiSet.insert(instructionDefIndex[j]);
-										firstReaching = instructionDefIndex[j];
+							//Use the value standing for the class of each operand, if it can be had here
+							Value* canonical[2];
+							int changedFlag = 0;
+							for (int k = 0; k < 2; k++){
+								Value* operand = compareInst->getOperand(k);
+								canonical[k] = operand;
+								if (isa<Constant>(operand)){
+									continue;
+								}
 
-									}
+								//Checks compare an extension of the index, look for the value it extends and extend what
+								//stands for it the same way
+								CastInst* extension = dyn_cast<CastInst>(operand);
+								if (extension != NULL){
+									operand = extension->getOperand(0);
 								}
-								//Check if there are multiple reaching and thus phi needed
-								if (phiSet.size()>1){		//needed
-									//check if arleady exists
-									if (phiTable[phiSet]==0){	//not in
-										phiTable[phiSet] = phiID;
-										valChecked = phiID--;
-									}else{	//int
-										valChecked = phiTable[phiSet];
-									}
-								}else{		//not needed
-//errs()<<firstReaching->instructNum<<"\n";
-									valChecked = valueID[instructionReverseIndex[firstReaching->instructNum]];
+								Value* representative = classes.getRepresentative(getValueID(operand, valueID, ID));
+								if (representative == NULL){
+									continue;
 								}
-							}
 
-							int bound = 0; 
-							if (isa<Constant>(compareInst->getOperand(1))){
-								bound = valueID[compareInst->getOperand(1)];		//get the bound compared
-							}else{
-								//Check if phi instruction needed
-								std::set<defInstruct*> phiSet;
-								defInstruct* firstReaching;
-								for (int j = 0; j< numDef;j++){
-									LoadInst* loadInst = dyn_cast<LoadInst>(compareInst->getOperand(1));
-									//Find all reaching for same var
-									int reachDefIndex = instructionIndex[compareInst];
-									if (reachDef[reachDefIndex*numDef + j]==1 && loadInst->getOperand(0)->getName()==instructionDefIndex[j]->def){
-										phiSet.insert(instructionDefIndex[j]);
-										firstReaching = instructionDefIndex[j];
+								//A constant of the class is used as it is
+								if (isa<Constant>(representative)){
+									if (representative->getType() == operand->getType()){
+										canonical[k] = extend(representative, extension, compareInst);
+										changedFlag = 1;
 									}
+									continue;
 								}
-								//Check if there are multiple reaching and thus phi needed
-								if (phiSet.size()>1){		//needed
-									//check if arleady exists
-									if (phiTable[phiSet]==0){	//not in
-										phiTable[phiSet] = phiID;
-										bound = phiID--;
-									}else{	//int
-										bound = phiTable[phiSet];
-									}
-								}else{		//not needed
-									bound = valueID[instructionReverseIndex[firstReaching->instructNum]];
-								}
-							}
-
-							llvm::CmpInst::Predicate comparison = compareInst->getSignedPredicate();// equality
-
-							//Try combo of values to see if a particular variation reaches
-							//if (bound > 0 && valChecked > 0)
-							for (std::vector<Value*>::iterator itr = reverseValueID[valChecked].begin(); itr != reverseValueID[valChecked].end(); ++itr){
-								for (std::vector<Value*>::iterator it = reverseValueID[bound].begin(); it != reverseValueID[bound].end(); ++it){
-									StoreInst* storeITR = dyn_cast<StoreInst>(*itr);
-									StoreInst* storeIT = dyn_cast<StoreInst>(*it);
-									LoadInst *loadITR = new LoadInst(storeITR->getOperand(1), "ITR", compareInst);
-									LoadInst *loadIT = new LoadInst(storeIT->getOperand(1), "IT", compareInst);
-									ICmpInst* testCheck =  new ICmpInst(compareInst, comparison,loadITR, loadIT, Twine("Test"));
-									if (0){
-										//if there is a match, remove compare instruction and branch
-										testCheck->eraseFromParent();	//Erase instruction
-										compareInst->eraseFromParent();	//Erase instruction
-										loadITR->eraseFromParent();
-										loadIT->eraseFromParent();
-
-										//Go to next instruction and check if 
-										i++;
-										if (BranchInst* branchAfterCheck = dyn_cast<BranchInst>(i)){
-											if (branchAfterCheck->getNumSuccessors()==2){
-
-												BasicBlock *nextBlock = branchAfterCheck->getSuccessor(0);
-												BasicBlock *errorBlock = branchAfterCheck->getSuccessor(1);
-
-												int deleteBlock = 0;
-												if (errorBlock->getSinglePredecessor()){
-													deleteBlock = 1;		
-												}
-
-												BranchInst::Create(nextBlock, branchAfterCheck->getParent());
-												branchAfterCheck->eraseFromParent(); //Remove the
-
-												//if exit block only has 1 predecessor
-												if (deleteBlock){
-													errorBlock->eraseFromParent();
-												}
-
-												//Add to block to examine and go to next block
-												nextBlocks.push(nextBlock);
-												break;
-											}
 
+								//Otherwise the variable the store standing for the class wrote, if that is the only def of it reaching here
+								StoreInst* representativeStore = cast<StoreInst>(representative);
+								Value* allocValue = representativeStore->getPointerOperand();
+								LoadInst* loadInst = dyn_cast<LoadInst>(operand);
+								if (representativeStore->getValueOperand()->getType() != operand->getType() || (loadInst && loadInst->getPointerOperand() == allocValue)){
+									continue;
+								}
+								std::map<Instruction*, int>::iterator storeIndex = instructionIndex.find(representativeStore);
+								int reachDefIndex = instructionIndex[compareInst];
+								int numReaching = 0;
+								int reachingFlag = 0;
+								for (int j = 0; j < numDef; j++){
+									if (reachDef[reachDefIndex*numDef + j]==1 && allocValue->getName()==instructionDefIndex[j]->def){
+										numReaching++;
+										if (storeIndex != instructionIndex.end() && instructionDefIndex[j]->instructNum == storeIndex->second){
+											reachingFlag = 1;
 										}
-
-									}else{
-										//if there is no match, just erase the new instruction
-										testCheck->eraseFromParent();
-										loadITR->eraseFromParent();
-										loadIT->eraseFromParent();
 									}
 								}
+								if (numReaching == 1 && reachingFlag){
+									canonical[k] = extend(new LoadInst(allocValue, "Canonical", compareInst), extension, compareInst);
+									changedFlag = 1;
+								}
+							}
+
+							//Rewrite the check once, keeping its name so it is still known as a check
+							if (changedFlag){
+								ICmpInst* newCheck = new ICmpInst(compareInst, compareInst->getPredicate(), canonical[0], canonical[1]);
+								newCheck->takeName(compareInst);
+								compareInst->replaceAllUsesWith(newCheck);
+								i = newCheck;
+								RecursivelyDeleteTriviallyDeadInstructions(compareInst);
 							}
 						}
 
 						if (i->isBinaryOp()){		//binary operation - add, sub, etc.
-
-							//Check if an operand is a constant
-							for (int j = 0; j<i->getNumOperands(); j++){
-								//If value used is a constant
-								if (isa<Constant>(i->getOperand(j))){
-									//Insert into ValueID table
-									if (valueID[i->getOperand(j)]!=0){	//not in table
-										curID = valueID[i->getOperand(j)];
-									}else{					//in table
-										curID = ID++;	//Increment ID
-									}
-
-									//List as a current instruction
-									curInstComboID.insert(curInstComboID.end(), curID);
-
-									//Update ValueID Table
-									valueID[i->getOperand(j)] = curID;
-								}
+							//Same operation on the same values, same id
+							ScopedValueTable::Entry &expression = expressions.get(i->getOpcode(), getValueID(i->getOperand(0), valueID, ID), getValueID(i->getOperand(1), valueID, ID));
+							if (expression.id == 0){
+								expression.id = ID++;	//Increment ID
 							}
-
-
-							//Get Operand
-							int instOp = i->getOpcode();
-
-							//Insert info about ongoing instruction
-							curInstComboID.insert(curInstComboID.end(), i->getOpcode());
-							curInstCombo.insert(curInstCombo.end(), &*i);
+							valueID[i] = expression.id;
+						}else if (CastInst* castInst = dyn_cast<CastInst>(i)){
+							//The same cast of the same value to the same type, same id. The type is told apart by the
+							//id of its null value
+							ScopedValueTable::Entry &expression = expressions.get(castInst->getOpcode(), getValueID(castInst->getOperand(0), valueID, ID), getValueID(Constant::getNullValue(castInst->getType()), valueID, ID));
+							if (expression.id == 0){
+								expression.id = ID++;
+							}
+							valueID[castInst] = expression.id;
 						}
 
 					}
 				}
 
-
+				//Go to the next block in the dominator tree, leaving the blocks whose subtree is done
+				nextNode = NULL;
+				while (nextNode == NULL && !dominatorPath.empty()){
+					DomTreeNodeBase<BasicBlock>* node = dominatorPath.back().first;
+					if (dominatorPath.back().second < node->getNumChildren()){
+						nextNode = node->getChildren()[dominatorPath.back().second++];
+					}else{
+						expressions.closeScope();
+						dominatorPath.pop_back();
+					}
+				}
 			}
+			delete dominatorTree;
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////DEBUG////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 /*
 			//Print Hash Table
 			errs()<<"Hash Table\n";
-			for (std::map<std::vector<int>, int>::iterator itr = hashTable.begin(); itr != hashTable.end(); ++itr){
-			   	errs() << "id:" << itr->second<<" set:";
-				for (std::vector<int>::const_iterator it=(itr->first).begin(); it!=(itr->first).end(); ++it){
-				   	errs() << *it<<"-";
+			for (int j = 0; j < expressions.slots.size(); j++){
+				if (expressions.slots[j].used){
+				   	errs() << "id:" << expressions.slots[j].id<<" set:"<<expressions.slots[j].first<<"-"<<expressions.slots[j].second<<"-"<<expressions.slots[j].opcode<<"\n";
 				}
-				errs()<<"\n";
 			}
 
 			//Print Value Table
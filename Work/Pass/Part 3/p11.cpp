@@ -1,5 +1,12 @@
 #define DEBUG_TYPE "p11"
+#define cloneCost 4		//Instructions a region copy may duplicate for each check or merged load it can save per call
+#define functionGrowth 100	//Percent a function may grow by copying regions
+#define moduleGrowth 30		//Percent the module may grow by copying regions
+#ifndef pathQualified
+#define pathQualified false	//Copy a region only for the predecessors along which it removes a check
+#endif
 #include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
 #include "llvm/Support/InstIterator.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/DerivedTypes.h"
@@ -10,9 +17,20 @@
 #include "llvm/DebugInfo.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Support/CFG.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "../Common/LoopChecks.h"
+#include "../Common/ReachingDefs.h"
+#include "../Common/Reachability.h"
+#include "../Common/ClonedRegion.h"
+#include "../Common/PathQualified.h"
 #include <map>
 #include <set>
 #include <queue>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
 
 using namespace llvm;
 using std::set;
@@ -34,550 +52,693 @@ namespace {
 		}
 	} defInstruct;
 
-	typedef struct _instTranslation{
-		Instruction* oldInst;
-		Instruction* newInst;
-					
-		//Constructor
-		 _instTranslation(Instruction* oldInstIn, Instruction* newInstIn){
-			oldInst = oldInstIn;
-			newInst = newInstIn;
-		}
-	}instTranslation;
-
 	struct p11 : public FunctionPass {
 		// Pass identification, replacement for typeid
 		static char ID; 
 		p11() : FunctionPass(ID) {}
 
-		//Run for each function
-		virtual bool runOnFunction(Function &F){
-			
-			//Information about structure of program
-			std::map<BasicBlock*, int> basicBlockIndex;
-			std::map<int, BasicBlock*> basicBlockReverseIndex;
-			std::map<Instruction*, int> instructionIndex;
-			std::map<int, defInstruct*> instructionDefIndex;
+		//Invariance and induction variables of loops
+		LoopChecks loopChecks;
 
-			int *dist = NULL;						//Hold distance between any two blocks
-			int* reachDef = NULL;						//Hold reaching def for each instruction
-			std::map<BasicBlock*, std::set<int> > killedDef;	//Hold killed def for each block	
-			std::map<BasicBlock*, std::set<int> > usedDef;		//Hold used def for each bock
-			std::map<BasicBlock*, std::set<BasicBlock*> > influencedNode;		//Hold used dbock
-			std::map<BasicBlock*, std::set<BasicBlock*> > ROI;		//Hold used def for each bock
-			std::map<std::vector<BasicBlock*>, std::vector<BasicBlock*> > cloned;		//hold relation between original and clone
-			std::map<std::vector<BasicBlock*>, BasicBlock* > headCloned;		//hold relation between original and clone
-			std::map<std::vector<BasicBlock*>, std::vector<instTranslation*> > renameBlock;	//hold relation between ROI and new names
+		//A loop can be copied if one block outside it enters it, it has no PHIs at its header or exits, and nothing it
+		//computes is used after it
+		bool canCloneLoop(Loop* loop, BasicBlock* entering){
+			if (entering == NULL || isa<PHINode>(loop->getHeader()->begin())){
+				return false;
+			}
 
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-///////////////////////////////////////////INITIALIZE////////////////////////////////////////////////////////////////////////////////////////
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-			int cloningFlag = 1;		
-			
-		while (cloningFlag == 1){
+			//Values made in the loop must not be used after it, otherwise both copies would have to be merged
+			for (Loop::block_iterator j = loop->block_begin(); j != loop->block_end(); ++j){
+				for (BasicBlock::iterator m = (*j)->begin(); m != (*j)->end(); ++m){
+					for (Value::use_iterator u = m->use_begin(); u != m->use_end(); ++u){
+						if (!loop->contains(cast<Instruction>(*u)->getParent())){
+							return false;
+						}
+					}
+				}
+			}
+			SmallVector<BasicBlock*, 4> exits;
+			loop->getExitBlocks(exits);
+			for (int j = 0; j < exits.size(); j++){
+				if (isa<PHINode>(exits[j]->begin())){
+					return false;
+				}
+			}
+			return true;
+		}
 
-			//Reset Flag
-			cloningFlag = 0;
+		//Remove the copies of the given checks from a cloned loop
+		void dropChecks(std::vector<ICmpInst*> &checks, ValueToValueMapTy &translation){
+			for (int j = 0; j < checks.size(); j++){
+				ICmpInst* fastCheck = cast<ICmpInst>(translation[checks[j]]);
+				BranchInst* fastBranch = cast<BranchInst>(*fastCheck->use_begin());
+				BranchInst::Create(fastBranch->getSuccessor(0), fastBranch);
+				fastBranch->eraseFromParent();
+
+				Value* index = fastCheck->getOperand(0);
+				Value* bound = fastCheck->getOperand(1);
+				fastCheck->eraseFromParent();
+				RecursivelyDeleteTriviallyDeadInstructions(index);
+				RecursivelyDeleteTriviallyDeadInstructions(bound);
+			}
+		}
 
-			//Free memory
-			if (dist!=NULL){
-				free(dist);
+		//Clone a loop whose index range is only known at runtime. One test before the loop checks that every
+		//index stays inside its array over the whole range of the induction variable. If it does, a copy of the loop
+		//without those checks runs, otherwise the original checked loop does. Returns the test, which is now the only
+		//block entering the checked loop, or NULL if the loop was left as it was.
+		BasicBlock* versionLoop(Function &F, Loop* loop){
+			if (!canCloneLoop(loop, loop->getLoopPreheader())){
+				return NULL;
+			}
+			BasicBlock* header = loop->getHeader();
+			BasicBlock* preheader = loop->getLoopPreheader();
+
+			Value* induction = NULL;
+			Value* last = NULL;
+			bool hasInduction = loopChecks.findInduction(loop, induction, last, NULL);
+
+			//Find the checks whose range can be tested before the loop
+			std::vector<ICmpInst*> checks;
+			for (Loop::block_iterator j = loop->block_begin(); j != loop->block_end(); ++j){
+				for (BasicBlock::iterator m = (*j)->begin(); m != (*j)->end(); ++m){
+					ICmpInst* cmp = dyn_cast<ICmpInst>(m);
+					BranchInst* branch;
+					if (cmp == NULL || !loopChecks.isBoundCheck(cmp, branch)){
+						continue;
+					}
+					if (!loopChecks.isInvariant(cmp->getOperand(1), loop, NULL)){
+						continue;
+					}
+					if (loopChecks.isInvariant(cmp->getOperand(0), loop, NULL) || (hasInduction && loopChecks.isMonotonic(cmp->getOperand(0), loop, induction))){
+						checks.push_back(cmp);
+					}
+				}
 			}
-			if (reachDef!=NULL){
-				free(reachDef);
+			if (checks.size() == 0){
+				return NULL;
 			}
 
-			//Clear maps
-			killedDef.clear();
-			usedDef.clear();
-			influencedNode.clear();
-			ROI.clear();
-			cloned.clear();
-			headCloned.clear();
-			renameBlock.clear();
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-///////////////////////////////////////////DISTANCE BETWEEN BLOCKS///////////////////////////////////////////////////////////////////////////
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-			int numBlock = 0;	//Number of blocks
+			//Edges leaving the loop stay as they are
+			ClonedRegion fast;
+			fast.clone(header, loop->getBlocks(), "fast");
 
-			//Get list of basic blocks			
-			Function::BasicBlockListType &allblocks = F.getBasicBlockList();
-			//Go through basic blocks
-			for (Function::iterator i = allblocks.begin(); i != allblocks.end(); i++) {
-				basicBlockReverseIndex[numBlock] = i;
-				basicBlockIndex[i] = numBlock++;		//hold information about where the basic block is
+			//Test the whole range before the loop
+			BasicBlock* versionBlock = BasicBlock::Create(header->getContext(), Twine(header->getName() + "version"), &F, header);
+			BranchInst* versionTerm = BranchInst::Create(header, versionBlock);
 
+			Value* first = NULL;
+			if (hasInduction){
+				first = new LoadInst(induction, "first", versionTerm);
+				loopChecks.findInduction(loop, induction, last, versionTerm);
 			}
 
-			//Allocate array
-			dist = (int*) malloc(numBlock*numBlock*sizeof(int*));
-			for (int i = 0; i<numBlock; i++){
-				//Init to infinite
-				for(int j =0; j<numBlock; j++){
-					if (i==j){
-						dist[i*numBlock + j] = 0;
+			Value* allValid = NULL;
+			for (int j = 0; j < checks.size(); j++){
+				ICmpInst* cmp = checks[j];
+				Value* size = loopChecks.copyExpression(cmp->getOperand(1), loop, NULL, NULL, versionTerm);
+
+				std::vector<Value*> indexes;
+				if (loopChecks.isInvariant(cmp->getOperand(0), loop, NULL)){
+					indexes.push_back(loopChecks.copyExpression(cmp->getOperand(0), loop, NULL, NULL, versionTerm));
+				}else{
+					indexes.push_back(loopChecks.copyExpression(cmp->getOperand(0), loop, induction, first, versionTerm));
+					indexes.push_back(loopChecks.copyExpression(cmp->getOperand(0), loop, induction, last, versionTerm));
+				}
+
+				for (int k = 0; k < indexes.size(); k++){
+					Value* valid = new ICmpInst(versionTerm, cmp->getPredicate(), indexes[k], size, Twine("CmpVersion"));
+					if (allValid == NULL){
+						allValid = valid;
 					}else{
-						dist[i*numBlock + j] = 1000000000;
+						allValid = BinaryOperator::CreateAnd(allValid, valid, "CmpVersion", versionTerm);
 					}
 				}
 			}
+			BranchInst::Create(fast.getCloneHead(), header, allValid, versionBlock);
+			versionTerm->eraseFromParent();
 
-			//Fill array will all with distance 1;
-			BasicBlock* successorBlock;	//Next basic block
-			//Block indexes
-			int sourceBlock = 0;
-			int destinationBlock;
-			for (Function::iterator i = allblocks.begin(); i != allblocks.end(); i++) {
-				//For each successor
-				for (int j = 0; j < (i->getTerminator())->getNumSuccessors();j++){
-					successorBlock = (i->getTerminator())->getSuccessor(j);	//Successor
-					destinationBlock = basicBlockIndex[successorBlock];
-					dist[sourceBlock*numBlock + destinationBlock] = 1;			//Set distance to 1
-				}
-				sourceBlock++;
+			//Enter through the test
+			preheader->getTerminator()->replaceUsesOfWith(header, versionBlock);
+
+			//The fast copy does not need the tested checks
+			dropChecks(checks, fast.valueMap);
+
+			errs()<<"Versioned loop "<<header->getName()<<", "<<checks.size()<<" checks removed from the fast path\n";
+			return versionBlock;
+		}
+
+		//Split the iterations of a loop whose indexes are "i + offset" into the boundary iterations, which keep their
+		//checks, and a middle range where every index is known to be inside its array, which runs a copy without checks.
+		//
+		//	lo = max(-offset)		every lower check holds for i >= lo
+		//	hi = min(size - offset)		every upper check holds for i < hi
+		//
+		//The back edges of the checked loop go through a test that enters the middle copy once lo <= i < hi. The middle
+		//copy leaves again through the original header when i reaches the end of the range, so the last iterations
+		//are checked again. entering is the one block outside the loop that goes to its header, where the end of the
+		//middle range is computed.
+		bool splitLoop(Function &F, Loop* loop, BasicBlock* entering){
+			if (!canCloneLoop(loop, entering)){
+				return false;
 			}
+			BasicBlock* header = loop->getHeader();
 
-			//Perform the algorithm
-			for (int i = 0; i<numBlock ;i++){
-				for (int j = 0; j<numBlock ;j++){
-					for (int k = 0; k<numBlock ;k++){
-						if (j!=k){
-							if (dist[j*numBlock + k] > (dist[j*numBlock + i] + dist[i*numBlock + k])){ 
-								dist[j*numBlock + k] = dist[j*numBlock + i] + dist[i*numBlock + k];
-							}
+			Value* induction = NULL;
+			Value* last = NULL;
+			if (!loopChecks.findInduction(loop, induction, last, NULL)){
+				return false;
+			}
+			int step = loopChecks.getStep(loop, induction);
+
+			//Find the checks on "i + offset" and the range they allow
+			std::vector<ICmpInst*> checks;
+			std::vector<std::pair<Value*, int64_t> > uppers;
+			int64_t lo = INT64_MIN;
+			Type* indexType = NULL;
+			for (Loop::block_iterator j = loop->block_begin(); j != loop->block_end(); ++j){
+				for (BasicBlock::iterator m = (*j)->begin(); m != (*j)->end(); ++m){
+					ICmpInst* cmp = dyn_cast<ICmpInst>(m);
+					BranchInst* branch;
+					int64_t offset;
+					if (cmp == NULL || !loopChecks.isBoundCheck(cmp, branch) || !loopChecks.getOffset(cmp->getOperand(0), induction, offset)){
+						continue;
+					}
+					if (indexType != NULL && cmp->getOperand(0)->getType() != indexType){
+						continue;
+					}
+
+					ConstantInt* minusOne = dyn_cast<ConstantInt>(cmp->getOperand(1));
+					if (cmp->getPredicate() == CmpInst::ICMP_SGT && minusOne != NULL && minusOne->isMinusOne()){
+						lo = std::max(lo, -offset);
+					}else if (cmp->getPredicate() == CmpInst::ICMP_ULT || cmp->getPredicate() == CmpInst::ICMP_SLT){
+						if (!loopChecks.isInvariant(cmp->getOperand(1), loop, NULL)){
+							continue;
+						}
+						if (cmp->getPredicate() == CmpInst::ICMP_ULT){
+							lo = std::max(lo, -offset);
 						}
+						uppers.push_back(std::make_pair(cmp->getOperand(1), offset));
+					}else{
+						continue;
 					}
+					indexType = cmp->getOperand(0)->getType();
+					checks.push_back(cmp);
 				}
 			}
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-//////////////////////////////////////////////REACHING DEFINTION ANALYSIS////////////////////////////////////////////////////////////////////
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-			int numInst = 0;		//number of instructions
-			int numDef = 0;			//number of defs
+			//With only one side known the middle range would never end
+			if (checks.size() == 0 || uppers.size() == 0 || lo == INT64_MIN){
+				return false;
+			}
+
+			ClonedRegion middle;
+			middle.clone(header, loop->getBlocks(), "middle");
+			BasicBlock* middleHeader = middle.getCloneHead();
+
+			//The end of the middle range, computed once before the loop
+			Instruction* insertPoint = entering->getTerminator();
+			Value* hi = NULL;
+			for (int j = 0; j < uppers.size(); j++){
+				Value* size = loopChecks.copyExpression(uppers[j].first, loop, NULL, NULL, insertPoint);
+				if (size->getType() != indexType){
+					size = CastInst::CreateIntegerCast(size, indexType, false, "splitsize", insertPoint);
+				}
+				Value* end = BinaryOperator::CreateSub(size, ConstantInt::get(indexType, uppers[j].second, true), "splitend", insertPoint);
+				if (hi == NULL){
+					hi = end;
+				}else{
+					Value* smaller = new ICmpInst(insertPoint, CmpInst::ICMP_SLT, end, hi, "splitmin");
+					hi = SelectInst::Create(smaller, end, hi, "splitend", insertPoint);
+				}
+			}
+			Constant* loValue = ConstantInt::get(indexType, lo, true);
+
+			//Enter the middle range from the checked loop
+			BasicBlock* splitBlock = BasicBlock::Create(F.getContext(), Twine(header->getName() + "split"), &F, header);
+			Value* current = new LoadInst(induction, "current", splitBlock);
+			current = CastInst::CreateIntegerCast(current, indexType, true, "current", splitBlock);
+			Value* aboveLo = new ICmpInst(*splitBlock, CmpInst::ICMP_SGE, current, loValue, "CmpSplit");
+			Value* belowHi = new ICmpInst(*splitBlock, CmpInst::ICMP_SLT, current, hi, "CmpSplit");
+			Value* inMiddle = BinaryOperator::CreateAnd(aboveLo, belowHi, "CmpSplit", splitBlock);
+			BranchInst::Create(middleHeader, header, inMiddle, splitBlock);
+
+			std::vector<BasicBlock*> predecessors(pred_begin(header), pred_end(header));
+			for (int j = 0; j < predecessors.size(); j++){
+				if (predecessors[j] != splitBlock){
+					predecessors[j]->getTerminator()->replaceUsesOfWith(header, splitBlock);
+				}
+			}
+
+			//The middle copy runs while the induction variable stays in range. Going up only the upper end can be reached,
+			//going down only the lower one. Leaving it goes back to the original header.
+			BranchInst* middleExit = cast<BranchInst>(middleHeader->getTerminator());
+			Value* middleCurrent = new LoadInst(induction, "current", middleExit);
+			middleCurrent = CastInst::CreateIntegerCast(middleCurrent, indexType, true, "current", middleExit);
+			Value* inRange;
+			if (step > 0){
+				inRange = new ICmpInst(middleExit, CmpInst::ICMP_SLT, middleCurrent, hi, "CmpSplit");
+			}else{
+				inRange = new ICmpInst(middleExit, CmpInst::ICMP_SGE, middleCurrent, loValue, "CmpSplit");
+			}
+			middleExit->setCondition(BinaryOperator::CreateAnd(middleExit->getCondition(), inRange, "CmpSplit", middleExit));
+			middleExit->setSuccessor(1, header);
+
+			dropChecks(checks, middle.valueMap);
+
+			errs()<<"Split loop "<<header->getName()<<", "<<checks.size()<<" checks removed from the middle iterations\n";
+			return true;
+		}
 
-			//Get loopinfo
-  			LoopInfo &LI = getAnalysis<LoopInfo>();
+		//Collect the loops without inner loops
+		void getInnermostLoops(Loop* loop, std::vector<Loop*> &innermost){
+			if (loop->getSubLoops().empty()){
+				innermost.push_back(loop);
+			}
+			for (Loop::iterator i = loop->begin(); i != loop->end(); ++i){
+				getInnermostLoops(*i, innermost);
+			}
+		}
 
-			std::vector<Instruction*> instructionLists;	//List of instructions
+		//Estimated runs of each block per call of the function, from BlockFrequencyInfo and kept up to date as regions are copied
+		std::map<BasicBlock*, double> frequency;
 
-			//Put each instruction into list			
-			for(inst_iterator i = inst_begin(F), e = inst_end(F); i != e; ++i){
-				instructionLists.insert(instructionLists.end(), &*i);
+		//Checks that always pass along the path into a region
+		PathQualified qualified;
 
-				//Get line number
-				unsigned int line;
-				MDNode *N = i->getMetadata("dbg");
-				if (N) {
-					DILocation Loc(N);                     
-					line = Loc.getLineNumber();
+		//Instructions the module may still grow by
+		int moduleBudget;
+
+		virtual bool doInitialization(Module &M){
+			int moduleSize = 0;
+			for (Module::iterator f = M.begin(); f != M.end(); ++f){
+				for (Function::iterator b = f->begin(); b != f->end(); ++b){
+					moduleSize += b->size();
 				}
+			}
+			moduleBudget = moduleSize * moduleGrowth / 100;
+			return false;
+		}
 
-				//Store data about variables in list - include line number, variable name, and actual instr
-				if (i->getOpcode()==28 && N && i->getOperand(1)->getName()!=""){
-					//Insert information about instruction
-					defInstruct* curInstuction = new defInstruct(i->getOperand(1)->getName(), numInst, line);
-					instructionDefIndex[numDef++] = curInstuction;
+		//Blocks made after the frequencies were read are taken to run once
+		double getFrequency(BasicBlock* block){
+			std::map<BasicBlock*, double>::iterator found = frequency.find(block);
+			return found == frequency.end() ? 1 : found->second;
+		}
+
+		//Bounds checks in a block
+		int countChecks(BasicBlock* block){
+			int checks = 0;
+			for (BasicBlock::iterator i = block->begin(); i != block->end(); ++i){
+				if (isa<ICmpInst>(i) && i->getName().startswith("CmpTest")){
+					checks++;
 				}
-				
-				//Store index number of instruction
-				instructionIndex[&*i] = numInst++;
-   			}
+			}
+			return checks;
+		}
 
-			//Allocate 2d array to hold reaching def
-			reachDef = (int*)calloc((numInst)*numDef,sizeof(int));
+		//Run for each function
+		virtual bool runOnFunction(Function &F){
 			
-			//Hold defentions that are being studied
-			int prevDef = 0;
-			int curDef = 0;
-			//go through each instruction and fix successor reaching defs
-			for(int i = 0; i < numInst; i++){
-				Instruction* curInst = instructionLists[i];	//Instruction being studied
-				BasicBlock *curBlock = curInst->getParent();	//block with current instruction
-				prevDef = curDef;				//defs being studied
-				
-				//Get which defs this instruction added
-				for (curDef = 0; curDef < numDef; curDef++){
-					//compare def to the instruction being studied
-					if(instructionDefIndex[curDef]->instructNum > i){
-						curDef--;
-						break;
-					}
-				}
+			//Information about structure of program
+			std::map<BasicBlock*, int> basicBlockIndex;
+			std::map<int, BasicBlock*> basicBlockReverseIndex;
+			std::map<Instruction*, int> instructionIndex;
+			std::map<int, defInstruct*> instructionDefIndex;
 
-				//copy prev instruction if not first instr in block
-				if (i > 0 && (curInst->getParent()->getFirstNonPHI()!=curInst)){
-					//Copy previous reach def
-					for (int j = 0; j < numDef; j++){
-						//if it is marked as reaching, mark it as reaching in next
-						if (reachDef[(i-1)*numDef+j] > 0){
-							reachDef[i*numDef+j] = reachDef[(i-1)*numDef+j]; 
-						}
-					}
-				}
-				
-				//Add new defitions reachable because of new isntruction
-				for (int j = prevDef+1; j <= curDef && j < numDef; j++){
-					reachDef[i*numDef+j] = basicBlockIndex[curBlock] + 1;		//mark instruction as reaching
-					//Check if need to get rid of def
-					for (int k = 0; k < numDef; k++){
-						//if instruction  is marked as reaching and not the same instruction
-						if (reachDef[i*numDef+k] > 0 && instructionDefIndex[k]->instructNum!=i){
-							//if the instructions are for the same variable, mark the others so
-							if(instructionDefIndex[j]->def == instructionDefIndex[k]->def){
-								reachDef[i*numDef+k] = 0;
-							}
-						}
-					}
+			Reachability reachability;					//Hold which blocks reach each other
+			ReachingDefs reachingDefs;					//Hold reaching def for each block
+			std::vector<BitVector> killedDef;	//Hold killed def for each block index
+			std::vector<BitVector> usedDef;		//Hold used def for each block index
+			std::vector<int> usedLoads;		//Hold number of loads with several reaching defs for each block index
+			std::vector<BitVector> influencedNode;		//Hold influenced blocks for each block index
+			std::map<BasicBlock*, std::set<BasicBlock*> > ROI;		//Hold used def for each bock
+			BitVector merging;		//Blocks that killed defs, by block index
+
+			//Read the block frequencies and the growth allowed, before anything is changed
+			BlockFrequencyInfo &BFI = getAnalysis<BlockFrequencyInfo>();
+			double entryFrequency = BFI.getBlockFreq(&F.getEntryBlock()).getFrequency();
+			int functionBudget = 0;
+			frequency.clear();
+			for (Function::iterator i = F.begin(); i != F.end(); ++i){
+				frequency[i] = BFI.getBlockFreq(i).getFrequency() / entryFrequency;
+				functionBudget += i->size();
+			}
+			functionBudget = functionBudget * functionGrowth / 100;
+			int numCopies = 0;
+			int grown = 0;
+			int numRemoved = 0;
+			std::vector<BasicBlock*> changedBlocks;		//Regions the last round copied, and their copies
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////LOOP VERSIONING///////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+			//Version the innermost loops before restructuring, while the loop info is still current
+			std::vector<Loop*> innermost;
+			LoopInfo &loops = getAnalysis<LoopInfo>();
+			for (LoopInfo::iterator i = loops.begin(); i != loops.end(); ++i){
+				getInnermostLoops(*i, innermost);
+			}
+			for (int i = 0; i < innermost.size(); i++){
+				//The checked loop left by versioning is still split, it is the one that runs when the range test fails.
+				//Versioning leaves it without a preheader, it is entered from the test
+				BasicBlock* entering = versionLoop(F, innermost[i]);
+				if (entering == NULL){
+					entering = innermost[i]->getLoopPreheader();
 				}
+				splitLoop(F, innermost[i], entering);
+			}
 
-				int changedFlag = 0;	//Flag to hold whether any changes where made
-				int killedFlag = 0;	//Flag to hold whether a def was killed
-
-				//If  it is a terminating instruction and is doing a call
-				if (curInst->isTerminator() && (((curBlock->getTerminator())->getNumSuccessors()>1)||curInst->getOpcode()==2)){
-					for (int j = 0; j<curBlock->getTerminator()->getNumSuccessors(); j++){
-						//Get the destination of the call
-						BasicBlock* nextBlock = curBlock->getTerminator()->getSuccessor(j);
-						Instruction* nextInst = nextBlock->getFirstNonPHI();
-
-						//Get index of the instruction
-						int nextInstIndex = instructionIndex[nextInst];
-
-						for (int k = 0; k<numDef; k++){
-							//Copy the reach definitions
-							if (reachDef[i*numDef+k] > 0){
-								if (reachDef[nextInstIndex*numDef+k] < 1){ 
-									changedFlag = 1;	//mark  there was a change
-									//Copy def
-									reachDef[nextInstIndex*numDef+k] = basicBlockIndex[curBlock] + 1; 
-								     
-									std::set<int> newKill;	//set of defs killed
-
-								     	//check for killed def
-									for (int d = 0; d < numDef;d++){
-										//if a diff def for same variable, and both reach
-										if (d!=k && instructionDefIndex[d]->def==instructionDefIndex[k]->def && reachDef[nextInstIndex*numDef+d]>0){
-											//if they are from diff blocks, then it is killed
-											if (reachDef[nextInstIndex*numDef+d] != reachDef[nextInstIndex*numDef+k]){
-												killedFlag = 1;
-											}
-
-										       	newKill.insert(d);	//insert it as newly killed
-										  }
-									}
-								     
-									//if there is a def killed, add the intial that triggered 
-								     	if (killedFlag){
-										killedFlag = 0;		//reset flag
-
-								          	std::set<int> currentKill = killedDef[nextBlock];	//get set
-										
-										//Add newly killed
-								         	currentKill.insert(k);
-										currentKill.insert(newKill.begin(), newKill.end());
-								          	
-										killedDef[nextBlock] = currentKill;			//Add back
-								     	}
-								}
-							}
-						}
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////INITIALIZE////////////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+			int cloningFlag = 1;
+			int numBlock = 0;	//Number of blocks
+			int numDef = 0;			//number of defs
 
-						//If there was a change restart analysis earlier - add to procset
-						if (changedFlag){
-							changedFlag = 0;	//reset flag
+			//The first round analyses the whole function. Later ones only find again the facts of the regions the round
+			//before copied, their copies and the blocks they exit to; everything else keeps its cached facts
+			bool fullAnalysis = true;
+		
+		while (cloningFlag == 1){
 
-							//if modified an earlier instruction, go back
-							if (i>nextInstIndex){
-								i = nextInstIndex;
-							}
+			//Reset Flag
+			cloningFlag = 0;
 
-							//Modify def analysis based on moving back
-							for (curDef = 0; curDef < numDef; curDef++){
-								if(instructionDefIndex[curDef]->instructNum > i){
-									curDef--;
-									break;
-								}
-							}
+			//Clear maps
+			ROI.clear();
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////REACHABILITY BETWEEN BLOCKS///////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+			//Get list of basic blocks			
+			Function::BasicBlockListType &allblocks = F.getBasicBlockList();
+			//Go through basic blocks, copies made since were numbered as they were made
+			if (fullAnalysis){
+				numBlock = 0;
+				basicBlockIndex.clear();
+				basicBlockReverseIndex.clear();
+				for (Function::iterator i = allblocks.begin(); i != allblocks.end(); i++) {
+					basicBlockReverseIndex[numBlock] = i;
+					basicBlockIndex[i] = numBlock++;		//hold information about where the basic block is
+				}
+			}
 
-							//go back to new successor block if backwards
-							if (i>nextInstIndex){
-								break;
-							}
-						}
+			//Find which blocks reach each other
+			reachability.build(F);
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////REACHING DEFINTION ANALYSIS////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+			std::vector<BasicBlock*> usedBlocks;		//blocks to find used defs for
+			std::vector<BasicBlock*> mergeBlocks;		//blocks to find killed defs for
+
+			if (fullAnalysis){
+				int numInst = 0;		//number of instructions
+				numDef = 0;
+				instructionIndex.clear();
+				instructionDefIndex.clear();
+
+				//Get loopinfo
+	  			LoopInfo &LI = getAnalysis<LoopInfo>();
+
+				std::vector<Instruction*> instructionLists;	//List of instructions
+				std::vector<Instruction*> defStores;		//Store making each def
+
+				//Put each instruction into list			
+				for(inst_iterator i = inst_begin(F), e = inst_end(F); i != e; ++i){
+					instructionLists.insert(instructionLists.end(), &*i);
+
+					//Get line number
+					unsigned int line;
+					MDNode *N = i->getMetadata("dbg");
+					if (N) {
+						DILocation Loc(N);                     
+						line = Loc.getLineNumber();
+					}
 
+					//Store data about variables in list - include line number, variable name, and actual instr
+					if (i->getOpcode()==28 && N && i->getOperand(1)->getName()!=""){
+						//Insert information about instruction
+						defInstruct* curInstuction = new defInstruct(i->getOperand(1)->getName(), numInst, line);
+						instructionDefIndex[numDef++] = curInstuction;
+						defStores.push_back(&*i);
+					}
+				
+					//Store index number of instruction
+					instructionIndex[&*i] = numInst++;
+	   			}
+
+				//Solve reaching def for each block
+				reachingDefs.run(F, defStores);
+				killedDef.assign(numBlock, BitVector(numDef));
+				usedDef.assign(numBlock, BitVector(numDef));
+				usedLoads.assign(numBlock, 0);
+				merging = BitVector(numBlock);
+				for (Function::iterator i = allblocks.begin(); i != allblocks.end(); i++) {
+					usedBlocks.push_back(i);
+				}
+				mergeBlocks = usedBlocks;
+			}else{
+				//The copies count as the defs they were copied from, so only the changed blocks are solved again
+				reachingDefs.update(changedBlocks);
+				killedDef.resize(numBlock, BitVector(numDef));
+				usedDef.resize(numBlock, BitVector(numDef));
+				usedLoads.resize(numBlock, 0);
+				merging.resize(numBlock);
+				usedBlocks = changedBlocks;
+
+				//The blocks the regions exit to now also come in from the copies
+				std::set<BasicBlock*> seen(changedBlocks.begin(), changedBlocks.end());
+				mergeBlocks = changedBlocks;
+				for (int j = 0; j < changedBlocks.size(); j++){
+					for (succ_iterator k = succ_begin(changedBlocks[j]); k != succ_end(changedBlocks[j]); ++k){
+						if (seen.insert(*k).second){
+							mergeBlocks.push_back(*k);
+						}
 					}
 				}
 			}
+
+			//Find the defs merged in each block
+			BitVector refreshed(numBlock);		//blocks whose killed or used defs were found again
+			for (int j = 0; j < mergeBlocks.size(); j++){
+				int block = basicBlockIndex[mergeBlocks[j]];
+				refreshed.set(block);
+				killedDef[block].reset();
+				reachingDefs.getMergesAt(mergeBlocks[j], killedDef[block]);
+				merging[block] = killedDef[block].any();
+			}
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////USED DEF ANALYSIS//////////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-			int curInstIndex = 0;
-			//Go through each instruction
-			for(inst_iterator i = inst_begin(F), e = inst_end(F); i != e; ++i){
-				if (i->getOpcode()==27){		//Is a load instruction
-					std::set<int> defsUsed;
-					//Go throuch reaching defs
-					for (int d = 0 ;d<numDef; d++){
-						//if the variable used has multiple reachinf defs, insert them
-						if (reachDef[curInstIndex*numDef + d] > 0 && instructionDefIndex[d]->def == i->getOperand(0)->getName()){
-							defsUsed.insert(d);		//add to used
+			//Go through each instruction of the blocks
+			for (int j = 0; j < usedBlocks.size(); j++){
+				int block = basicBlockIndex[usedBlocks[j]];
+				BitVector &currentUsed = usedDef[block];
+				currentUsed.reset();
+				usedLoads[block] = 0;
+				refreshed.set(block);
+				for (BasicBlock::iterator i = usedBlocks[j]->begin(); i != usedBlocks[j]->end(); ++i){
+					if (i->getOpcode()==27){		//Is a load instruction
+						//Go throuch reaching defs of the variable used
+						ReachingDefs::Defs reaching = reachingDefs.reachingOf(i->getOperand(0), &*i);
+
+						//if there are mutliple reach defs, then add to used defs list
+						if (reaching.count()>1){
+							usedLoads[block]++;
+							for (ReachingDefs::Defs::iterator d = reaching.begin(); d != reaching.end(); ++d){
+								currentUsed.set(*d);		//add to used
+							}
 						}
-					}
-					//if there are mutliple reach defs, then add to used defs list
-					if (defsUsed.size()>1){
-						std::set<int> currentUsed = usedDef[i->getParent()];
-						currentUsed.insert(defsUsed.begin(), defsUsed.end());
-						usedDef[i->getParent()] = currentUsed;
-					}
 
+					}
 				}
-				curInstIndex++;
 			}
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////INFLUENCED NODE//////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-			//Go through each block
-			for (Function::iterator i = allblocks.begin(); i != allblocks.end(); i++){	
-				//if it has mutliple defs that it killed
-				if (killedDef[i].size() > 0){
-					//Go through each block and look for a path
-					for (Function::iterator j = allblocks.begin(); j != allblocks.end(); j++){
-						//Get indexes for block
-						int sourceBlock = basicBlockIndex[i];
-						int destBlock = basicBlockIndex[j];
-
-						if (usedDef[j].size() > 0){
-							//If they are different blocks and one source reaches dest or the same block
-							if ((dist[sourceBlock*numBlock + destBlock]>0 && dist[sourceBlock*numBlock + destBlock]<100000000) || sourceBlock==destBlock){
-								//Go through the killed defs for source block
-								for (std::set<int>::iterator k = killedDef[i].begin(); k != killedDef[i].end(); ++k){
-									int killed = *k;
-					
-									//GO through used defs for dest blocks
-									for (std::set<int>::iterator m = usedDef[j].begin(); m != usedDef[j].end(); ++m){
-										int used = *m;
-
-										//if there is an interesection between killed and used, dest is influenced
-										if (used==killed){
-											std::set<BasicBlock*> influencedBlocks = influencedNode[i];
-											influencedBlocks.insert(j);
-											influencedNode[i] = influencedBlocks;
-										}
-									}
-								}
-							}
-						}		
+			//Go through each block that killed defs, and the blocks it reaches
+			influencedNode.assign(numBlock, BitVector());
+			for (int sourceBlock = merging.find_first(); sourceBlock != -1; sourceBlock = merging.find_next(sourceBlock)){
+				BitVector reached = reachability.getReached(sourceBlock);
+				reached.set(sourceBlock);
+
+				//Every source that influenced a block was copied or turned down last round. The others only influence something
+				//now if their killed defs or the used defs of a block they reach were found again
+				if (!reached.anyCommon(refreshed)){
+					continue;
+				}
+				influencedNode[sourceBlock].resize(numBlock);
+				for (int destBlock = reached.find_first(); destBlock != -1; destBlock = reached.find_next(destBlock)){
+					//if there is an interesection between killed and used, dest is influenced
+					if (killedDef[sourceBlock].anyCommon(usedDef[destBlock])){
+						influencedNode[sourceBlock].set(destBlock);
 					}
 				}
 			}
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////ROI//////////////////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-			//Go through all blocks
-			for (Function::iterator i = allblocks.begin(); i != allblocks.end(); i++){
-				int sourceBlock = basicBlockIndex[i];	//Initial block
-	
-				//GO through influenced blocks for each blocks
-				for (std::set<BasicBlock*>::iterator j = influencedNode[i].begin(); j != influencedNode[i].end(); ++j){ 
-					int endBlock = basicBlockIndex[*j]; 	//last block
-
-					std::set<BasicBlock*> curROI;
-					//Go through all the blocks and set as an intermediate block
-					for (Function::iterator k = allblocks.begin(); k != allblocks.end(); k++){	
-						int intermediateBlock = basicBlockIndex[k];
-
-						//if source reaches intermediate, and intermediate reaches dest, then in ROI
-						if ((dist[sourceBlock*numBlock+intermediateBlock]>0 && dist[sourceBlock*numBlock+intermediateBlock]<1000000000)|| sourceBlock==intermediateBlock){ 
-							if ((dist[intermediateBlock*numBlock+endBlock]>0 && dist[intermediateBlock*numBlock+endBlock]<1000000000)|| endBlock==intermediateBlock){
-								curROI.insert(k);	
-							}
-						}	
-					}
+			//The ROI of a block is every block on a path from it to a block it influences
+			for (int sourceBlock = merging.find_first(); sourceBlock != -1; sourceBlock = merging.find_next(sourceBlock)){
+				if (influencedNode[sourceBlock].none()){
+					continue;
+				}
 
-					//Insert into list of ROI
-					if (curROI.size()>0){
-						ROI[i] =curROI;
-					//	break;			//FIX
-					}
+				//Blocks reaching any of the influenced blocks
+				BitVector towards(numBlock);
+				for (int endBlock = influencedNode[sourceBlock].find_first(); endBlock != -1; endBlock = influencedNode[sourceBlock].find_next(endBlock)){
+					towards |= reachability.getReaching(endBlock);
+					towards.set(endBlock);
 				}
-				
-				//if (ROI[i].size()>1){		//FIX
-				//	break;			//FIX
-				//}
 
+				//that the source reaches
+				BitVector curROI = reachability.getReached(sourceBlock);
+				curROI.set(sourceBlock);
+				curROI &= towards;
+
+				//Insert into list of ROI
+				for (int k = curROI.find_first(); k != -1; k = curROI.find_next(k)){
+					ROI[basicBlockReverseIndex[sourceBlock]].insert(basicBlockReverseIndex[k]);
+				}
 			}
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////REPLICATING//////////////////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-			//Go through all the ROI sets and clone them		
+			//Go through all the ROI sets and clone them
+			std::vector<ClonedRegion*> clonedRegions;
+			std::vector<BasicBlock*> enteringBlocks;		//predecessor of the head that enters each clone
+			std::vector<BasicBlock*> failureBlocks;		//blocks on either end of the edge of a removed check
 			for (std::map<BasicBlock*, std::set<BasicBlock*> >::iterator i = ROI.begin(); i != ROI.end(); ++i){
 
-				//Count number of predecessor blocks
+				//Get predecessor blocks
 				int sourceBlock = basicBlockIndex[i->first];	//get index of top of ROI block
-				int numPred = 0;
-				for (int j = 0; j<numBlock; j++){
-					if (dist[j*numBlock + sourceBlock]==1){
-						numPred++;	//Increment
+				std::vector<unsigned> &preds = reachability.getPredecessors(sourceBlock);
+				std::vector<BasicBlock*> originalROI(i->second.begin(), i->second.end());
+
+				//Instructions a copy duplicates, and the checks and merged loads in the influenced blocks it could
+				//make redundant, in runs per call
+				int size = 0;
+				double work = 0;
+				for (int j = 0; j < originalROI.size(); j++){
+					int block = basicBlockIndex[originalROI[j]];
+					size += originalROI[j]->size();
+					if (influencedNode[sourceBlock].test(block)){
+						work += getFrequency(originalROI[j]) * (usedLoads[block] + countChecks(originalROI[j]));
 					}
 				}
-
-				//Create 1 for each predecessor
-				for (int k = 1; k<numPred; k++){
-
-					std::vector<BasicBlock*> originalROI;				
-					std::vector<BasicBlock*> clonedROI;
-					std::vector<instTranslation*> newTranslations;
-
-					//Go through a specific set of ROI blocks
-					for (std::set<BasicBlock*>::iterator j=(i->second).begin(); j!=(i->second).end(); ++j){
-
-						BasicBlock *cloneBB = BasicBlock::Create((*j)->getContext(), Twine((*j)->getName() + "clone"), &F);
-						//Go through instructions for each block
-						for (BasicBlock::iterator m = (*j)->begin(); m!=(*j)->end(); ++m) {
-							//clone instruction     
-							Instruction *cloneInst = m->clone();
-							if (m->hasName()){
-								cloneInst->setName(m->getName() + "clone");
-							}
-
-							//Insert name translation
-							instTranslation* curInstTranlate = new instTranslation(m, cloneInst);
-							newTranslations.insert(newTranslations.end(), curInstTranlate);
-
-							cloneBB->getInstList().push_back(cloneInst);
-						}
-						//Add cloned BB
-						clonedROI.insert(clonedROI.end(), cloneBB);
-						originalROI.insert(originalROI.end(), *j);
-
+				double headFrequency = getFrequency(i->first);
+
+#if pathQualified
+				//Checks that pass along every way into the region need no copy, they are removed from the region itself
+				std::vector<ICmpInst*> alwaysPassing;
+				qualified.findAlwaysPassing(reachingDefs, i->first, originalROI, alwaysPassing);
+				for (int j = 0; j < alwaysPassing.size(); j++){
+					failureBlocks.push_back(alwaysPassing[j]->getParent());
+					failureBlocks.push_back(PathQualified::removeCheck(alwaysPassing[j]));
+					numRemoved++;
+				}
+				reachingDefs.clearWalk();
+#endif
+
+				//Create 1 for each predecessor it pays for, the first predecessor can just use the original
+				std::vector<std::pair<ClonedRegion*, double> > copies;
+				double movedShare = 0;
+				for (int k = 1; k<preds.size(); k++){
+					//The part of the runs of the head that come from this predecessor
+					BasicBlock* prevBlock = basicBlockReverseIndex[preds[k]];
+					double share = 0;
+					if (headFrequency > 0){
+						share = std::min(1.0, getFrequency(prevBlock) / prevBlock->getTerminator()->getNumSuccessors() / headFrequency);
 					}
-					//Map orininal to cloned
-					cloned[clonedROI] = originalROI;
-					headCloned[clonedROI] = i->first;
-					renameBlock[clonedROI] = newTranslations;
-				}
-			}
-
-			//Fix up names
-			//Go throuch each clone
-			for (std::map<std::vector<BasicBlock*>, std::vector<instTranslation*> >::iterator i = renameBlock.begin(); i!=renameBlock.end(); ++i){
-				//Go throuch each block in clone
-				for (std::vector<BasicBlock*>::const_iterator j=(i->first).begin(); j!=(i->first).end(); ++j){
-					//Go throuch each instruction					
-					for (BasicBlock::iterator k = (*j)->begin(); k!=(*j)->end(); ++k) {
-						//Go throuch each operand in each instruction
-						for (int m = 0; m<k->getNumOperands() ;m++){
-							//Go through each rename
-							for (int n = 0; n<i->second.size();n++){
-								instTranslation* instFixing = i->second[n];
-								//if refer to old, replace
-								if (k->getOperand(m)==instFixing->oldInst){
-									k->setOperand(m,instFixing->newInst);
-								}
-							}
-						}
+					double benefit = share * work;
+#if pathQualified
+					//Only the checks the copy removes along the path from this predecessor count
+					std::vector<ICmpInst*> passing;
+					qualified.findPassing(reachingDefs, i->first, prevBlock, originalROI, passing);
+					if (passing.size() == 0){
+						continue;
+					}
+					benefit = 0;
+					for (int j = 0; j < passing.size(); j++){
+						benefit += share * getFrequency(passing[j]->getParent());
+					}
+#endif
+					if (benefit * cloneCost < size || size > functionBudget || size > moduleBudget){
+						continue;
+					}
+					functionBudget -= size;
+					moduleBudget -= size;
+					grown += size;
+					numCopies++;
+
+					ClonedRegion* clonedROI = new ClonedRegion();
+					clonedROI->clone(i->first, originalROI, "clone");
+					clonedRegions.push_back(clonedROI);
+					enteringBlocks.push_back(prevBlock);
+					copies.push_back(std::make_pair(clonedROI, share));
+					movedShare += share;
+#if pathQualified
+					for (int j = 0; j < passing.size(); j++){
+						failureBlocks.push_back(PathQualified::removeCheck(cast<ICmpInst>(clonedROI->getCopy(passing[j]))));
+						numRemoved++;
 					}
+#endif
+				}
 
+				//Copies take the runs of their predecessor, the original keeps the rest
+				movedShare = std::min(1.0, movedShare);
+				for (int j = 0; j < originalROI.size(); j++){
+					double original = getFrequency(originalROI[j]);
+					for (int k = 0; k < copies.size(); k++){
+						frequency[copies[k].first->clones[j]] = original * copies[k].second;
+					}
+					frequency[originalROI[j]] = original * (1 - movedShare);
 				}
 			}
 
-			//Go through cloned and fix up pointers
-			for (std::map<std::vector<BasicBlock*>, std::vector<BasicBlock*> >::iterator i = cloned.begin(); i!=cloned.end(); ++i){
-				for (std::vector<BasicBlock*>::const_iterator j=(i->first).begin(); j!=(i->first).end(); ++j){
-					//Fix up terminator pointers
-					for (int k = 0; k<(*j)->getTerminator()->getNumSuccessors(); k++){
-						//Get the destination of the call
-						BasicBlock* nextBlock = (*j)->getTerminator()->getSuccessor(k);
-
-						//Try to find the block within the ROI
-						std::vector<BasicBlock*>::iterator it;
-						it = std::find((i->second).begin(),(i->second).end(), nextBlock);
-
-						//If it is found, we have to redirect it
-						if (it!=(i->second).end()){
-							//cast as branch
-							BranchInst* bi = dyn_cast<BranchInst>((*j)->getTerminator());
-							if (bi){
-								//get next block in clone and set as successor
-								BasicBlock* cloneNextBlock = i->first[it - (i->second).begin()];
-								bi->setSuccessor (k, cloneNextBlock);
-							}
-						}
-					}				
+			//Fix up predecessor pointers, once all regions are cloned from the original blocks
+			fullAnalysis = false;
+			for (int i = 0; i < clonedRegions.size(); i++){
+				if (clonedRegions[i]->enterFrom(enteringBlocks[i])){
+					cloningFlag = 1;
+				}else{
+					//Erasing blocks moves the block numbers, so the next round starts over
+					clonedRegions[i]->discard();
+					fullAnalysis = true;
 				}
 			}
 
-			//Fix up predecessor  pointers
-			while(cloned.size()>0){
-				//Go through each ROI
-				for (std::map<std::vector<BasicBlock*>, std::vector<BasicBlock*> >::iterator i = cloned.begin(); i!=cloned.end(); ++i){
-					std::vector<BasicBlock*> clonedROI = i->first;
-					std::vector<BasicBlock*> originalROI = i->second;
-
-					//Get information about head of basic block	
-					BasicBlock* headBlock = headCloned[i->first];
-					int headBlockIndex = basicBlockIndex[headBlock];
-
-					//Find the predecessors of block
-					int numPred = 0;
-					for (int j = 0; j<numBlock; j++){
-						if (dist[j*numBlock + headBlockIndex]==1){
-							numPred++;	//Increment
-							//First predecessor can just use the original
-							if (numPred==1){
-								continue;
-							}
-
-							cloningFlag = 1;
-
-							//Get cloned head block
-							BasicBlock* cloneHeadBlock;
-							std::vector<BasicBlock*>::iterator it;
-							it = std::find(originalROI.begin(),originalROI.end(), headBlock);
-							if (it!=originalROI.end()){
-								//get next block in clone and set as successor
-								cloneHeadBlock = clonedROI[it - originalROI.begin()];
-							}
-
-
-							//Get the previous block
-							BasicBlock* prevBlock = basicBlockReverseIndex[j];
-							//Go through the successors for the prdedecessor block
-							for (int k = 0; k<prevBlock->getTerminator()->getNumSuccessors(); k++){
-								//Get the destination of the call and check if dest is head
-								BasicBlock* nextBlock = prevBlock->getTerminator()->getSuccessor(k);
-								if (nextBlock!=headBlock){
-									continue;
-								}
-
-								//cast as branch
-								BranchInst* bi = dyn_cast<BranchInst>(prevBlock->getTerminator());
-								if (bi){
-									//get head block in clone and set as successor
-									bi->setSuccessor (k, cloneHeadBlock);
-									
-									//Remove from maps
-									cloned.erase(clonedROI);
-									headCloned.erase(clonedROI);
-									break;
-								}						
-							}
-						}
-
-						//Go through all clones
-						for (std::map<std::vector<BasicBlock*>, std::vector<BasicBlock*> >::iterator k = cloned.begin(); k!=cloned.end(); ++k){ 
-							//Find another clone for same blocks
-							if (k->second==originalROI){
-								clonedROI = k->first;
-								break; 
-							}
+			//Number the copies, which were added at the end of the function, and note what changed
+			changedBlocks.clear();
+			std::set<BasicBlock*> changedSet;
+			for (int i = 0; i < clonedRegions.size(); i++){
+				ClonedRegion* clonedROI = clonedRegions[i];
+				for (int j = 0; j < clonedROI->clones.size() && !fullAnalysis; j++){
+					basicBlockReverseIndex[numBlock] = clonedROI->clones[j];
+					basicBlockIndex[clonedROI->clones[j]] = numBlock++;
+					if (changedSet.insert(clonedROI->originals[j]).second){
+						changedBlocks.push_back(clonedROI->originals[j]);
+					}
+					changedSet.insert(clonedROI->clones[j]);
+					changedBlocks.push_back(clonedROI->clones[j]);
+
+					//Copied stores make the same defs
+					for (BasicBlock::iterator m = clonedROI->originals[j]->begin(); m != clonedROI->originals[j]->end(); ++m){
+						//The copies of checks removed along the path are gone
+						Value* copy = clonedROI->getCopy(m);
+						if (copy != NULL){
+							reachingDefs.addCopy(m, cast<Instruction>(copy));
 						}
-
-
 					}
 				}
+				delete clonedROI;
+			}
+			for (int i = 0; i < failureBlocks.size() && !fullAnalysis; i++){
+				if (changedSet.insert(failureBlocks[i]).second){
+					changedBlocks.push_back(failureBlocks[i]);
+				}
 			}
 		}
+			errs()<<F.getName()<<": "<<numCopies<<" region copies, "<<grown<<" instructions added, "<<numRemoved<<" checks removed along paths\n";
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////DEBUG////////////////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -586,7 +747,7 @@ namespace {
 			for (int z = 0; z<numInst;z++){
 				errs()<<*instructionLists[z]<<"\n";
 				for (int y = 0; y<numDef; y++){
-					if (reachDef[z*numDef+y] > 0){
+					if (reachingDefs.reaches(y, instructionLists[z])){
 						errs()<<"-------"<<instructionDefIndex[y]->lineNum<<"-"<<instructionDefIndex[y]->def<<"\n";
 					}
 				}
@@ -594,29 +755,29 @@ namespace {
 */
 /*
 			//Print Killed def
-			for (std::map<BasicBlock*, std::set<int> >::iterator itr = killedDef.begin(); itr != killedDef.end(); ++itr){
-				errs() <<"\n"<<itr->first->getName();
-				for (std::set<int>::iterator it=(itr->second).begin(); it!=(itr->second).end(); ++it){
-				   	errs() << ' ' << instructionDefIndex[*it]->def<<"-"<<instructionDefIndex[*it]->lineNum;
+			for (int b = 0; b < numBlock; b++){
+				errs() <<"\n"<<basicBlockReverseIndex[b]->getName();
+				for (int it = killedDef[b].find_first(); it != -1; it = killedDef[b].find_next(it)){
+				   	errs() << ' ' << instructionDefIndex[it]->def<<"-"<<instructionDefIndex[it]->lineNum;
 				}
 			}
 
 */
 /*
 			//Print Used def
-			for (std::map<BasicBlock*, std::set<int> >::iterator itr = usedDef.begin(); itr != usedDef.end(); ++itr){
-				errs() <<"\n"<<itr->first->getName();
-				for (std::set<int>::iterator it=(itr->second).begin(); it!=(itr->second).end(); ++it){
-					errs() << ' ' << instructionDefIndex[*it]->def<<"-"<<instructionDefIndex[*it]->lineNum;
+			for (int b = 0; b < numBlock; b++){
+				errs() <<"\n"<<basicBlockReverseIndex[b]->getName();
+				for (int it = usedDef[b].find_first(); it != -1; it = usedDef[b].find_next(it)){
+					errs() << ' ' << instructionDefIndex[it]->def<<"-"<<instructionDefIndex[it]->lineNum;
 				}
 			}
 */
 /*
 			//Print Influenced def
-			for (std::map<BasicBlock*, std::set<BasicBlock*> >::iterator itr = influencedNode.begin(); itr != influencedNode.end(); ++itr){
-				errs() <<"\n"<<itr->first->getName();
-				for (std::set<BasicBlock*>::iterator it=(itr->second).begin(); it!=(itr->second).end(); ++it){
-					errs() <<" "<<(*it)->getName();
+			for (int b = 0; b < numBlock; b++){
+				errs() <<"\n"<<basicBlockReverseIndex[b]->getName();
+				for (int it = influencedNode[b].find_first(); it != -1; it = influencedNode[b].find_next(it)){
+					errs() <<" "<<basicBlockReverseIndex[it]->getName();
 				}
 			}
 */
@@ -631,13 +792,13 @@ namespace {
 */
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-			free(dist);
 			return true;
 
 		}
 
 		virtual void getAnalysisUsage(AnalysisUsage &AU) const {
 		  	AU.addRequired<LoopInfo>();		//add request	
+		  	AU.addRequired<BlockFrequencyInfo>();
 		}
 
 	};
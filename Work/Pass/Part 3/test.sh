@@ -1,6 +1,19 @@
 clang++ -c p11.cpp `llvm-config --cxxflags`;
-clang++ -shared -o pass.so p11.o `llvm-config --ldflags`
+clang++ -c "../Part 1/CreateBounds.cpp" `llvm-config --cxxflags`;
+clang++ -shared -o pass.so p11.o CreateBounds.o `llvm-config --ldflags`
 opt -load ./pass.so -p11 -dot-cfg <../../Test/hello.bc> result.bc
 lli result.bc
 rm result.bc
-rm -f *~ pass.so *.o
+#The loop in sum is versioned and its checked copy split, it prints 100 then 0
+opt -load ./pass.so -CreateBounds -p11 <../../Test/split.bc> result.bc 2> result.txt
+grep "Versioned loop\|Split loop" result.txt
+lli result.bc
+rm result.bc result.txt
+#Path-qualified mode: sum gets a copy without the check of a[i], pick loses the check of a[i + j], it prints 150 then 7
+clang++ -c p11.cpp -DpathQualified=true -o qualified.o `llvm-config --cxxflags`;
+clang++ -shared -o qualified.so qualified.o CreateBounds.o `llvm-config --ldflags`
+opt -load ./qualified.so -CreateBounds -p11 <../../Test/qualified.bc> result.bc 2> result.txt
+grep "checks removed along paths" result.txt
+lli result.bc
+rm result.bc result.txt
+rm -f *~ pass.so qualified.so *.o
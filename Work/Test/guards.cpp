@@ -0,0 +1,29 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char** argv){
+
+	int a[10] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+	int i;
+	int x = 0;
+	int y = 0;
+
+	//The checks of a[i - 1] and a[i + 1] together cover a[i], its check is removed
+	i = argc + 4;
+	x = a[i - 1] + a[i + 1];
+	y = a[i];
+
+	//i moves after its load for the first access, the second access is not covered by the first check
+	i = argc + 7;
+	x += a[i++];
+	y += a[i];
+	printf("%d\n", x + y);
+
+	//A negative guard only says i >= -4, the check of a[i] must stay and fail
+	i = argc - 4;
+	if(i > -5 && i < 10){
+		a[i] = 1;
+	}
+
+	return x + y;
+}
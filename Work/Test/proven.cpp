@@ -0,0 +1,27 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char** argv){
+
+	int a[10];
+	int b[12] = {0};
+	int i;
+	int s = 0;
+
+	//A loop that stops on != is not narrowed by CreateBounds, the range of i in the body is still 0 to 9
+	for(i = 0; i != 10; i++){
+		a[i] = i;
+	}
+
+	//2 * i is 0 to 8 and 2 * i + 1 is 1 to 9, both checks are proven
+	for(i = 0; i != 5; i++){
+		b[2 * i + 1] = a[2 * i];
+	}
+
+	for(i = 0; i < 12; i++){
+		s += b[i];
+	}
+	printf("%d\n", s);
+
+	return 0;
+}
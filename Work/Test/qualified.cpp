@@ -0,0 +1,42 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+int a[10] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+
+//Entered from the odd iterations i is 3, so a copy of the join for that path drops the check of a[i]. On the
+//even iterations i is k, which is only known at run time, and the check stays
+int sum(int k){
+	int s = 0;
+	int i;
+	int j;
+	for(j = 0; j < 100; j++){
+		if(j & 1){
+			i = 3;
+		}else{
+			i = k;
+		}
+		s += a[i];
+	}
+	return s;
+}
+
+//i + j is 7 whichever way the join is entered, so the check of a[i + j] is removed without a copy. Ranges alone
+//only give 4 to 10 for it
+int pick(int k){
+	int i;
+	int j;
+	if(k > 0){
+		i = 2;
+		j = 5;
+	}else{
+		i = 5;
+		j = 2;
+	}
+	return a[i + j];
+}
+
+int main(int argc, char** argv){
+	printf("%d\n", sum(argc - 1));
+	printf("%d\n", pick(argc));
+	return 0;
+}
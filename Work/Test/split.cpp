@@ -0,0 +1,27 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+int a[11] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+
+//n is only known at run time, so the loop is versioned, and the checked loop it keeps is split so only its
+//iterations near the ends of a are checked
+int sum(int n){
+	int s = 0;
+	int i;
+	for(i = 0; i < n; i++){
+		s += a[i] + a[i + 1];
+	}
+	return s;
+}
+
+int main(int argc, char** argv){
+
+	//Every index is inside a, the loop without checks runs
+	printf("%d\n", sum(argc + 9));
+
+	//a[i + 1] is past the end on the last iteration, the checked loop runs the middle iterations without checks
+	//and the failed check on the last one returns 0
+	printf("%d\n", sum(argc + 10));
+
+	return 0;
+}
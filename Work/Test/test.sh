@@ -1,2 +1,6 @@
 clang++ -g -O0 -emit-llvm benchmark.cpp -c -o benchmark.bc 
 
+clang++ -g -O0 -emit-llvm guards.cpp -c -o guards.bc 
+clang++ -g -O0 -emit-llvm split.cpp -c -o split.bc 
+clang++ -g -O0 -emit-llvm qualified.cpp -c -o qualified.bc 
+clang++ -g -O0 -emit-llvm proven.cpp -c -o proven.bc 